@@ -38,6 +38,7 @@
 #include <ostream>
 #include "lima/Debug.h"
 #include "XhClient.h"
+#include "XhFrameProcessor.h"
 
 using namespace std;
 
@@ -46,6 +47,8 @@ namespace Xh {
 
 const int xPixelSize = 1;
 const int yPixelSize = 1;
+const int DEFAULT_CHUNK_BYTES = 16 * 1024 * 1024;	///< default limit of a single read command
+const int MIN_STREAM_BYTES = 1024 * 1024;			///< smallest part of a read given to a data stream
 
 class BufferCtrlObj;
 
@@ -53,7 +56,7 @@ class BufferCtrlObj;
  * \class Camera
  * \brief object controlling the Xh camera
  *******************************************************************/
-class Camera {
+class Camera : public HwMaxImageSizeCallbackGen {
 DEB_CLASS_NAMESPC(DebModCamera, "Camera", "Xh");
 
 public:
@@ -84,6 +87,7 @@ Camera(string hostname, int port, string configName);
 	void stopAcq();
 	void getStatus(XhStatus& status);
 	int getNbHwAcquiredFrames();
+	void getAcqError(string& error);
 
 	// -- detector info object
 	void getImageType(ImageType& type);
@@ -97,6 +101,11 @@ Camera(string hostname, int port, string configName);
 	// -- Buffer control object
 	HwBufferCtrlObj* getBufferCtrlObj();
 
+	// -- Roi control object
+	void checkRoi(const Roi& set_roi, Roi& hw_roi);
+	void setRoi(const Roi& set_roi);
+	void getRoi(Roi& hw_roi);
+
 	//-- Synch control object
 	void setTrigMode(TrigMode mode);
 	void getTrigMode(TrigMode& mode);
@@ -136,6 +145,12 @@ Camera(string hostname, int port, string configName);
 		XhESRF1136MHz			///> ESRF Clock settings for RF div 31 = 11.3 MHz
 	};
 
+	enum FrameWaitType {
+		XhWaitPoll,					///> Poll the timing status every ms
+		XhWaitAdaptive,				///> Poll at an interval derived from the programmed frame time
+		XhWaitServer				///> Block in the server until the next frame completes (falls back to XhWaitAdaptive)
+	};
+
 	enum TriggerOutputType {
 		XhTrigOut_dc,				///> DC value from software polarity control only
 		XhTrigOut_wholeGroup,		///> Asserted for full duration of enabled groups
@@ -187,10 +202,20 @@ Camera(string hostname, int port, string configName);
 		bool allowExcess;				///> Allow programming of more frame than will fit in DRAM, for manual probing
  	};
 
+	struct XhTimingGroup {
+	public:
+		int nframes;					///> Number of frames
+		int nscans;						///> Number of scans per frame (0 to calc maximum possible)
+		int intTime;					///> Integration time (clock cycles)
+		XhTimingParameters timingParams;	///> Additional timing parameters
+	};
+
 	vector<string> getDebugMessages();
 	void sendCommand(string cmd);
 	void shutDown(string cmd);
 	void uninterleave(bool uninterleave);
+	void setClientUninterleave(bool client);
+	void getClientUninterleave(bool& client);
 	void set16BitReadout(bool mode);
 	void setDeadPixels(int first, int num, bool reset=false);
 	void setXDelay(int value);
@@ -208,6 +233,9 @@ Camera(string hostname, int port, string configName);
 
 	void setDefaultTimingParameters(XhTimingParameters& timingParams);
 	void setTimingGroup(int groupNum, int nframes, int nscans, int intTime, bool last, const XhTimingParameters& timingParams);
+	void setTimingGroups(const vector<XhTimingGroup>& groups);
+	void beginSetup();
+	void endSetup();
 	void modifyTimingGroup(int group_num, int fixed_reset=-1, bool last=false, bool allowExcess=false);
 	void setTimingOrbit(int delay, bool use_falling_edge=false);
 	void getTimingInfo(unsigned int* buff, int firstParam, int nParams, int firstGroup, int nGroups);
@@ -229,24 +257,108 @@ Camera(string hostname, int port, string configName);
 	void getNbScans(int& nb_scans);
 	void getTotalFrames(int& nframes);
 	void getMaxFrames(string& nframes);
+
+	void setPersistentDataConnection(bool persistent);
+	void getPersistentDataConnection(bool& persistent);
+	void setSharedMemoryData(bool enable);
+	void getSharedMemoryData(bool& enable);
+	void setControlConnection(bool enable);
+	void getControlConnection(bool& enable);
+	void setDataStreams(int nb_streams);
+	void getDataStreams(int& nb_streams);
+	void setAutoReconnect(bool enable);
+	void getAutoReconnect(bool& enable);
+	void setReadChunkSize(int max_frames, int max_bytes);
+	void getReadChunkSize(int& max_frames, int& max_bytes);
+	void setDataSocketOptions(int rcvbuf, bool quickack=false, int busy_poll=0);
+	void getDataSocketOptions(int& rcvbuf, bool& quickack, int& busy_poll);
+	void getTransferRate(double& last, double& mean);
+	void startTrace(const string& filename);
+	void stopTrace();
+	void setFrameWaitMode(FrameWaitType mode);
+	void getFrameWaitMode(FrameWaitType& mode);
+
+	void setCorrection(bool enable);
+	void getCorrection(bool& enable);
+	void setDark(double exp_time, const float* dark, int npixels);
+	void clearDarks();
+	void setGain(const float* gain, int npixels);
+	void clearGain();
+	void setDeadPixelInterpolation(bool enable);
+	void getDeadPixelInterpolation(bool& enable);
+	// Bpp32 frames hold the sum of the accumulated frames, Bpp32F frames the mean
+	void setAccumulation(int nb_frames);
+	void getAccumulation(int& nb_frames);
+	void setAccumulationShift(int shift);
+	void getAccumulationShift(int& shift);
+	void setConcatFrames(int nb_frames);
+	void getConcatFrames(int& nb_frames);
+
 	
 
 private:
+	void connect();
+	void probeServerWait();
+	void checkConnection();
+	void reconnect(bool force=false);
+	void configure(const string& key, const string& cmd, int group=-1, int* value=0);
+	void journal(const string& key, const string& cmd, int group=-1);
+	void forget(const string& prefix);
+	void forgetGroups(int first);
+	void readFrames(const struct iovec* iov, int iovcnt, int frame_nb, int nframes);
+	string readCmd(int frame_nb, int nframes);
+	void transferDone(long long nbytes, double seconds);
+	void connectStreams();
+	void disconnectStreams();
+	void waitStatus(XhStatus& status, int nframes);
+	int getPollInterval();
+	int getChunkFrames(int nframes, int frame_size);
+	int readoutWordSize() const;
+	void openDataHandle(bool uninterleave);
+	void connectControl();
+	XhClient* controlClient();
+	double clockPeriod() const;
+	bool getFrameTimestamp(int frame_nb, double& timestamp) const;
+	void checkTimingGroups(const vector<XhTimingGroup>& groups);
+	string timingGroupCmd(int groupNum, int nframes, int nscans, int intTime, bool last, const XhTimingParameters& timingParams);
+	void groupProgrammed(int groupNum, int nframes, int nscans, int intTime, bool last, const XhTimingParameters& timingParams,
+			int num_frames);
+
 	// xh specific
 	XhClient *m_xh;
+	XhClient *m_ctrl;		// status and slow-control connection
 	string m_hostname;
 	int m_port;
 	string m_configName;
 	string m_sysName;
 
 	int m_uninterleave;
+	bool m_client_uninterleave;	// un-interleave in AcqThread rather than in the server
+	bool m_handle_uninterleave;	// m_openHandle was opened with un-interleave
 	int m_npixels;
+	int m_roi_x;			// first pixel read from each frame
+	int m_roi_width;		// pixels read from each frame
 	int m_nb_groups;
 	int m_openHandle;
+	bool m_persistent_data;
+	bool m_shared_memory;	// frames read from shared memory, server on this host
+	bool m_readout16;		// detector in 16 bit readout mode, data read as 'raw'
+	bool m_control_connection;
+	int m_chunk_frames;		// most frames per read command, 0 for no limit
+	int m_chunk_bytes;		// most bytes per read command, 0 for no limit
+	int m_nb_accumulate;	// detector frames summed in a strip
+	int m_acc_shift;		// right shift of the sums in Bpp32 frames
+	int m_nb_concat;		// strips in a LImA frame
 
 	class AcqThread;
+	class DispatchThread;
+	class StreamThread;
 
 	AcqThread *m_acq_thread;
+	DispatchThread *m_dispatch_thread;
+	vector<StreamThread*> m_streams;	// extra data connections of split reads
+	int m_nb_streams;		// data connections a large read is split over
+	Mutex m_stream_mutex;	// one split read at a time
 	TrigMode m_trigger_mode;
 	double m_exp_time;
 	ImageType m_image_type;
@@ -254,15 +366,55 @@ private:
 	bool m_thread_running;
 	bool m_wait_flag;
 	bool m_quit;
-	int m_acq_frame_nb; // nos of frames acquired
+	int m_acq_frame_nb; // nos of frames acquired, under m_cond
+	string m_acq_error;	// error which ended the acquisition, under m_cond
 	mutable Cond m_cond;
 	XhTimingParameters m_timingParams;
 	int m_nb_scans;
 	int m_clock_mode;
+	FrameWaitType m_frame_wait;
+	bool m_server_wait;		// true if the server supports wait-frames, probed on connect
+	double m_frame_time;	// shortest programmed frame time (seconds)
+
+	// programmed timing group, to derive the frame timestamps
+	struct GroupTiming {
+		int nframes;
+		int first_frame;	// first frame of the group in the acquisition
+		long long start;	// start of the group (clock cycles), -1 if it depends on a trigger
+		int group_delay;
+		int frame_delay;
+		int period;			// frame period (clock cycles), 0 if it depends on a trigger
+	};
+	vector<GroupTiming> m_group_timing;
+	XhBatch m_setup_batch;	// commands queued between beginSetup and endSetup
+
+	// configuration command applied, replayed after a reconnect
+	struct JournalEntry {
+		string key;			// the setting, a later command for it replaces this one
+		string cmd;
+		int group;			// timing group programmed or modified, -1 if none
+	};
+	vector<JournalEntry> m_journal;	// in the order applied
+	Mutex m_journal_mutex;	// journal and reconnection
+	bool m_auto_reconnect;
+	bool m_in_setup;		// between beginSetup and endSetup
+
+	// data throughput, MB/s
+	Mutex m_rate_mutex;
+	double m_last_rate;
+	long long m_read_bytes;	// read since prepareAcq
+	double m_read_time;
+	XhTraceWriter* m_trace;	// records the traffic of all the clients, 0 if none
+	string m_status_cmd;	// read-status command, built once
+	string m_wait_cmd;		// wait-frames command buffer
+	string m_status_str;	// last status reply of the acquisition thread
+	Mutex m_poll_mutex;		// getStatus calls, one at a time
+	string m_poll_str;		// last getStatus reply
 	//double timearray[3] ;
 	
 	// Buffer control object
 	SoftBufferCtrlObj m_bufferCtrlObj;
+	FrameProcessor m_processor;
 
 };
 
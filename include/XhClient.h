@@ -29,15 +29,124 @@
 #define XHCLIENT_CPP_
 
 #include <netinet/in.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <deque>
+#include <list>
 #include "lima/Debug.h"
+#include "lima/ThreadUtils.h"
+#include "XhTrace.h"
 
 using namespace std;
 
 namespace lima {
 namespace Xh {
 
-const int RD_BUFF = 1000;	// Read buffer for more efficient recv
+const int RD_BUFF = 65536;	// Receive buffer of the command socket, grows for longer lines
+const uint32_t DATA_STREAM_MAGIC = 0x58484453;	// 'XHDS' marks a block on a persistent data stream
 
+/*
+ * Header sent by the server in front of each block on a persistent data stream
+ */
+struct DataStreamHeader {
+	uint32_t magic;
+	uint32_t nbytes;
+};
+
+class XhClient;
+
+/*
+ * Receive buffer of the command socket. recv() fills the free space at the
+ * end, complete lines are split off the front with memchr and parsed in
+ * place. Once the end is reached the partial line left is moved back to the
+ * start, so the buffer is reused as a ring without lines wrapping around.
+ */
+class XhLineBuffer {
+public:
+	XhLineBuffer(int size=RD_BUFF);
+
+	char* getSpace(int& len);
+	void fill(int len);
+	bool nextLine(const char*& line, int& len);
+	void clear();
+
+private:
+	vector<char> m_buff;
+	int m_head;			// first byte not parsed
+	int m_tail;			// end of the data received
+};
+
+/*
+ * Response to a command sent with XhClient::sendAsync, filled in by the I/O
+ * thread of the client. The reply must stay in place until it is done.
+ */
+class XhReply {
+public:
+	enum ReturnType {
+		XhReturnInt,		// '* ' integer, negative on error
+		XhReturnDouble,		// '* ' double, nan on error
+		XhReturnString		// '* ' string, "(null)" on error
+	};
+
+	/*
+	 * Called from the I/O thread of the client when the response is there.
+	 * It must not wait for other commands sent on the same client.
+	 */
+	class Callback {
+	public:
+		virtual ~Callback() {}
+		virtual void replyReady(const XhReply& reply) = 0;
+	};
+
+	XhReply(ReturnType type=XhReturnInt);
+
+	bool wait(double timeout=-1.) const;
+
+	string cmd;				// command sent, empty for the blocking calls
+	ReturnType type;
+	bool ok;
+	int ivalue;
+	double dvalue;
+	string svalue;
+	string error;			// server error message if !ok
+	int progress;			// last '@' timebar of the command ("done outoff"), 0 if none
+	int progress_total;
+
+private:
+	friend class XhClient;
+	XhClient* m_client;		// client it was sent on, 0 if not sent
+	bool m_done;
+};
+
+/*
+ * Commands sent back to back by XhClient, without waiting for the prompt
+ * between them. The responses are matched to the commands in order and each
+ * command gets its own return value or error.
+ */
+class XhBatch {
+public:
+	XhBatch() : m_nb_sent(0) {}
+
+	int add(const string& cmd, XhReply::ReturnType type=XhReply::XhReturnInt);
+	void clear();
+	int size() const { return m_results.size(); }
+	const XhReply& operator[](int i) const { return m_results[i]; }
+	int getNbErrors() const;
+	string getErrors() const;
+
+private:
+	friend class XhClient;
+	deque<XhReply> m_results;	// a deque keeps the replies in place while the batch grows
+	int m_nb_sent;			// commands already sent
+};
+
+/*
+ * Client of da.server. Commands are written and responses parsed by one I/O
+ * thread per client, waiting on the command socket with epoll, so that any
+ * number of threads can have commands in flight. The blocking calls send a
+ * command and wait for its reply. Data blocks are read by the caller from the
+ * data socket.
+ */
 class XhClient {
 DEB_CLASS_NAMESPC(DebModCamera, "XhClient", "Xh");
 
@@ -45,55 +154,111 @@ public:
 	XhClient();
 	~XhClient();
 
-	void sendNowait(string cmd);
-	void sendWait(string cmd);
-	void sendWait(string cmd, int& value);
-	void sendWait(string cmd, double& value);
-	void sendWait(string cmd, string& value);
-
-	int waitForResponse(string& value);
-	int waitForResponse(double& value);
-	int waitForResponse(int& value);
+	void sendAsync(const string& cmd, XhReply& reply);
+	void sendAsync(const string& cmd, XhReply::Callback& cb, XhReply::ReturnType type=XhReply::XhReturnInt);
+	void sendNowait(const string& cmd);
+	void sendWait(const string& cmd);
+	void sendWait(const string& cmd, int& value);
+	void sendWait(const string& cmd, double& value);
+	void sendWait(const string& cmd, string& value);
+	void sendRead(const string& cmd, const struct iovec* iov, int iovcnt);
+	void sendBatch(XhBatch& batch);
+	void beginBatch(XhBatch& batch);
+	void endBatch();
 
 	int connectToServer (const string hostname, int port);
 	void disconnectFromServer();
+	bool isConnected() const;
 	int initServerDataPort();
-	void getData(void* bptr, int num);
+	int setDataStream(bool persistent);
+	bool isDataStream() const;
+	int setSharedMemory(size_t size);
+	size_t getSharedMemorySize() const;
+	void setDataSocketOptions(int rcvbuf, bool quickack, int busy_poll);
+	void getDataSocketOptions(int& rcvbuf, bool& quickack, int& busy_poll) const;
+	int getData(void* bptr, int num);
+	int getData(const struct iovec* iov, int iovcnt);
 	string getErrorMessage() const;
 	vector<string> getDebugMessages() const;
+	void setTrace(XhTraceWriter* trace, int conn=0);
 
 private:
+	friend class XhReply;
+	class IoThread;
+
+	// a command queued or in flight
+	struct Request {
+		const string* cmd;			// in the reply, or the caller's for the blocking calls
+		XhReply* reply;				// where the response goes
+		XhReply::Callback* cb;		// called with the reply, 0 if none
+		XhReply own;				// reply of commands sent without one
+	};
+
 	mutable Cond m_cond;
 	bool m_valid;						// true if connected
 	int m_skt;							// socket for commands */
 	struct sockaddr_in m_remote_addr;	// address of remote server */
 	int m_data_port;					// our data port
 	int m_data_listen_skt;				// data socket we listen on
-	int m_prompts;						// counts # of prompts received
-	int m_num_read, m_cur_pos;
-	char m_rd_buff[RD_BUFF];
-	int m_just_read;
+	int m_data_skt;						// long-lived data connection, -1 if none
+	bool m_data_stream;					// true if the server keeps the data connection open
+	char* m_shm;						// shared memory the server puts the data blocks in, 0 if none
+	size_t m_shm_size;
+	int m_shm_seq;						// makes the shared memory names unique
+	Mutex m_read_mutex;					// keeps a read command and its data block together
+	vector<struct iovec> m_iov;			// scatter list being filled by readData
+	int m_rcvbuf;						// data socket receive buffer size, 0 for the default
+	bool m_quickack;					// TCP_QUICKACK on the data sockets
+	int m_busy_poll;					// SO_BUSY_POLL on the data sockets (us), 0 for none
 	string m_errorMessage;
 	vector<string> m_debugMessages;
+	XhBatch* m_batch;					// commands without return value queued here, 0 if none
+	XhTraceWriter* m_trace;				// records the traffic, 0 if none
+	int m_trace_conn;					// connection number in the trace
 
-	enum ServerResponse {
-		CLN_NEXT_PROMPT,		// '> ': at prompt
-		CLN_NEXT_ERRMSG, 		// '! ': read error message
-		CLN_NEXT_DEBUGMSG,		// '# ': read debugging message
-		CLN_NEXT_TIMEBAR,		// '@ ': time-bar message
-		CLN_NEXT_UNKNOWN,		// unknown line
-		CLN_NEXT_INTRET,		// '* ': read integer ret value
-		CLN_NEXT_DBLRET,		// '* ': read double ret value
-		CLN_NEXT_STRRET			// '* ': read string ret value
-	};
-	void sendCmd(const string cmd);
-	int waitForPrompt();
-	int nextLine(string *errmsg, int *ivalue, double *dvalue, string *svalue, int *done, int *outoff);
-	int getChar();
+	// shared with the I/O thread, under m_cond
+	IoThread* m_io_thread;
+	int m_epoll_fd;
+	int m_wake_fd;						// eventfd waking up the I/O thread
+	bool m_io_quit;
+	bool m_closing;						// disconnectFromServer waits for the I/O thread to close
+	list<Request> m_requests;			// in the order sent
+	list<Request> m_spare_requests;		// done, reused without allocating
+	int m_nb_requests;
+	int m_nb_written;					// first requests moved to the output buffer
+	vector<string> m_cur_debug;			// debug messages of the response being read
+	string m_cur_error;					// error message of the response being read
+	bool m_at_prompt;					// prompt seen, response not yet
+	vector<Request> m_ready;			// completed requests with a callback
+
+	// I/O thread only
+	string m_out;						// commands not yet written
+	int m_out_pos;
+	bool m_want_out;					// waiting for EPOLLOUT
+	XhLineBuffer m_rd_buff;
+
+	void enqueue(const string& cmd, XhReply* reply, XhReply::Callback* cb, XhReply::ReturnType type, bool copy_cmd=true);
+	void sendRef(const string& cmd, XhReply& reply);
+	void wakeIoThread();
+	bool waitReply(const XhReply& reply, double timeout);
+	void queueBatch(XhBatch& batch);
+	void waitBatch(XhBatch& batch);
+	void flushBatch();
+	void ioLoop();
+	bool writeOut(int skt);
+	void parseInput();
+	void parseLine(const char* line, int len);
+	void completeRequest(const char* value, int len);
+	void connectionLost(const string& msg);
+	int connectUnix(const string& path);
+	int acceptData();
+	void tuneDataSocket(int skt);
+	void releaseSharedMemory();
+	int readData(int skt, const struct iovec* iov, int iovcnt, int num);
 
 	void errmsg_handler(const string errmsg);
 	void debugmsg_handler(const string msg);
-	void timebar_handler(int done, int outoff, const string errmsg);
+	void timebar_handler(int done, int outoff);
 	void error_handler(const string errmsg);
 };
 
@@ -0,0 +1,134 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2011
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+/*
+ * XhFrameProcessor.h
+ * Client side conversion of the frames read from da.server.
+ */
+
+#ifndef XHFRAMEPROCESSOR_H_
+#define XHFRAMEPROCESSOR_H_
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include "lima/Debug.h"
+#include "lima/Constants.h"
+
+namespace lima {
+namespace Xh {
+
+/*******************************************************************
+ * \class FrameProcessor
+ * \brief pixel conversions applied between the network and LImA buffers
+ *
+ * The static kernels convert the data read from da.server. An instance
+ * holds the dark and gain tables of the optional correction stage, which
+ * works in place on 32 bit frames: out = (raw - dark) * gain, as Bpp32
+ * clipped at 0 or as Bpp32F, and the dead pixel map used to interpolate
+ * the dead pixels from their good neighbours. In accumulation mode the
+ * detector frames are summed into 64 bit accumulators and the correction is
+ * applied once to each accumulated frame: Bpp32 frames get the sum, shifted
+ * right if asked, and Bpp32F frames the mean. A sum which overflows a Bpp32
+ * frame is refused when the frame is written.
+ *******************************************************************/
+class FrameProcessor {
+DEB_CLASS_NAMESPC(DebModCamera, "FrameProcessor", "Xh");
+
+public:
+	FrameProcessor();
+	~FrameProcessor();
+
+	void setCorrection(bool enable);
+	bool getCorrection() const;
+	void setDark(int int_time, const float* dark, int npixels);
+	void clearDarks();
+	void setGain(const float* gain, int npixels);
+	void clearGain();
+	void setDeadPixels(int first, int num, bool reset);
+	void setInterpolation(bool enable);
+	bool getInterpolation() const;
+	void setRoi(int x, int width);
+
+	void prepare(int int_time, int npixels, ImageType type, bool uninterleaved, int nb_accumulate=1, int acc_shift=0);
+	bool isActive() const;
+	void process(void* frame) const;
+	bool accumulate(const void* frame, bool word16);
+	void emit(void* frame);
+
+	enum SimdType {
+		XhSimdScalar,		///> plain C++ loops
+		XhSimdSSE2,			///> 128 bit SSE2 kernels
+		XhSimdAVX2			///> 256 bit AVX2 kernels
+	};
+
+	static void setSimd(SimdType simd);
+	static SimdType getSimd();
+	static SimdType getBestSimd();
+
+	static void widen16(const uint16_t* src, uint32_t* dst, int npixels);
+	static void deinterleave16(const uint16_t* src, uint16_t* dst, int npixels);
+	static void deinterleave32(const uint32_t* src, uint32_t* dst, int npixels);
+	static void correct32(const uint32_t* src, const float* dark, const float* gain, uint32_t* dst, int npixels);
+	static void correct32F(const uint32_t* src, const float* dark, const float* gain, float* dst, int npixels);
+	static void accumulate16(uint64_t* acc, const uint16_t* src, int npixels);
+	static void accumulate32(uint64_t* acc, const uint32_t* src, int npixels);
+	static void interpolate16(uint16_t* frame, const int32_t* pixel, const int32_t* left, const int32_t* right,
+			const float* weight, int n);
+	static void interpolate32(uint32_t* frame, const int32_t* pixel, const int32_t* left, const int32_t* right,
+			const float* weight, int n);
+	static void interpolate32F(float* frame, const int32_t* pixel, const int32_t* left, const int32_t* right,
+			const float* weight, int n);
+
+private:
+	void prepareInterpolation(int npixels, bool uninterleaved);
+
+	static SimdType s_simd;
+
+	bool m_correction;
+	std::map<int, std::vector<float> > m_darks;	// dark per integration time (clock cycles)
+	std::vector<float> m_gain;
+	std::vector<float> m_zero;			// dark of the acquisition when none is loaded
+	std::vector<float> m_one;			// gain of the acquisition when none is loaded
+	const float* m_cur_dark;
+	const float* m_cur_gain;
+	bool m_interpolation;
+	std::vector<uint8_t> m_dead;		// dead pixel map, in detector pixel order
+	std::vector<int32_t> m_interp_pixel;	// dead pixels of the acquisition, in frame order
+	std::vector<int32_t> m_interp_left;		// good pixel on the left of each dead pixel
+	std::vector<int32_t> m_interp_right;	// good pixel on the right of each dead pixel
+	std::vector<float> m_interp_weight;		// weight of the right pixel
+	int m_roi_x;						// first pixel of the frames
+	int m_roi_width;					// pixels in the frames, 0 for the full frame
+	int m_npixels;						// pixels in the frames
+	ImageType m_type;
+	bool m_active;
+	bool m_convert;						// dark and gain correction or Bpp32F output
+	int m_nb_accumulate;				// detector frames summed in a frame
+	int m_acc_count;					// detector frames in m_acc
+	int m_acc_shift;					// right shift of the sums in Bpp32 frames
+	std::vector<uint64_t> m_acc;		// accumulators
+};
+
+} // namespace Xh
+} // namespace lima
+
+#endif /* XHFRAMEPROCESSOR_H_ */
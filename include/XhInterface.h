@@ -96,6 +96,26 @@ private:
 	Camera& m_cam;
 };
 
+/*******************************************************************
+ * \class RoiCtrlObj
+ * \brief Control object providing Xh roi interface
+ *******************************************************************/
+
+class RoiCtrlObj: public HwRoiCtrlObj {
+DEB_CLASS_NAMESPC(DebModCamera, "RoiCtrlObj", "Xh");
+
+public:
+	RoiCtrlObj(Camera& cam);
+	virtual ~RoiCtrlObj();
+
+	virtual void checkRoi(const Roi& set_roi, Roi& hw_roi);
+	virtual void setRoi(const Roi& set_roi);
+	virtual void getRoi(Roi& hw_roi);
+
+private:
+	Camera& m_cam;
+};
+
 /*******************************************************************
  * \class Interface
  * \brief Xh hardware interface
@@ -121,6 +141,7 @@ private:
 	DetInfoCtrlObj m_det_info;
 	HwBufferCtrlObj*  m_bufferCtrlObj;
 	SyncCtrlObj m_sync;
+	RoiCtrlObj m_roi;
 };
 
 } // namespace Xh
@@ -0,0 +1,122 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2011
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+/*
+ * XhTrace.h
+ * Binary trace of the traffic between XhClient and da.server.
+ */
+
+#ifndef XHTRACE_H_
+#define XHTRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+#include "lima/Debug.h"
+#include "lima/ThreadUtils.h"
+
+namespace lima {
+namespace Xh {
+
+const uint32_t TRACE_MAGIC = 0x52544858;	// 'XHTR' at the start of a trace file
+const uint32_t TRACE_VERSION = 1;
+
+/*
+ * Header of a trace file
+ */
+struct XhTraceHeader {
+	uint32_t magic;
+	uint32_t version;
+	double start;			// time of the first record (seconds since the epoch)
+};
+
+/*
+ * Header of one record of a trace file, followed by len bytes of payload
+ */
+struct XhTraceRecord {
+	enum Type {
+		XhTraceConnect = 1,	///< connection opened, payload is "host:port"
+		XhTraceCommand,		///< command written, without its line feed
+		XhTraceServer,		///< bytes received on the command socket
+		XhTraceData			///< data block received
+	};
+	uint8_t type;
+	uint8_t conn;			// connection of the camera the record belongs to
+	uint16_t reserved;
+	uint32_t len;
+	double time;			// seconds from the start of the trace
+};
+
+/*******************************************************************
+ * \class XhTraceWriter
+ * \brief records the traffic of one or more XhClient in a trace file
+ *
+ * Thread safe, the clients of a camera share one writer and tell their
+ * records apart by connection number.
+ *******************************************************************/
+class XhTraceWriter {
+DEB_CLASS_NAMESPC(DebModCamera, "XhTraceWriter", "Xh");
+
+public:
+	XhTraceWriter(const std::string& filename);
+	~XhTraceWriter();
+
+	void record(int type, int conn, const void* data, size_t len);
+	void record(int type, int conn, const struct iovec* iov, int iovcnt, size_t len);
+	long long getNbBytes() const;
+	bool isFailed() const;
+
+private:
+	bool writeHeader(int type, int conn, size_t len);
+	bool writeData(const void* data, size_t len);
+
+	mutable Mutex m_mutex;
+	FILE* m_file;
+	double m_start;
+	long long m_nb_bytes;
+	bool m_failed;			// a write failed, nothing more is recorded
+};
+
+/*******************************************************************
+ * \class XhTraceReader
+ * \brief reads back the records of a trace file in order
+ *******************************************************************/
+class XhTraceReader {
+DEB_CLASS_NAMESPC(DebModCamera, "XhTraceReader", "Xh");
+
+public:
+	XhTraceReader(const std::string& filename);
+	~XhTraceReader();
+
+	bool next(XhTraceRecord& record, std::vector<char>& payload);
+	double getStartTime() const;
+
+private:
+	FILE* m_file;
+	double m_start;
+};
+
+} // namespace Xh
+} // namespace lima
+
+#endif /* XHTRACE_H_ */
@@ -31,7 +31,12 @@
 #include <unistd.h>
 #include <climits>
 #include <iomanip>
+#include <cstring>
+#include <cstdio>
+#include <sys/uio.h>
+#include <deque>
 #include "XhCamera.h"
+#include "XhStatusParser.h"
 #include "lima/Exceptions.h"
 #include "lima/Debug.h"
 
@@ -52,37 +57,182 @@ public:
 protected:
 	virtual void threadFunction();
 
+private:
+	void readBatch(StdBufferCbMgr& buffer_mgr, int first_frame, int nframes);
+	void readAccumulate(StdBufferCbMgr& buffer_mgr, int first_frame, int nframes);
+	char* stripPtr(StdBufferCbMgr& buffer_mgr, int strip);
+
+	Camera& m_cam;
+	vector<struct iovec> m_iov;		// frame buffers of the batch being read
+	vector<char> m_scratch;			// batch to be converted into the frame buffers
+	vector<char> m_frame;			// de-interleaved frame to be widened or accumulated
+};
+
+//---------------------------
+//- dispatch thread, hands the batches read by AcqThread to the buffer manager
+//---------------------------
+class Camera::DispatchThread: public Thread {
+DEB_CLASS_NAMESPC(DebModCamera, "Camera", "DispatchThread");
+public:
+	DispatchThread(Camera &aCam);
+	virtual ~DispatchThread();
+
+	void reset(int max_in_flight);
+	int getFreeFrames(int nframes);
+	void push(int first_frame, int nframes);
+	bool waitIdle();
+
+protected:
+	virtual void threadFunction();
+
+private:
+	struct Batch {
+		int first_frame;
+		int nframes;
+	};
+	static const int MAX_BATCHES = 4;	// queue depth between reader and dispatcher
+
+	Camera& m_cam;
+	Cond m_cond;
+	deque<Batch> m_queue;				// batches read, front one is being dispatched
+	int m_in_flight;					// frames read but not yet dispatched
+	int m_max_in_flight;				// frame buffers available to the reader
+	bool m_continue;					// false once newFrameReady asked to stop
+	bool m_quit;
+};
+
+//---------------------------
+//- stream thread, reads one part of a split read on its own connection
+//---------------------------
+class Camera::StreamThread: public Thread {
+DEB_CLASS_NAMESPC(DebModCamera, "Camera", "StreamThread");
+public:
+	StreamThread(Camera &aCam);
+	virtual ~StreamThread();
+
+	void connect(int conn);
+	XhClient& client() { return m_xh; }
+	void startRead(const string& cmd, const vector<struct iovec>& iov);
+	void waitRead();
+
+protected:
+	virtual void threadFunction();
+
 private:
 	Camera& m_cam;
+	XhClient m_xh;
+	Cond m_cond;
+	string m_cmd;
+	vector<struct iovec> m_iov;			// slice of the destination
+	bool m_busy;
+	string m_error;						// error of the last read, empty if none
+	bool m_quit;
 };
 
+/*
+ * Get the len bytes from offset of a scatter list
+ */
+static void sliceIov(const struct iovec* iov, int iovcnt, size_t offset, size_t len, vector<struct iovec>& slice) {
+	slice.clear();
+	for (int i = 0; i < iovcnt && len > 0; i++) {
+		if (offset >= iov[i].iov_len) {
+			offset -= iov[i].iov_len;
+			continue;
+		}
+		struct iovec v;
+		v.iov_base = (char*) iov[i].iov_base + offset;
+		v.iov_len = iov[i].iov_len - offset;
+		if (v.iov_len > len)
+			v.iov_len = len;
+		slice.push_back(v);
+		len -= v.iov_len;
+		offset = 0;
+	}
+}
+
 //---------------------------
 // @brief  Ctor
 //---------------------------
 
 Camera::Camera(string hostname, int port, string configName) : m_hostname(hostname), m_port(port), m_configName(configName),
-		m_sysName("'xh0'"), m_uninterleave(false), m_npixels(1024), m_image_type(Bpp32), m_nb_frames(0), m_acq_frame_nb(-1), m_bufferCtrlObj(){
+		m_sysName("'xh0'"), m_uninterleave(false), m_client_uninterleave(false), m_handle_uninterleave(false), m_npixels(1024), m_roi_x(0), m_roi_width(1024), m_nb_groups(0), m_openHandle(-1), m_persistent_data(false), m_shared_memory(false), m_readout16(false), m_control_connection(false),
+		m_chunk_frames(0), m_chunk_bytes(DEFAULT_CHUNK_BYTES), m_nb_accumulate(1), m_acc_shift(0), m_nb_concat(1), m_nb_streams(1), m_image_type(Bpp32), m_nb_frames(0), m_thread_running(false), m_wait_flag(true), m_acq_frame_nb(-1),
+		m_frame_wait(XhWaitPoll), m_server_wait(false), m_frame_time(0.), m_auto_reconnect(true), m_in_setup(false), m_last_rate(0.), m_read_bytes(0), m_read_time(0.), m_trace(0), m_bufferCtrlObj(){
 	DEB_CONSTRUCTOR();
 
 //	DebParams::setModuleFlags(DebParams::AllFlags);
 //	DebParams::setTypeFlags(DebParams::AllFlags);
 //	DebParams::setFormatFlags(DebParams::AllFlags);
+	m_xh = new XhClient();
+	m_ctrl = new XhClient();
+	try {
+		init();
+	} catch (Exception&) {
+		// the destructor is not called, nothing must be left behind
+		disconnectStreams();
+		delete m_ctrl;
+		delete m_xh;
+		delete m_trace;
+		throw;
+	}
+	// the threads use the clients, they start once the camera is connected
+	m_dispatch_thread = new DispatchThread(*this);
+	m_dispatch_thread->start();
 	m_acq_thread = new AcqThread(*this);
 	m_acq_thread->start();
-	m_xh = new XhClient();
-	init();
 }
 
 Camera::~Camera() {
 	DEB_DESTRUCTOR();
+	// the threads use the clients until they are joined
+	delete m_acq_thread;
+	delete m_dispatch_thread;
+	disconnectStreams();
+	m_ctrl->disconnectFromServer();
+	delete m_ctrl;
 	m_xh->disconnectFromServer();
 	delete m_xh;
-	delete m_acq_thread;
+	delete m_trace;
 }
 
 void Camera::init() {
 	DEB_MEMBER_FUNCT();
-	stringstream cmd1, cmd2, cmd3;
+	AutoMutex aLock(m_journal_mutex);
+	m_journal.clear();
+	connect();
+	m_roi_x = 0;
+	m_roi_width = m_npixels;
+	m_processor.setRoi(0, 0);
+	
+	//call setDefaultTimingParameters to initialize
+	setDefaultTimingParameters(m_timingParams);
+	//by default, 1 scan
+	m_nb_scans = 1;
+	m_clock_mode = 0;
+	// no timing program until the groups are set up again
+	m_nb_groups = 0;
+	m_group_timing.clear();
+	//timearray[0] = 20*1e-9;
+	//timearray[1] = 22*1e-9;
+	//timearray[2] = 22*1e-9;
+	DEB_TRACE() << " m_timingParams.trigMux : " << m_timingParams.trigMux;
+	
+}
+
+void Camera::reset() {
+	DEB_MEMBER_FUNCT();
+	disconnectStreams();
+	m_ctrl->disconnectFromServer();
+	m_xh->disconnectFromServer();
+	init();
+}
+
+/*
+ * Open the connections, load the configuration file and open the data handle
+ */
+void Camera::connect() {
+	DEB_MEMBER_FUNCT();
+	stringstream cmd1, cmd3, cmd4;
 	int dataPort;
 
 	if (m_xh->connectToServer(m_hostname, m_port) < 0) {
@@ -92,42 +242,161 @@ void Camera::init() {
 		THROW_HW_ERROR(Error) << "[ " << m_xh->getErrorMessage() << " ]";
 	}
 	DEB_TRACE() << "da.server assigned dataport " << dataPort;
+	cmd4 << "xstrip timing read-status " << m_sysName;
+	m_status_cmd = cmd4.str();
+	if (m_persistent_data && m_xh->setDataStream(true) < 0) {
+		DEB_WARNING() << "da.server does not support a persistent data connection, using connect-back";
+	}
+	if (m_shared_memory && m_xh->setSharedMemory(DEFAULT_CHUNK_BYTES) < 0) {
+		DEB_WARNING() << "Cannot use shared memory for the data [ " << m_xh->getErrorMessage() << " ], using the data connection";
+	}
+	probeServerWait();
+	if (m_control_connection) {
+		connectControl();
+	}
+	connectStreams();
 	if (m_configName.length() != 0) {
 		cmd1 << "~" << m_configName;
 		m_xh->sendWait(cmd1.str());
 	}
-	if (m_uninterleave) {
-		cmd2 << "xstrip open " << m_sysName << " un-interleave";
-		m_xh->sendWait(cmd2.str(), m_openHandle);
-	} else {
-		cmd2 << "xstrip open " << m_sysName;
-		m_xh->sendWait(cmd2.str(), m_openHandle);
-	}
-	if (m_openHandle < 0) {
+	m_openHandle = -1;
+	openDataHandle(m_uninterleave && !m_client_uninterleave);
+	cmd3 << "unif-get-nx " << m_openHandle;
+	m_xh->sendWait(cmd3.str(), m_npixels);
+	DEB_TRACE() << "configured pixels as " << m_npixels;
+}
+
+/*
+ * Find out if the server blocks in wait-frames. Older servers refuse the
+ * command, whatever their wording, and the frames are then polled for.
+ */
+void Camera::probeServerWait() {
+	DEB_MEMBER_FUNCT();
+	stringstream cmd;
+	cmd << "xstrip timing wait-frames " << m_sysName << " 0 0";
+	XhReply reply(XhReply::XhReturnString);
+	m_xh->sendAsync(cmd.str(), reply);
+	reply.wait();
+	if (!m_xh->isConnected()) {
 		THROW_HW_ERROR(Error) << "[ " << m_xh->getErrorMessage() << " ]";
-	} else {
-		DEB_TRACE() << "configured open path as " << m_openHandle;
-		cmd3 << "unif-get-nx " << m_openHandle;
-		m_xh->sendWait(cmd3.str(), m_npixels);
-		DEB_TRACE() << "configured pixels as " << m_npixels;
 	}
-	
-	//call setDefaultTimingParameters to initialize
-	setDefaultTimingParameters(m_timingParams);
-	//by default, 1 scan
-	m_nb_scans = 1;
-	m_clock_mode = 0;
-	//timearray[0] = 20*1e-9;
-	//timearray[1] = 22*1e-9;
-	//timearray[2] = 22*1e-9;
-	DEB_TRACE() << " m_timingParams.trigMux : " << m_timingParams.trigMux;
-	
+	m_server_wait = reply.ok;
+	if (!m_server_wait)
+		DEB_TRACE() << "da.server does not support wait-frames [ " << reply.error << " ]";
 }
 
-void Camera::reset() {
+/*
+ * Reconnect if the connection to the server was lost and auto-reconnect is on.
+ * Not during a setup sequence, endSetup() reconnects if needed.
+ */
+void Camera::checkConnection() {
+	if (m_auto_reconnect && !m_in_setup && (!m_xh->isConnected() || (m_control_connection && !m_ctrl->isConnected())))
+		reconnect();
+}
+
+/*
+ * Open the connections again and replay the configuration journal, pipelined.
+ * The detector is left as configured before the connection was lost, even if
+ * the server was restarted meanwhile. If force, the connections are opened
+ * again even if they are still up. Refused during an acquisition, whose
+ * threads use the connections: the acquisition fails on the lost connection
+ * and the next command after it reconnects.
+ */
+void Camera::reconnect(bool force) {
 	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_journal_mutex);
+	// another thread may have reconnected meanwhile
+	if (!force && m_xh->isConnected() && (!m_control_connection || m_ctrl->isConnected()))
+		return;
+	// startAcq holds the journal lock too, so no acquisition starts until the
+	// connections are back; the acquisition lock is not held over the network
+	AutoMutex cLock(m_cond.mutex());
+	if (m_thread_running || !m_wait_flag) {
+		THROW_HW_ERROR(Error) << "Cannot reconnect to da.server during an acquisition";
+	}
+	cLock.unlock();
+	double t0 = Timestamp::now();
+	if (!force)
+		DEB_WARNING() << "Connection to da.server lost, reconnecting";
+	disconnectStreams();
+	m_ctrl->disconnectFromServer();
 	m_xh->disconnectFromServer();
-	init();
+	connect();
+	XhBatch batch;
+	for (unsigned int i = 0; i < m_journal.size(); i++)
+		batch.add(m_journal[i].cmd);
+	m_xh->sendBatch(batch);
+	DEB_TRACE() << "replayed " << batch.size() << " commands in " << (Timestamp::now() - t0) * 1e3 << " ms";
+	if (batch.getNbErrors() != 0) {
+		THROW_HW_ERROR(Error) << batch.getNbErrors() << " of " << batch.size() << " configuration commands failed after reconnecting [ "
+				<< batch.getErrors() << "]";
+	}
+}
+
+/*
+ * Send a configuration command and record it in the journal under key,
+ * replacing the command recorded for the same setting. If the connection is
+ * lost, reconnect and send it again: the configuration commands can be
+ * repeated safely. group is the timing group the command programs, value
+ * receives the return value if not 0.
+ */
+void Camera::configure(const string& key, const string& cmd, int group, int* value) {
+	DEB_MEMBER_FUNCT();
+	int rc;
+	checkConnection();
+	try {
+		if (value)
+			m_xh->sendWait(cmd, *value);
+		else
+			m_xh->sendWait(cmd);
+	} catch (Exception&) {
+		if (!m_auto_reconnect || m_in_setup || m_xh->isConnected())
+			throw;
+		reconnect();
+		m_xh->sendWait(cmd, value ? *value : rc);
+	}
+	journal(key, cmd, group);
+}
+
+void Camera::journal(const string& key, const string& cmd, int group) {
+	AutoMutex aLock(m_journal_mutex);
+	for (unsigned int i = 0; i < m_journal.size(); i++) {
+		if (m_journal[i].key == key) {
+			m_journal.erase(m_journal.begin() + i);
+			break;
+		}
+	}
+	JournalEntry entry;
+	entry.key = key;
+	entry.cmd = cmd;
+	entry.group = group;
+	m_journal.push_back(entry);
+}
+
+/*
+ * Remove the settings whose key starts with prefix
+ */
+void Camera::forget(const string& prefix) {
+	AutoMutex aLock(m_journal_mutex);
+	for (unsigned int i = 0; i < m_journal.size();) {
+		if (m_journal[i].key.compare(0, prefix.length(), prefix) == 0)
+			m_journal.erase(m_journal.begin() + i);
+		else
+			i++;
+	}
+}
+
+/*
+ * Remove the timing groups from first on, which are programmed again
+ */
+void Camera::forgetGroups(int first) {
+	AutoMutex aLock(m_journal_mutex);
+	for (unsigned int i = 0; i < m_journal.size();) {
+		if (m_journal[i].group >= first)
+			m_journal.erase(m_journal.begin() + i);
+		else
+			i++;
+	}
 }
 
 void Camera::prepareAcq() {
@@ -137,29 +406,44 @@ void Camera::prepareAcq() {
 	DEB_TRACE() << " nb frames : " << m_nb_frames;
 	DEB_TRACE() << " nb scans  : " << m_nb_scans;
 	DEB_TRACE() << " exp time  : " << mexptime;
+	Roi roi(m_roi_x, 0, m_roi_width, m_nb_concat), hw_roi;
+	checkRoi(roi, hw_roi);
+	if (hw_roi != roi)
+		THROW_HW_ERROR(Error) << "Roi " << roi << " cannot be read with the current un-interleave mode, set it again";
+	int nb_hw_frames = m_nb_frames * m_nb_concat * m_nb_accumulate;
 	if (mexptime !=0 ){
-	   setTimingGroup(0,m_nb_frames,m_nb_scans,mexptime,1,m_timingParams);
+	   setTimingGroup(0,nb_hw_frames,m_nb_scans,mexptime,1,m_timingParams);
 	} else {
 		int total_frames;
 		getTotalFrames(total_frames);
-		if (m_nb_frames != total_frames)
+		if (nb_hw_frames != total_frames)
 			THROW_HW_ERROR(Error) << " Trying to collect a different number of frames than is currently configured ";		
 	}
-	
+	m_processor.prepare(mexptime, m_npixels, m_image_type, m_uninterleave, m_nb_accumulate, m_acc_shift);
+	AutoMutex aLock(m_rate_mutex);
+	m_read_bytes = 0;
+	m_read_time = 0.;
 }
 
 void Camera::startAcq() {
 	DEB_MEMBER_FUNCT();
 	stringstream cmd;
+	AutoMutex cLock(m_cond.mutex());
 	m_acq_frame_nb = 0;
+	m_acq_error.clear();
+	cLock.unlock();
 	StdBufferCbMgr& buffer_mgr = m_bufferCtrlObj.getBuffer();
 	buffer_mgr.setStartTimestamp(Timestamp::now());
 	cmd << "xstrip timing start " << m_sysName;
+	// a reconnect from another thread ends first, and is refused from now on
+	AutoMutex jLock(m_journal_mutex);
+	checkConnection();
 	m_xh->sendWait(cmd.str());
 	AutoMutex aLock(m_cond.mutex());
 	m_wait_flag = false;
 	m_quit = false;
 	m_cond.broadcast();
+	jLock.unlock();
 	// Wait that Acq thread start if it's an external trigger
 	while (m_trigger_mode == ExtTrigMult && !m_thread_running)
 		m_cond.wait();
@@ -175,76 +459,181 @@ void Camera::stopAcq() {
 
 void Camera::readFrame(void *bptr, int frame_nb, int nframes) {
 	DEB_MEMBER_FUNCT();
-	stringstream cmd;
-	int num, retval;
+	struct iovec iov;
+	iov.iov_base = bptr;
+	iov.iov_len = nframes * m_roi_width * readoutWordSize();
+	readFrames(&iov, 1, frame_nb, nframes);
+}
+
+/*
+ * Read nframes frames starting at frame_nb straight into the scatter list.
+ * Large reads are split into consecutive frame ranges, each read over its own
+ * data connection into its slice of the scatter list.
+ */
+void Camera::readFrames(const struct iovec* iov, int iovcnt, int frame_nb, int nframes) {
+	DEB_MEMBER_FUNCT();
 	DEB_TRACE() << "reading frame " << frame_nb;
-	if (m_uninterleave) {
+	AutoMutex aLock(m_stream_mutex);
+	double t0 = Timestamp::now();
+	size_t frame_size = m_roi_width * readoutWordSize();
+	long long nb_parts = (long long) nframes * frame_size / MIN_STREAM_BYTES;
+	if (nb_parts > (long long) m_streams.size() + 1)
+		nb_parts = m_streams.size() + 1;
+	if (nb_parts > nframes)
+		nb_parts = nframes;
+	if (nb_parts <= 1) {
+		m_xh->sendRead(readCmd(frame_nb, nframes), iov, iovcnt);
+		transferDone((long long) nframes * frame_size, Timestamp::now() - t0);
+		return;
+	}
+	// the first part is read on the data connection, the others by the stream threads
+	vector<struct iovec> slice;
+	for (int p = 1; p < nb_parts; p++) {
+		int first = p * nframes / nb_parts;
+		int n = (p + 1) * nframes / nb_parts - first;
+		sliceIov(iov, iovcnt, first * frame_size, n * frame_size, slice);
+		m_streams[p - 1]->startRead(readCmd(frame_nb + first, n), slice);
+	}
+	int n = nframes / nb_parts;
+	sliceIov(iov, iovcnt, 0, n * frame_size, slice);
+	string error;
+	try {
+		m_xh->sendRead(readCmd(frame_nb, n), &slice[0], slice.size());
+	} catch (Exception& e) {
+		error = e.getErrMsg();
+	}
+	for (int p = 1; p < nb_parts; p++) {
+		try {
+			m_streams[p - 1]->waitRead();
+		} catch (Exception& e) {
+			if (error.empty())
+				error = e.getErrMsg();
+		}
+	}
+	if (!error.empty()) {
+		THROW_HW_ERROR(Error) << error;
+	}
+	transferDone((long long) nframes * frame_size, Timestamp::now() - t0);
+}
+
+/*
+ * Account for a read of nbytes which took seconds, command round trip included
+ */
+void Camera::transferDone(long long nbytes, double seconds) {
+	DEB_MEMBER_FUNCT();
+	double rate = (seconds > 0.) ? nbytes / seconds * 1e-6 : 0.;
+	DEB_TRACE() << "read " << nbytes << " bytes in " << seconds * 1e3 << " ms, " << rate << " MB/s";
+	AutoMutex aLock(m_rate_mutex);
+	m_last_rate = rate;
+	m_read_bytes += nbytes;
+	m_read_time += seconds;
+}
+
+/*
+ * Read command for nframes frames from frame_nb of the current roi
+ */
+string Camera::readCmd(int frame_nb, int nframes) {
+	stringstream cmd;
+	if (m_handle_uninterleave && m_roi_width == m_npixels) {
 		cmd << "read 0 0 " << frame_nb << " " << m_npixels/2 << " 2 " << nframes << " from " << m_openHandle;
+	} else if (m_handle_uninterleave) {
+		// the roi is within one head, a row of the handle
+		int head = (m_roi_x >= m_npixels/2) ? 1 : 0;
+		cmd << "read " << m_roi_x - head * (m_npixels/2) << " " << head << " " << frame_nb << " " << m_roi_width << " 1 "
+				<< nframes << " from " << m_openHandle;
 	} else {
-		cmd << "read 0 0 " << frame_nb << " " << m_npixels << " 1 " << nframes <<" from " << m_openHandle;
+		cmd << "read " << m_roi_x << " 0 " << frame_nb << " " << m_roi_width << " 1 " << nframes <<" from " << m_openHandle;
 	}
-	if (m_image_type == Bpp16) {
-		num = nframes * m_npixels * sizeof(short) ;
+	if (m_readout16) {
 		cmd <<  " raw";
 	} else {
-		num = nframes * m_npixels * sizeof(int32_t);
 		cmd << " long";
 	}
-	AutoMutex aLock(m_cond.mutex());
-	m_xh->sendNowait(cmd.str());
-	m_xh->getData(bptr, num);
-	if (m_xh->waitForResponse(retval) < 0) {
-		THROW_HW_ERROR(Error) << "Waiting for response in readFrame";
-	}
-
-//	uint32_t *dptr;
-//	dptr = (uint32_t *)bptr;
-//	std::cout << *dptr << " " << *(dptr+1) << " " << *(dptr+2) << std::endl;
+	return cmd.str();
 }
 
 void Camera::getStatus(XhStatus& status) {
 	DEB_MEMBER_FUNCT();
-	stringstream cmd, parser;
-	string str;
-	unsigned pos, pos2;
-	cmd << "xstrip timing read-status " << m_sysName;
-	AutoMutex aLock(m_cond.mutex());
-	m_xh->sendWait(cmd.str(), str);
-	aLock.unlock();
-	DEB_TRACE() << "xh status " << str;
-	pos = str.find(":");
-	string state = str.substr (2, pos-2);
-	if (state.compare("Idle") == 0) {
-		status.state = XhStatus::Idle;
-	} else if (state.compare("Paused at frame") == 0) {
-		status.state = XhStatus::PausedAtFrame;
-	} else if (state.compare("Paused at group") == 0) {
-		status.state = XhStatus::PausedAtGroup;
-	} else if (state.compare("Paused at scan") == 0) {
-		status.state = XhStatus::PausedAtScan;
-	} else {
-		status.state = XhStatus::Running;
-	}
-	pos = str.find("=");
-	pos2 = str.find(",", pos);
-	std::stringstream ss1(str.substr(pos+1, pos2-pos));
-	ss1 >> status.group_num ;
-	pos = str.find("=", pos+1);
-	pos2 = str.find(",", pos);
-	std::stringstream ss2(str.substr(pos+1, pos2-pos));
-	ss2 >> status.frame_num;
-	pos = str.find("=", pos+1);
-	pos2 = str.find(",", pos);
-	std::stringstream ss3(str.substr(pos+1, pos2-pos));
-	ss3 >> status.scan_num;
-	pos = str.find("=", pos+1);
-	pos2 = str.find(",", pos);
-	std::stringstream ss4(str.substr(pos+1, pos2-pos));
-	ss4 >> status.cycle;
-	pos = str.find("=", pos+1);
-	pos2 = str.find(",", pos);
-	std::stringstream ss5(str.substr(pos+1, pos2-pos));
-	ss5 >> status.completed_frames;
+	checkConnection();
+	// the reply buffer is reused, a poll does not allocate
+	AutoMutex aLock(m_poll_mutex);
+	controlClient()->sendWait(m_status_cmd, m_poll_str);
+	parseStatus(m_poll_str.c_str(), status);
+}
+
+/*
+ * Get the timing status once at least nframes frames are complete or the
+ * detector is idle. Without server support this is a plain status poll.
+ * Only called from the acquisition thread, on the data connection.
+ */
+void Camera::waitStatus(XhStatus& status, int nframes) {
+	DEB_MEMBER_FUNCT();
+	if (m_frame_wait == XhWaitServer && m_server_wait) {
+		char cmd[128];
+		// bounded server wait so that stopAcq stays responsive
+		snprintf(cmd, sizeof(cmd), "xstrip timing wait-frames %s %d 100", m_sysName.c_str(), nframes);
+		m_wait_cmd.assign(cmd);
+		m_xh->sendWait(m_wait_cmd, m_status_str);
+		parseStatus(m_status_str.c_str(), status);
+		return;
+	}
+	m_xh->sendWait(m_status_cmd, m_status_str);
+	parseStatus(m_status_str.c_str(), status);
+}
+
+/*
+ * Parse a status reply such as
+ * "  Running: group=0, frame=3, scan=0, cycle=0, completed=3"
+ * in a single pass, without any allocation.
+ */
+void Xh::parseStatus(const char* str, Camera::XhStatus& status) {
+	typedef Camera::XhStatus XhStatus;
+	static const struct {
+		const char* name;
+		size_t len;
+		XhStatus::XhState state;
+	} states[] = {
+		{"Idle", 4, XhStatus::Idle},
+		{"Paused at frame", 15, XhStatus::PausedAtFrame},
+		{"Paused at group", 15, XhStatus::PausedAtGroup},
+		{"Paused at scan", 14, XhStatus::PausedAtScan},
+	};
+	int* fields[] = {&status.group_num, &status.frame_num, &status.scan_num, &status.cycle, &status.completed_frames};
+	const char* p = str;
+
+	// the state name runs from the third character up to the ':'
+	for (int i = 0; i < 2 && *p; i++)
+		p++;
+	const char* state = p;
+	while (*p && *p != ':')
+		p++;
+	size_t len = p - state;
+	status.state = XhStatus::Running;
+	for (size_t i = 0; i < sizeof(states) / sizeof(states[0]); i++) {
+		if (len == states[i].len && memcmp(state, states[i].name, len) == 0) {
+			status.state = states[i].state;
+			break;
+		}
+	}
+	// then the counters, in order, each after an '='
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		while (*p && *p != '=')
+			p++;
+		if (*p == '\0') {
+			*fields[i] = 0;
+			continue;
+		}
+		p++;
+		while (*p == ' ')
+			p++;
+		bool neg = (*p == '-');
+		if (neg)
+			p++;
+		int value = 0;
+		while (*p >= '0' && *p <= '9')
+			value = value * 10 + (*p++ - '0');
+		*fields[i] = neg ? -value : value;
+	}
 
 	DEB_TRACE() << "XhStatus.state is [" << status.state << "]";
 	DEB_TRACE() << "XhStatus group " << status.group_num << " frame " << status.frame_num << " scan " << status.scan_num;
@@ -253,9 +642,21 @@ void Camera::getStatus(XhStatus& status) {
 
 int Camera::getNbHwAcquiredFrames() {
 	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_cond.mutex());
 	return m_acq_frame_nb;
 }
 
+/**
+ * Get the error which ended the last acquisition, such as a lost connection.
+ *
+ * @param[out] error The error message, empty if the acquisition did not fail
+ */
+void Camera::getAcqError(string& error) {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_cond.mutex());
+	error = m_acq_error;
+}
+
 void Camera::AcqThread::threadFunction() {
 	DEB_MEMBER_FUNCT();
 	AutoMutex aLock(m_cam.m_cond.mutex());
@@ -276,55 +677,164 @@ void Camera::AcqThread::threadFunction() {
 		m_cam.m_cond.broadcast();
 		aLock.unlock();
 
+		// frames read ahead of the dispatcher must not wrap onto frames not yet dispatched
+		int nb_buffers, nb_concat;
+		buffer_mgr.getNbBuffers(nb_buffers);
+		buffer_mgr.getNbConcatFrames(nb_concat);
+		m_cam.m_dispatch_thread->reset(nb_buffers * nb_concat);
+
+		// read_frame_nb counts detector frames, nb_acc of them are summed in a strip
+		// and nb_concat strips make a LImA frame
 		bool continueFlag = true;
-		while (continueFlag && (!m_cam.m_nb_frames || m_cam.m_acq_frame_nb < m_cam.m_nb_frames)) {
-			XhStatus status;
-			m_cam.getStatus(status);
-			if (status.state == status.Idle || (status.completed_frames > m_cam.m_acq_frame_nb) ) {
-				int nframes;
-				if (status.state == status.Idle) {
-					nframes = m_cam.m_nb_frames - m_cam.m_acq_frame_nb;
+		int read_frame_nb = 0;
+		int nb_acc = m_cam.m_nb_accumulate;
+		int per_frame = nb_acc * m_cam.m_nb_concat;
+		int nb_hw_frames = m_cam.m_nb_frames * per_frame;
+		try {
+			while (continueFlag && (!nb_hw_frames || read_frame_nb < nb_hw_frames)) {
+				XhStatus status;
+				m_cam.waitStatus(status, read_frame_nb + 1);
+				if (status.state == status.Idle || (status.completed_frames > read_frame_nb) ) {
+					int nframes;
+					if (status.state == status.Idle) {
+						nframes = nb_hw_frames - read_frame_nb;
+					} else {
+						nframes = status.completed_frames - read_frame_nb;
+					}
+					// detector frames up to the end of the LImA frames which have a free buffer
+					int pending = read_frame_nb % per_frame;
+					int nb_out = m_cam.m_dispatch_thread->getFreeFrames((pending + nframes + per_frame - 1) / per_frame);
+					if (nb_out == 0) {
+						continueFlag = false;
+						break;
+					}
+					if (nframes > nb_out * per_frame - pending)
+						nframes = nb_out * per_frame - pending;
+					nframes = m_cam.getChunkFrames(nframes, m_cam.m_roi_width * m_cam.readoutWordSize());
+					if (nb_acc > 1)
+						readAccumulate(buffer_mgr, read_frame_nb, nframes);
+					else
+						readBatch(buffer_mgr, read_frame_nb, nframes);
+					// LImA frames completed by this batch
+					int first_out = read_frame_nb / per_frame;
+					nb_out = (read_frame_nb + nframes) / per_frame - first_out;
+					if (nb_out > 0)
+						m_cam.m_dispatch_thread->push(first_out, nb_out);
+					read_frame_nb += nframes;
 				} else {
-					nframes = status.completed_frames - m_cam.m_acq_frame_nb;
-				}
-				int32_t *dptr, *baseptr;
-				int npoints = m_cam.m_npixels;
-				if (m_cam.m_image_type == Bpp16) {
-					npoints /= 2;
-				}
-				//std::cout << "malloc " << nframes << " * " << npoints << std::endl; 
-				dptr = (int32_t*)malloc(nframes*npoints * sizeof(int32_t));
-				baseptr = dptr;
-				m_cam.readFrame(dptr, m_cam.m_acq_frame_nb, nframes);
-				for (int i=0; i<nframes; i++) {
-					int32_t* bptr = (int32_t*)buffer_mgr.getFrameBufferPtr(m_cam.m_acq_frame_nb);
-					memcpy(bptr,dptr,npoints*sizeof(int32_t));
-					dptr += npoints;
-					HwFrameInfoType frame_info;
-					frame_info.acq_frame_nb = m_cam.m_acq_frame_nb;
-					continueFlag = buffer_mgr.newFrameReady(frame_info);
-					DEB_TRACE() << "acqThread::threadFunction() newframe ready ";
-					++m_cam.m_acq_frame_nb;
-				}
-				free(baseptr);
-			} else {
-				AutoMutex aLock(m_cam.m_cond.mutex());
-				continueFlag = !m_cam.m_wait_flag;
-				if (m_cam.m_wait_flag) {
-					stringstream cmd;
-					cmd << "xstrip timing stop " << m_cam.m_sysName;
-					m_cam.m_xh->sendWait(cmd.str());
-				} else {
-					usleep(1000);
+					AutoMutex aLock(m_cam.m_cond.mutex());
+					continueFlag = !m_cam.m_wait_flag;
+					if (m_cam.m_wait_flag) {
+						stringstream cmd;
+						cmd << "xstrip timing stop " << m_cam.m_sysName;
+						m_cam.m_xh->sendWait(cmd.str());
+					} else {
+						aLock.unlock();
+						int interval = m_cam.getPollInterval();
+						if (interval > 0)
+							usleep(interval);
+					}
 				}
+				DEB_TRACE() << "read " << read_frame_nb << " frames, required " << nb_hw_frames << " frames";
 			}
-			DEB_TRACE() << "acquired " << m_cam.m_acq_frame_nb << " frames, required " << m_cam.m_nb_frames << " frames";
+		} catch (Exception& e) {
+			// a lost connection ends the acquisition, the threads go back to waiting
+			DEB_ERROR() << "Acquisition failed: " << e.getErrMsg();
+			AutoMutex eLock(m_cam.m_cond.mutex());
+			m_cam.m_acq_error = e.getErrMsg();
 		}
+		m_cam.m_dispatch_thread->waitIdle();
 		aLock.lock();
 		m_cam.m_wait_flag = true;
 	}
 }
 
+/*
+ * Address of a strip in the frame buffers, nb_concat strips make a LImA frame
+ */
+char* Camera::AcqThread::stripPtr(StdBufferCbMgr& buffer_mgr, int strip) {
+	int nb_concat = m_cam.m_nb_concat;
+	int strip_size = m_cam.m_roi_width * FrameDim::getImageTypeDepth(m_cam.m_image_type);
+	return (char*)buffer_mgr.getFrameBufferPtr(strip / nb_concat) + (strip % nb_concat) * strip_size;
+}
+
+/*
+ * Read nframes frames starting at first_frame into their strips of the frame buffers
+ */
+void Camera::AcqThread::readBatch(StdBufferCbMgr& buffer_mgr, int first_frame, int nframes) {
+	DEB_MEMBER_FUNCT();
+	int npixels = m_cam.m_roi_width;
+	bool widen = m_cam.m_readout16 && m_cam.m_image_type != Bpp16;
+	bool deinterleave = m_cam.m_uninterleave && !m_cam.m_handle_uninterleave;
+	if (widen || deinterleave) {
+		// read into the scratch buffer, then convert each frame into its buffer
+		int frame_size = npixels * m_cam.readoutWordSize();
+		m_scratch.resize(nframes * frame_size);
+		if (widen && deinterleave)
+			m_frame.resize(npixels * sizeof(uint16_t));
+		m_cam.readFrame(&m_scratch[0], first_frame, nframes);
+		for (int i=0; i<nframes; i++) {
+			void* bptr = stripPtr(buffer_mgr, first_frame + i);
+			const char* src = &m_scratch[i * frame_size];
+			if (widen && deinterleave) {
+				FrameProcessor::deinterleave16((const uint16_t*)src, (uint16_t*)&m_frame[0], npixels);
+				FrameProcessor::widen16((const uint16_t*)&m_frame[0], (uint32_t*)bptr, npixels);
+			} else if (widen) {
+				FrameProcessor::widen16((const uint16_t*)src, (uint32_t*)bptr, npixels);
+			} else if (m_cam.m_readout16) {
+				FrameProcessor::deinterleave16((const uint16_t*)src, (uint16_t*)bptr, npixels);
+			} else {
+				FrameProcessor::deinterleave32((const uint32_t*)src, (uint32_t*)bptr, npixels);
+			}
+		}
+		return;
+	}
+	// read straight into the frame buffers, merging consecutive
+	// buffers which are contiguous in memory
+	int frame_size = npixels * m_cam.readoutWordSize();
+	m_iov.clear();
+	for (int i=0; i<nframes; i++) {
+		char* bptr = stripPtr(buffer_mgr, first_frame + i);
+		if (!m_iov.empty() && (char*)m_iov.back().iov_base + m_iov.back().iov_len == bptr) {
+			m_iov.back().iov_len += frame_size;
+		} else {
+			struct iovec iov;
+			iov.iov_base = bptr;
+			iov.iov_len = frame_size;
+			m_iov.push_back(iov);
+		}
+	}
+	m_cam.readFrames(&m_iov[0], m_iov.size(), first_frame, nframes);
+}
+
+/*
+ * Read nframes detector frames starting at first_frame into the accumulators,
+ * writing each completed sum to its strip of the frame buffers
+ */
+void Camera::AcqThread::readAccumulate(StdBufferCbMgr& buffer_mgr, int first_frame, int nframes) {
+	DEB_MEMBER_FUNCT();
+	int npixels = m_cam.m_roi_width;
+	bool word16 = m_cam.m_readout16;
+	bool deinterleave = m_cam.m_uninterleave && !m_cam.m_handle_uninterleave;
+	int frame_size = npixels * m_cam.readoutWordSize();
+	m_scratch.resize(nframes * frame_size);
+	if (deinterleave)
+		m_frame.resize(frame_size);
+	m_cam.readFrame(&m_scratch[0], first_frame, nframes);
+	for (int i=0; i<nframes; i++) {
+		const char* src = &m_scratch[i * frame_size];
+		if (deinterleave && word16) {
+			FrameProcessor::deinterleave16((const uint16_t*)src, (uint16_t*)&m_frame[0], npixels);
+			src = &m_frame[0];
+		} else if (deinterleave) {
+			FrameProcessor::deinterleave32((const uint32_t*)src, (uint32_t*)&m_frame[0], npixels);
+			src = &m_frame[0];
+		}
+		if (m_cam.m_processor.accumulate(src, word16))
+			m_cam.m_processor.emit(stripPtr(buffer_mgr, (first_frame + i) / m_cam.m_nb_accumulate));
+	}
+}
+
 Camera::AcqThread::AcqThread(Camera& cam) :
 		m_cam(cam) {
 	AutoMutex aLock(m_cam.m_cond.mutex());
@@ -336,57 +846,339 @@ Camera::AcqThread::AcqThread(Camera& cam) :
 
 Camera::AcqThread::~AcqThread() {
 	AutoMutex aLock(m_cam.m_cond.mutex());
+	// a running acquisition stops at the next status poll
+	m_cam.m_wait_flag = true;
 	m_cam.m_quit = true;
 	m_cam.m_cond.broadcast();
 	aLock.unlock();
+	join();
 }
 
-void Camera::getImageType(ImageType& type) {
-	DEB_MEMBER_FUNCT();
-	type = m_image_type;
+Camera::DispatchThread::DispatchThread(Camera& cam) :
+		m_cam(cam), m_in_flight(0), m_max_in_flight(1), m_continue(true), m_quit(false) {
+	pthread_attr_setscope(&m_thread_attr, PTHREAD_SCOPE_PROCESS);
 }
 
-void Camera::setImageType(ImageType type) {
-	//this is what xh generates but may need Bpp32 for accummulate
-	DEB_MEMBER_FUNCT();
-	m_image_type = type;
+Camera::DispatchThread::~DispatchThread() {
+	AutoMutex aLock(m_cond.mutex());
+	m_quit = true;
+	m_cond.broadcast();
+	aLock.unlock();
+	join();
 }
 
+/*
+ * Prepare for a new acquisition with max_in_flight frame buffers
+ */
+void Camera::DispatchThread::reset(int max_in_flight) {
+	AutoMutex aLock(m_cond.mutex());
+	m_queue.clear();
+	m_in_flight = 0;
+	m_max_in_flight = (max_in_flight > 0) ? max_in_flight : 1;
+	m_continue = true;
+}
 
-void Camera::getDetectorType(std::string& type) {
-	DEB_MEMBER_FUNCT();
-	type = "xh";
+/*
+ * Wait until at least one frame buffer is free for the reader.
+ * Returns the number of frames, at most nframes, which can be read now,
+ * 0 if the acquisition was stopped by the buffer manager.
+ */
+int Camera::DispatchThread::getFreeFrames(int nframes) {
+	AutoMutex aLock(m_cond.mutex());
+	while (m_continue && m_in_flight >= m_max_in_flight)
+		m_cond.wait();
+	if (!m_continue)
+		return 0;
+	int free_frames = m_max_in_flight - m_in_flight;
+	return (nframes < free_frames) ? nframes : free_frames;
 }
 
-void Camera::getDetectorModel(std::string& model) {
-	DEB_MEMBER_FUNCT();
-	stringstream ss;
-//	ss << "Revision " << xh_get_revision(m_sys);
-	model = ss.str();
+/*
+ * Queue a batch of frames for dispatching, waits while the queue is full
+ */
+void Camera::DispatchThread::push(int first_frame, int nframes) {
+	AutoMutex aLock(m_cond.mutex());
+	while (m_queue.size() >= MAX_BATCHES)
+		m_cond.wait();
+	Batch batch;
+	batch.first_frame = first_frame;
+	batch.nframes = nframes;
+	m_queue.push_back(batch);
+	m_in_flight += nframes;
+	m_cond.broadcast();
 }
 
-void Camera::getDetectorImageSize(Size& size) {
-	DEB_MEMBER_FUNCT();
-	size = Size(m_npixels, 1);
+/*
+ * Wait until all the queued batches are dispatched.
+ * Returns false if the buffer manager asked to stop.
+ */
+bool Camera::DispatchThread::waitIdle() {
+	AutoMutex aLock(m_cond.mutex());
+	while (!m_queue.empty())
+		m_cond.wait();
+	return m_continue;
 }
 
-void Camera::getPixelSize(double& sizex, double& sizey) {
+void Camera::DispatchThread::threadFunction() {
 	DEB_MEMBER_FUNCT();
-	sizex = xPixelSize;
-	sizey = yPixelSize;
+	StdBufferCbMgr& buffer_mgr = m_cam.m_bufferCtrlObj.getBuffer();
+	AutoMutex aLock(m_cond.mutex());
+
+	while (!m_quit) {
+		if (m_queue.empty()) {
+			m_cond.wait();
+			continue;
+		}
+		Batch batch = m_queue.front();
+		bool continueFlag = m_continue;
+		aLock.unlock();
+		int strip_size = m_cam.m_roi_width * FrameDim::getImageTypeDepth(m_cam.m_image_type);
+		int per_frame = m_cam.m_nb_concat * m_cam.m_nb_accumulate;	// detector frames in a LImA frame
+		for (int i=0; continueFlag && i<batch.nframes; i++) {
+			HwFrameInfoType frame_info;
+			frame_info.acq_frame_nb = batch.first_frame + i;
+			double timestamp;
+			if (m_cam.getFrameTimestamp(frame_info.acq_frame_nb * per_frame, timestamp))
+				frame_info.frame_timestamp = Timestamp(timestamp);
+			if (m_cam.m_processor.isActive()) {
+				char* frame_ptr = (char*)buffer_mgr.getFrameBufferPtr(frame_info.acq_frame_nb);
+				for (int strip=0; strip<m_cam.m_nb_concat; strip++)
+					m_cam.m_processor.process(frame_ptr + strip * strip_size);
+			}
+			continueFlag = buffer_mgr.newFrameReady(frame_info);
+			DEB_TRACE() << "DispatchThread::threadFunction() newframe ready ";
+			AutoMutex cLock(m_cam.m_cond.mutex());
+			m_cam.m_acq_frame_nb = batch.first_frame + i + 1;
+		}
+		aLock.lock();
+		m_queue.pop_front();
+		m_in_flight -= batch.nframes;
+		m_continue = m_continue && continueFlag;
+		m_cond.broadcast();
+	}
 }
 
-HwBufferCtrlObj* Camera::getBufferCtrlObj() {
-	return &m_bufferCtrlObj;
+Camera::StreamThread::StreamThread(Camera& cam) :
+		m_cam(cam), m_busy(false), m_quit(false) {
+	pthread_attr_setscope(&m_thread_attr, PTHREAD_SCOPE_PROCESS);
 }
 
-void Camera::setTrigMode(TrigMode mode) {
-	DEB_MEMBER_FUNCT();
-	DEB_TRACE() << "Camera::setTrigMode - " << DEB_VAR1(mode);
-	DEB_PARAM() << DEB_VAR1(mode);
-	switch (mode) {
-	case IntTrig:
-	case IntTrigMult:
+Camera::StreamThread::~StreamThread() {
+	AutoMutex aLock(m_cond.mutex());
+	m_quit = true;
+	m_cond.broadcast();
+	aLock.unlock();
+	join();
+	m_xh.disconnectFromServer();
+}
+
+/*
+ * Connect to da.server with a data port of our own, in the data connection
+ * mode of the camera. conn is the connection number in the trace.
+ */
+void Camera::StreamThread::connect(int conn) {
+	DEB_MEMBER_FUNCT();
+	m_xh.setTrace(m_cam.m_trace, conn);
+	if (m_xh.connectToServer(m_cam.m_hostname, m_cam.m_port) < 0 || m_xh.initServerDataPort() < 0) {
+		THROW_HW_ERROR(Error) << "[ " << m_xh.getErrorMessage() << " ]";
+	}
+	if (m_cam.m_persistent_data)
+		m_xh.setDataStream(true);
+	if (m_cam.m_shared_memory)
+		m_xh.setSharedMemory(MIN_STREAM_BYTES);
+	int rcvbuf, busy_poll;
+	bool quickack;
+	m_cam.m_xh->getDataSocketOptions(rcvbuf, quickack, busy_poll);
+	m_xh.setDataSocketOptions(rcvbuf, quickack, busy_poll);
+}
+
+void Camera::StreamThread::startRead(const string& cmd, const vector<struct iovec>& iov) {
+	AutoMutex aLock(m_cond.mutex());
+	m_cmd = cmd;
+	m_iov = iov;
+	m_error.clear();
+	m_busy = true;
+	m_cond.broadcast();
+}
+
+/*
+ * Wait for the read to complete, throws its error
+ */
+void Camera::StreamThread::waitRead() {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_cond.mutex());
+	while (m_busy)
+		m_cond.wait();
+	if (!m_error.empty()) {
+		THROW_HW_ERROR(Error) << m_error;
+	}
+}
+
+void Camera::StreamThread::threadFunction() {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_cond.mutex());
+	while (!m_quit) {
+		if (!m_busy) {
+			m_cond.wait();
+			continue;
+		}
+		aLock.unlock();
+		string error;
+		try {
+			m_xh.sendRead(m_cmd, &m_iov[0], m_iov.size());
+		} catch (Exception& e) {
+			error = e.getErrMsg();
+		}
+		aLock.lock();
+		m_error = error;
+		m_busy = false;
+		m_cond.broadcast();
+	}
+}
+
+void Camera::getImageType(ImageType& type) {
+	DEB_MEMBER_FUNCT();
+	type = m_image_type;
+}
+
+/**
+ * Set the type of the frames handed to LImA. Bpp16 needs the 16 bit readout
+ * mode, Bpp32 frames are widened on the client in 16 bit readout mode.
+ * Bpp32F frames are converted on the client, after the dark and gain
+ * correction if it is enabled.
+ *
+ * @param[in] type Bpp16, Bpp32 or Bpp32F
+ */
+void Camera::setImageType(ImageType type) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(type);
+	switch (type) {
+	case Bpp16:
+		if (!m_readout16) {
+			THROW_HW_ERROR(InvalidValue) << "Bpp16 frames need the 16 bit readout mode";
+		}
+		break;
+	case Bpp32:
+	case Bpp32F:
+		break;
+	default:
+		THROW_HW_ERROR(NotSupported) << "Image type not supported";
+	}
+	if (type == m_image_type)
+		return;
+	m_image_type = type;
+	maxImageSizeChanged(Size(m_npixels, m_nb_concat), m_image_type);
+}
+
+/*
+ * Size in bytes of a pixel as read from da.server
+ */
+int Camera::readoutWordSize() const {
+	return m_readout16 ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+
+void Camera::getDetectorType(std::string& type) {
+	DEB_MEMBER_FUNCT();
+	type = "xh";
+}
+
+void Camera::getDetectorModel(std::string& model) {
+	DEB_MEMBER_FUNCT();
+	stringstream ss;
+//	ss << "Revision " << xh_get_revision(m_sys);
+	model = ss.str();
+}
+
+void Camera::getDetectorImageSize(Size& size) {
+	DEB_MEMBER_FUNCT();
+	size = Size(m_npixels, m_nb_concat);
+}
+
+void Camera::getPixelSize(double& sizex, double& sizey) {
+	DEB_MEMBER_FUNCT();
+	sizex = xPixelSize;
+	sizey = yPixelSize;
+}
+
+HwBufferCtrlObj* Camera::getBufferCtrlObj() {
+	return &m_bufferCtrlObj;
+}
+
+/**
+ * Find the roi which can be read from the detector for a requested roi.
+ * Any range of pixels can be read from interleaved frames. When the server
+ * un-interleaves the heads, a roi within one head is read from that head and a
+ * roi across both heads needs the full frame. Frames un-interleaved on the
+ * client are always read in full, and so are all the concatenated strips.
+ * LImA crops the frames to the requested roi.
+ *
+ * @param[in] set_roi The requested roi
+ * @param[out] hw_roi The roi read from the detector
+ */
+void Camera::checkRoi(const Roi& set_roi, Roi& hw_roi) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(set_roi);
+	Roi full(0, 0, m_npixels, m_nb_concat);
+	if (!set_roi.isActive()) {
+		hw_roi = full;
+	} else {
+		Point topleft = set_roi.getTopLeft();
+		Size size = set_roi.getSize();
+		if (topleft.x < 0 || topleft.y < 0 || topleft.x + size.getWidth() > m_npixels
+				|| topleft.y + size.getHeight() > m_nb_concat) {
+			THROW_HW_ERROR(InvalidValue) << "Roi " << set_roi << " is outside the " << m_npixels << "x" << m_nb_concat << " image";
+		}
+		// all the strips are read
+		hw_roi = Roi(topleft.x, 0, size.getWidth(), m_nb_concat);
+		if (m_uninterleave) {
+			int half = m_npixels / 2;
+			int end = topleft.x + size.getWidth();
+			bool one_head = end <= half || (topleft.x >= half && end <= 2 * half);
+			if (m_client_uninterleave || !one_head)
+				hw_roi = full;
+		}
+	}
+	DEB_RETURN() << DEB_VAR1(hw_roi);
+}
+
+/**
+ * Select the pixels read from the detector. The x offset and width of the roi
+ * become those of the 'read' command, so that only the roi is transferred.
+ *
+ * @param[in] set_roi The roi, as returned by checkRoi
+ */
+void Camera::setRoi(const Roi& set_roi) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(set_roi);
+	Roi hw_roi;
+	checkRoi(set_roi, hw_roi);
+	if (hw_roi != set_roi && set_roi.isActive()) {
+		THROW_HW_ERROR(InvalidValue) << "Roi " << set_roi << " cannot be read, use " << hw_roi;
+	}
+	m_roi_x = hw_roi.getTopLeft().x;
+	m_roi_width = hw_roi.getSize().getWidth();
+	m_processor.setRoi(m_roi_x, (m_roi_width == m_npixels) ? 0 : m_roi_width);
+}
+
+/**
+ * Get the pixels read from the detector
+ *
+ * @param[out] hw_roi The roi
+ */
+void Camera::getRoi(Roi& hw_roi) {
+	DEB_MEMBER_FUNCT();
+	hw_roi = Roi(m_roi_x, 0, m_roi_width, m_nb_concat);
+	DEB_RETURN() << DEB_VAR1(hw_roi);
+}
+
+void Camera::setTrigMode(TrigMode mode) {
+	DEB_MEMBER_FUNCT();
+	DEB_TRACE() << "Camera::setTrigMode - " << DEB_VAR1(mode);
+	DEB_PARAM() << DEB_VAR1(mode);
+	switch (mode) {
+	case IntTrig:
+	case IntTrigMult:
 	case ExtTrigMult:
 		m_trigger_mode = mode;
 		break;
@@ -410,8 +1202,7 @@ void Camera::getExpTime(double& exp_time) {
 	DEB_MEMBER_FUNCT();
 	DEB_TRACE() << "Camera::getExpTime";
 	// convert to seconds
-	double timearray[] = {20*1e-9,22*1e-9,22*1e-9};
-	exp_time = m_exp_time * timearray[m_clock_mode];
+	exp_time = m_exp_time * clockPeriod();
 	DEB_RETURN() << DEB_VAR1(exp_time);
 }
 
@@ -419,11 +1210,18 @@ void Camera::setExpTime(double exp_time) {
 	DEB_MEMBER_FUNCT();
 	DEB_TRACE() << "Camera::setExpTime - " << DEB_VAR1(exp_time);
         // we receive seconds, 
-	double timearray[] = {20*1e-9,22*1e-9,22*1e-9};
-	m_exp_time = exp_time / timearray[m_clock_mode];
+	m_exp_time = exp_time / clockPeriod();
 	DEB_TRACE() << "Camera::setExpTime ------------------------------>"  << DEB_VAR1(m_exp_time) ;
 }
 
+/*
+ * Period of the timing clock in seconds
+ */
+double Camera::clockPeriod() const {
+	double timearray[] = {20*1e-9,22*1e-9,22*1e-9};
+	return timearray[m_clock_mode];
+}
+
 void Camera::setLatTime(double lat_time) {
 	DEB_MEMBER_FUNCT();
 	DEB_PARAM() << DEB_VAR1(lat_time);
@@ -511,7 +1309,9 @@ void Camera::continueAcq() {
 }
 
 /**
- * Set or Clear 16 bit readout mode
+ * Set or Clear 16 bit readout mode. The frames are read as 16 bit words and
+ * handed to LImA as the image type set with setImageType(). The Bpp32 and
+ * Bpp32F types are kept, Bpp16 frames become Bpp32 in 32 bit mode.
  *
  * @param[in] mode false=> 32 bit mode, true => 16 bit mode
  */
@@ -520,12 +1320,15 @@ void Camera::set16BitReadout(bool mode) {
 	stringstream cmd;
 	if (mode) {
 		cmd << "xstrip mode16bit " << m_sysName << " 1";
-		m_image_type = Bpp16;
 	} else {
 		cmd << "xstrip mode16bit " << m_sysName << " 0";
+	}
+	configure("mode16bit", cmd.str());
+	m_readout16 = mode;
+	if (!mode && m_image_type == Bpp16) {
 		m_image_type = Bpp32;
+		maxImageSizeChanged(Size(m_npixels, m_nb_concat), m_image_type);
 	}
-	m_xh->sendWait(cmd.str());
 }
 
 /**
@@ -541,7 +1344,12 @@ void Camera::setDeadPixels(int first, int num, bool reset) {
 	cmd << "xstrip set-dead-pixels " << m_sysName << " " << first << " " << num;
 	if (reset)
 		cmd << " reset";
-	m_xh->sendWait(cmd.str());
+	if (reset)
+		forget("dead-pixels ");
+	stringstream key;
+	key << "dead-pixels " << first << " " << num;
+	configure(key.str(), cmd.str());
+	m_processor.setDeadPixels(first, num, reset);
 }
 
 /**
@@ -557,7 +1365,9 @@ void Camera::setOffsets(int first, int num, int value, bool direct) {
 	cmd << "xstrip offsets set " << m_sysName << " " << first << " " << num << " " << value;
 	if (direct)
 		cmd << " direct";
-	m_xh->sendWait(cmd.str());
+	stringstream key;
+	key << "offsets " << first << " " << num;
+	configure(key.str(), cmd.str());
 }
 
 /**
@@ -580,7 +1390,9 @@ void Camera::setHvDac(double value, bool noslew, int sign, bool direct){
 		cmd << " neg";
 	if (sign > 0)
 		cmd << " pos";
-	m_xh->sendWait(cmd.str());
+	stringstream key;
+	key << "hv-dac " << sign;
+	configure(key.str(), cmd.str());
 }
 
 /**
@@ -609,7 +1421,7 @@ void Camera::getHvAdc(double& value, bool hvmon, bool v12, bool v5, int sign, bo
 		cmd << " v12";
 	if (v5)
 		cmd << " v5";
-	m_xh->sendWait(cmd.str(), value);
+	controlClient()->sendWait(cmd.str(), value);
 }
 
 /**
@@ -631,7 +1443,7 @@ void Camera::enableHv(bool enable, bool overtemp, bool force) {
 	} else {
 		cmd << " off";
 	}
-	m_xh->sendWait(cmd.str());
+	configure("hv", cmd.str());
 }
 
 /**
@@ -705,7 +1517,9 @@ void Camera::setHeadDac(double value, HeadVoltageType voltageType, int head, boo
 		cmd << " head " << head;
 	if (direct)
 		cmd << " direct";
-	m_xh->sendWait(cmd.str());
+	stringstream key;
+	key << "head-dac " << voltageType << " " << head;
+	configure(key.str(), cmd.str());
 }
 
 /**
@@ -745,7 +1559,7 @@ void Camera::getHeadAdc(double& value, int head, HeadVoltageType voltageType) {
 		cmd << " vled";
 		break;
 	}
-	m_xh->sendWait(cmd.str(), value);
+	controlClient()->sendWait(cmd.str(), value);
 }
 
 /**
@@ -760,7 +1574,9 @@ void Camera::setCalEn(bool onOff, int head) {
 	cmd << "xstrip head set-cal-en " << m_sysName << " " << onOff;
 	if (head != -1)
 		cmd << " head " << head;
-	m_xh->sendWait(cmd.str());
+	stringstream key;
+	key << "cal-en " << head;
+	configure(key.str(), cmd.str());
 }
 
 /**
@@ -776,7 +1592,9 @@ void Camera::setHeadCaps(int capsAB, int capsCD, int head) {
 	cmd << "xstrip head set-xchip-caps " << m_sysName <<  " " << capsAB << " " << capsCD;
 	if (head != -1)
 		cmd << " head " << head;
-	m_xh->sendWait(cmd.str());
+	stringstream key;
+	key << "caps " << head;
+	configure(key.str(), cmd.str());
 }
 
 /**
@@ -821,6 +1639,163 @@ void Camera::setDefaultTimingParameters(XhTimingParameters& timingParams) {
  */
 void Camera::setTimingGroup(int groupNum, int nframes, int nscans, int intTime, bool last, const XhTimingParameters& timingParams) {
 	DEB_MEMBER_FUNCT();
+	int num_frames;
+	stringstream key;
+	key << "group " << groupNum;
+	// the server drops the groups after this one
+	forgetGroups(groupNum);
+	configure(key.str(), timingGroupCmd(groupNum, nframes, nscans, intTime, last, timingParams), groupNum, &num_frames);
+	groupProgrammed(groupNum, nframes, nscans, intTime, last, timingParams, num_frames);
+}
+
+/**
+ * Start a detector setup sequence. Until endSetup(), the commands without a
+ * return value (clock, caps, dacs, offsets, dead pixels, outputs, ...) are
+ * queued and sent pipelined, without a round trip each. A command with a
+ * return value sends the queued commands first, so the order is kept.
+ */
+void Camera::beginSetup() {
+	DEB_MEMBER_FUNCT();
+	checkConnection();
+	m_setup_batch.clear();
+	m_xh->beginBatch(m_setup_batch);
+	m_in_setup = true;
+}
+
+/**
+ * Send the commands queued since beginSetup(). Throws with the error of
+ * each command the server refused.
+ */
+void Camera::endSetup() {
+	DEB_MEMBER_FUNCT();
+	m_in_setup = false;
+	try {
+		m_xh->endBatch();
+	} catch (Exception&) {
+		if (!m_auto_reconnect || m_xh->isConnected())
+			throw;
+	}
+	DEB_TRACE() << m_setup_batch.size() << " setup commands";
+	if (m_auto_reconnect && !m_xh->isConnected()) {
+		// the commands are in the journal, they are replayed with the others
+		reconnect();
+		return;
+	}
+	if (m_setup_batch.getNbErrors() != 0) {
+		// the refused settings are not applied, do not replay them
+		AutoMutex aLock(m_journal_mutex);
+		for (int i = 0; i < m_setup_batch.size(); i++) {
+			if (m_setup_batch[i].ok)
+				continue;
+			for (unsigned int j = 0; j < m_journal.size(); j++) {
+				if (m_journal[j].cmd == m_setup_batch[i].cmd) {
+					m_journal.erase(m_journal.begin() + j);
+					break;
+				}
+			}
+		}
+		aLock.unlock();
+		THROW_HW_ERROR(Error) << m_setup_batch.getNbErrors() << " of " << m_setup_batch.size() << " setup commands failed [ "
+				<< m_setup_batch.getErrors() << "]";
+	}
+}
+
+/**
+ * Setup all the timing groups of an experiment. The program is checked as a
+ * whole before anything is sent, then the groups are sent pipelined, without
+ * waiting for the prompt between them. The last group is written to memory.
+ *
+ * @param[in] groups The timing groups, in order
+ */
+void Camera::setTimingGroups(const vector<XhTimingGroup>& groups) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(groups.size());
+	checkTimingGroups(groups);
+	XhBatch batch;
+	for (unsigned int g = 0; g < groups.size(); g++) {
+		const XhTimingGroup& group = groups[g];
+		batch.add(timingGroupCmd(g, group.nframes, group.nscans, group.intTime, g + 1 == groups.size(), group.timingParams));
+	}
+	XhBatch unsent(batch);
+	checkConnection();
+	try {
+		m_xh->sendBatch(batch);
+		if (batch.getNbErrors() != 0 && m_auto_reconnect && !m_in_setup && !m_xh->isConnected()) {
+			reconnect();
+			batch = unsent;
+			m_xh->sendBatch(batch);
+		}
+	} catch (Exception&) {
+		m_nb_groups = 0;
+		m_group_timing.clear();
+		throw;
+	}
+	if (batch.getNbErrors() != 0) {
+		// part of the program may have been written, it must be sent again
+		m_nb_groups = 0;
+		m_group_timing.clear();
+		THROW_HW_ERROR(Error) << "[ " << batch.getErrors() << "]";
+	}
+	forgetGroups(0);
+	for (unsigned int g = 0; g < groups.size(); g++) {
+		const XhTimingGroup& group = groups[g];
+		stringstream key;
+		key << "group " << g;
+		journal(key.str(), batch[g].cmd, g);
+		groupProgrammed(g, group.nframes, group.nscans, group.intTime, g + 1 == groups.size(), group.timingParams, batch[g].ivalue);
+	}
+}
+
+/*
+ * Check a timing program before sending it, throws on the first invalid group
+ */
+void Camera::checkTimingGroups(const vector<XhTimingGroup>& groups) {
+	DEB_MEMBER_FUNCT();
+	if (groups.empty()) {
+		THROW_HW_ERROR(InvalidValue) << "Empty timing program";
+	}
+	long long total_frames = 0;
+	for (unsigned int g = 0; g < groups.size(); g++) {
+		const XhTimingGroup& group = groups[g];
+		const XhTimingParameters& p = group.timingParams;
+		const char* error = 0;
+		if (group.nframes <= 0)
+			error = "number of frames must be positive";
+		else if (group.nscans < 0)
+			error = "number of scans must not be negative";
+		else if (group.intTime <= 0)
+			error = "integration time must be positive";
+		else if (p.trigMux < -1 || p.trigMux > 9)
+			error = "trigger mux must be -1..9";
+		else if (p.orbitMux < -1 || p.orbitMux > 3)
+			error = "orbit mux must be -1..3";
+		else if (p.lemoOut < 0 || p.lemoOut > 255)
+			error = "lemo outputs must be 0..255";
+		else if (p.groupDelay < 0 || p.frameDelay < 0 || p.scanPeriod < 0 || p.auxDelay < 0 || p.frameTime < 0)
+			error = "delays and periods must not be negative";
+		else if (p.auxWidth < 1)
+			error = "aux width must be at least 1";
+		else if (p.shiftDown < 0 || p.shiftDown > 4)
+			error = "shift down must be 0..4";
+		else if (p.cyclesStart < 1)
+			error = "cycles start must be at least 1";
+		else if (p.s1Delay < 0 || p.s1Delay > 3 || p.s2Delay < 0 || p.s2Delay > 3 || p.xclkDelay < 0 || p.xclkDelay > 3
+				|| p.rstRDelay < 0 || p.rstRDelay > 3 || p.rstFDelay < 0 || p.rstFDelay > 3)
+			error = "fine delays must be 0..3";
+		if (error) {
+			THROW_HW_ERROR(InvalidValue) << "Timing group " << g << ": " << error;
+		}
+		total_frames += group.nframes;
+	}
+	if (total_frames > INT_MAX) {
+		THROW_HW_ERROR(InvalidValue) << "Timing program has too many frames " << total_frames;
+	}
+}
+
+/*
+ * Build the command which sets up a timing group
+ */
+string Camera::timingGroupCmd(int groupNum, int nframes, int nscans, int intTime, bool last, const XhTimingParameters& timingParams) {
 	stringstream cmd;
 	cmd << "xstrip timing setup-group " << m_sysName << " " << groupNum << " " << nframes << " " << nscans << " "
 			<< intTime;
@@ -905,9 +1880,16 @@ void Camera::setTimingGroup(int groupNum, int nframes, int nscans, int intTime,
 	if (timingParams.allowExcess)
 		cmd << " allow-excess";
 
-	int num_frames;
-	m_xh->sendWait(cmd.str(), num_frames);
+	return cmd.str();
+}
 
+/*
+ * Keep track of a timing group accepted by the server, num_frames is the
+ * total number of frames programmed so far
+ */
+void Camera::groupProgrammed(int groupNum, int nframes, int nscans, int intTime, bool last, const XhTimingParameters& timingParams,
+		int num_frames) {
+	DEB_MEMBER_FUNCT();
 	if (timingParams.trigControl != Camera::XhTrigIn_noTrigger) {
 		setTrigMode(ExtTrigMult);
 	}
@@ -915,10 +1897,70 @@ void Camera::setTimingGroup(int groupNum, int nframes, int nscans, int intTime,
 		setTrigMode(IntTrigMult);
 	}
 	if (last) {
-		m_nb_frames = num_frames;
+		// LImA frames, each made of accumulated and concatenated detector frames
+		m_nb_frames = num_frames / (m_nb_concat * m_nb_accumulate);
 	}
 	m_nb_groups = groupNum + 1;
 	DEB_TRACE() << "m_nb_frames " << m_nb_frames;
+
+	// keep the shortest frame time to pace the status polling
+	int frame_cycles = timingParams.frameTime;
+	if (frame_cycles == 0) {
+		int scan_cycles = (timingParams.scanPeriod != 0) ? timingParams.scanPeriod : intTime;
+		frame_cycles = ((nscans > 0) ? nscans : 1) * scan_cycles + timingParams.frameDelay;
+	}
+	double frame_time = frame_cycles * clockPeriod();
+	if (groupNum == 0 || frame_time < m_frame_time)
+		m_frame_time = frame_time;
+
+	// the frame times are only known for groups which are not triggered and
+	// whose number of scans is not chosen by the server
+	GroupTiming group;
+	group.nframes = nframes;
+	group.group_delay = timingParams.groupDelay;
+	group.frame_delay = timingParams.frameDelay;
+	bool triggered = (timingParams.trigControl & (Camera::XhTrigIn_groupTrigger | Camera::XhTrigIn_frameTrigger
+			| Camera::XhTrigIn_scanTrigger | Camera::XhTrigIn_groupOrbit | Camera::XhTrigIn_frameOrbit
+			| Camera::XhTrigIn_scanOrbit)) != 0;
+	group.period = (triggered || (timingParams.frameTime == 0 && nscans <= 0)) ? 0 : frame_cycles;
+	m_group_timing.resize(groupNum);
+	m_group_timing.push_back(group);
+	int first_frame = 0;
+	long long start = 0;
+	for (unsigned int g = 0; g < m_group_timing.size(); g++) {
+		GroupTiming& t = m_group_timing[g];
+		t.first_frame = first_frame;
+		t.start = start;
+		first_frame += t.nframes;
+		if (start < 0 || t.period == 0)
+			start = -1;
+		else
+			start += t.group_delay + (long long) t.nframes * t.period;
+	}
+}
+
+/*
+ * Time of the start of a detector frame from the start of the acquisition,
+ * derived from the programmed timing groups. Returns false if it depends on
+ * a trigger.
+ */
+bool Camera::getFrameTimestamp(int frame_nb, double& timestamp) const {
+	int lo = 0, hi = m_group_timing.size();
+	while (hi - lo > 1) {
+		int mid = (lo + hi) / 2;
+		if (m_group_timing[mid].first_frame <= frame_nb)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if (hi == 0)
+		return false;
+	const GroupTiming& t = m_group_timing[lo];
+	if (t.start < 0 || t.period == 0 || frame_nb >= t.first_frame + t.nframes)
+		return false;
+	long long cycles = t.start + t.group_delay + t.frame_delay + (long long) (frame_nb - t.first_frame) * t.period;
+	timestamp = cycles * clockPeriod();
+	return true;
 }
 
 /**
@@ -939,7 +1981,9 @@ void Camera::modifyTimingGroup(int group_num, int fixed_reset, bool allowExcess,
 		cmd << " allow-excess";
 	if (fixed_reset != -1)
 		cmd << " fixed-rst-s1 " << fixed_reset;
-	m_xh->sendWait(cmd.str());
+	stringstream key;
+	key << "modify-group " << group_num;
+	configure(key.str(), cmd.str(), group_num);
 }
 
 /**
@@ -996,7 +2040,9 @@ void Camera::setExtTrigOutput(int trigNum, TriggerOutputType trigout, int width,
 		cmd << " width " << width;
 	if (invert)
 		cmd << " invert";
-	m_xh->sendWait(cmd.str());
+	stringstream key;
+	key << "ext-output " << trigNum;
+	configure(key.str(), cmd.str());
 }
 
 /**
@@ -1013,7 +2059,7 @@ void Camera::setLedTiming(int pause_time, int frame_time, int int_time, bool wai
 	cmd << "xstrip timing setup-leds " << m_sysName <<  " " << pause_time << " " << frame_time << " " << int_time;
 	if (wait_for_trig)
 		cmd << " inc-orbit";
-	m_xh->sendWait(cmd.str());
+	configure("setup-leds", cmd.str());
 }
 
 /**
@@ -1029,7 +2075,7 @@ void Camera::setTimingOrbit(int delay, bool use_falling_edge) {
 	if (use_falling_edge) {
 		cmd << " falling";
 	}
-	m_xh->sendWait(cmd.str());
+	configure("setup-orbit", cmd.str());
 }
 
 /**
@@ -1044,19 +2090,24 @@ void Camera::setTimingOrbit(int delay, bool use_falling_edge) {
 void Camera::getTimingInfo(unsigned int* buff, int firstParam, int nParams, int firstGroup, int nGroups) {
 	DEB_MEMBER_FUNCT();
 	int timingHandle;
-	unsigned char* bptr = (unsigned char*) buff;
 	stringstream cmd, cmd1, cmd2;
+	checkConnection();
 	cmd << "xstrip timing open " << m_sysName;
 	m_xh->sendWait(cmd.str(), timingHandle);
-	int num = 30 * m_nb_groups * sizeof(long);
-	cmd1 << "read " << firstParam << " " << firstGroup << " 0 " << nParams << " " << nGroups << " 1" << " from " << timingHandle << " long";
-	m_xh->sendWait(cmd1.str());
-	m_xh->getData(bptr, num);
 	cmd2 << "close " << timingHandle;
+	// one 32 bit word per parameter and group, drained while the server sends it
+	struct iovec iov;
+	iov.iov_base = buff;
+	iov.iov_len = (size_t) nParams * nGroups * sizeof(unsigned int);
+	cmd1 << "read " << firstParam << " " << firstGroup << " 0 " << nParams << " " << nGroups << " 1" << " from " << timingHandle << " long";
+	try {
+		m_xh->sendRead(cmd1.str(), &iov, 1);
+	} catch (Exception&) {
+		if (m_xh->isConnected())
+			m_xh->sendNowait(cmd2.str());
+		throw;
+	}
 	m_xh->sendWait(cmd2.str());
-
-//	uint32_t *dptr = (uint32_t *)bptr;
-//	std::cout << *dptr << " " << *(dptr+1) << " " << *(dptr+2) << std::endl;
 }
 
 /**
@@ -1094,7 +2145,9 @@ void Camera::setupClock(ClockModeType clockMode, int pll_gain, int extra_div, in
 		cmd << " r3 " << r3;
 	if (r4 > 0)
 		cmd << " r4 " << r4;
-	m_xh->sendWait(cmd.str());
+	// the clocks are synchronised again after a new setup
+	forget("sync-clock");
+	configure("clock", cmd.str());
 }
 
 /**
@@ -1107,7 +2160,7 @@ void Camera::getSetpoint(int channel, double& value) {
 	DEB_MEMBER_FUNCT();
 	stringstream cmd;
 	cmd << "xstrip tc get " << m_sysName <<  " ch " << channel << " setpoint";
-	m_xh->sendWait(cmd.str(), value);
+	controlClient()->sendWait(cmd.str(), value);
 }
 
 /**
@@ -1120,7 +2173,7 @@ void Camera::getTemperature(int channel, double& value) {
 	DEB_MEMBER_FUNCT();
 	stringstream cmd;
 	cmd << "xstrip tc get " << m_sysName <<  " ch " << channel << " t";
-	m_xh->sendWait(cmd.str(), value);
+	controlClient()->sendWait(cmd.str(), value);
 }
 
 /**
@@ -1132,7 +2185,7 @@ void Camera::setCalImage(double imageScale) {
 	DEB_MEMBER_FUNCT();
 	stringstream cmd;
 	cmd << "xstrip head set-cal-image " << m_sysName <<  " " << imageScale;
-	m_xh->sendWait(cmd.str());
+	configure("cal-image", cmd.str());
 }
 
 /**
@@ -1144,7 +2197,7 @@ void Camera::setXDelay(int delay) {
 	DEB_MEMBER_FUNCT();
 	stringstream cmd;
 	cmd << "xstrip set-x-delay " << m_sysName <<  " " << delay;
-	m_xh->sendWait(cmd.str());
+	configure("x-delay", cmd.str());
 }
 
 /**
@@ -1154,7 +2207,7 @@ void Camera::syncClock() {
 	DEB_MEMBER_FUNCT();
 	stringstream cmd;
 	cmd << "xstrip test sync-clock " << m_sysName;
-	m_xh->sendWait(cmd.str());
+	configure("sync-clock", cmd.str());
 }
 
 /**
@@ -1176,7 +2229,7 @@ void Camera::getMaxFrames(string& nframes) {
 	DEB_MEMBER_FUNCT();
 	stringstream cmd;
 	cmd << "%xstrip_num_tf";
-	m_xh->sendWait(cmd.str(), nframes);
+	controlClient()->sendWait(cmd.str(), nframes);
 }
 
 /**
@@ -1188,7 +2241,7 @@ void Camera::getTotalFrames(int& nframes) {
 	DEB_MEMBER_FUNCT();
 	stringstream cmd;
 	cmd << "%xstrip_num_tf";
-	m_xh->sendWait(cmd.str(), nframes);
+	controlClient()->sendWait(cmd.str(), nframes);
 }
 
 /**
@@ -1211,23 +2264,620 @@ void Camera::shutDown(string script) {
  */
 void Camera::uninterleave(bool uninterleave) {
 	DEB_MEMBER_FUNCT();
-	stringstream cmd1, cmd2, cmd3;
-	if (m_uninterleave != uninterleave) {
-		m_uninterleave = uninterleave;
+	m_uninterleave = uninterleave;
+	bool server = m_uninterleave && !m_client_uninterleave;
+	if (server != m_handle_uninterleave) {
+		openDataHandle(server);
+	}
+}
+
+/**
+ * Select where the un-interleaved format is produced. On the client the data
+ * is read interleaved and the heads are separated while the data is copied
+ * into the frame buffers, so switching the format needs no server round trip.
+ *
+ * @param[in] client true to un-interleave on the client, false on the server
+ */
+void Camera::setClientUninterleave(bool client) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(client);
+	m_client_uninterleave = client;
+	uninterleave(m_uninterleave);
+}
+
+/**
+ * Get where the un-interleaved format is produced.
+ *
+ * @param[out] client true if the data is un-interleaved on the client
+ */
+void Camera::getClientUninterleave(bool& client) {
+	DEB_MEMBER_FUNCT();
+	client = m_client_uninterleave;
+	DEB_RETURN() << DEB_VAR1(client);
+}
+
+/*
+ * (Re)open the detector data handle, un-interleaved on the server or not
+ */
+void Camera::openDataHandle(bool uninterleave) {
+	DEB_MEMBER_FUNCT();
+	stringstream cmd1, cmd2;
+	if (m_openHandle >= 0) {
 		cmd1 << "close " << m_openHandle;
 		m_xh->sendWait(cmd1.str());
-		if (m_uninterleave) {
-			cmd2 << "xstrip open " << m_sysName << " un-interleave";
-			m_xh->sendWait(cmd2.str(), m_openHandle);
-		} else {
-			cmd2 << "xstrip open " << m_sysName;
-			m_xh->sendWait(cmd2.str(), m_openHandle);
-		}
-		if (m_openHandle < 0) {
-			THROW_HW_ERROR(Error) << "[ " << m_xh->getErrorMessage() << " ]";
-		} else {
-			DEB_TRACE() << "configured open path as " << m_openHandle;
+		m_openHandle = -1;
+	}
+	if (uninterleave) {
+		cmd2 << "xstrip open " << m_sysName << " un-interleave";
+	} else {
+		cmd2 << "xstrip open " << m_sysName;
+	}
+	m_xh->sendWait(cmd2.str(), m_openHandle);
+	if (m_openHandle < 0) {
+		THROW_HW_ERROR(Error) << "[ " << m_xh->getErrorMessage() << " ]";
+	}
+	m_handle_uninterleave = uninterleave;
+	DEB_TRACE() << "configured open path as " << m_openHandle;
+}
+
+/**
+ * Keep one data connection open for the whole session instead of letting the
+ * server connect to our data port for every read. Servers which do not support
+ * it are left in the connect-back mode.
+ *
+ * @param[in] persistent true to use a persistent data connection
+ */
+void Camera::setPersistentDataConnection(bool persistent) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(persistent);
+	AutoMutex aLock(m_cond.mutex());
+	m_persistent_data = persistent;
+	if (m_xh->setDataStream(persistent) < 0) {
+		DEB_WARNING() << "da.server does not support a persistent data connection, using connect-back";
+	}
+	AutoMutex sLock(m_stream_mutex);
+	for (unsigned int i = 0; i < m_streams.size(); i++)
+		m_streams[i]->client().setDataStream(persistent);
+}
+
+/**
+ * Have da.server put the frames in shared memory instead of sending them on a
+ * data connection, when it runs on this host. Use a hostname starting with
+ * '/', the path of the server unix-domain socket, for the commands as well.
+ * Servers which do not support it, or run on another host, are left on the
+ * data connection.
+ *
+ * @param[in] enable true to read the frames from shared memory
+ */
+void Camera::setSharedMemoryData(bool enable) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(enable);
+	AutoMutex aLock(m_cond.mutex());
+	m_shared_memory = enable;
+	if (m_xh->setSharedMemory(enable ? DEFAULT_CHUNK_BYTES : 0) < 0) {
+		DEB_WARNING() << "Cannot use shared memory for the data [ " << m_xh->getErrorMessage() << " ], using the data connection";
+	}
+	AutoMutex sLock(m_stream_mutex);
+	for (unsigned int i = 0; i < m_streams.size(); i++)
+		m_streams[i]->client().setSharedMemory(enable ? MIN_STREAM_BYTES : 0);
+}
+
+/**
+ * Get whether the frames are read from shared memory.
+ *
+ * @param[out] enable true if the frames are read from shared memory
+ */
+void Camera::getSharedMemoryData(bool& enable) {
+	DEB_MEMBER_FUNCT();
+	enable = m_xh->getSharedMemorySize() != 0;
+	DEB_RETURN() << DEB_VAR1(enable);
+}
+
+/**
+ * Get the data connection mode in use.
+ *
+ * @param[out] persistent true if a persistent data connection is in use
+ */
+void Camera::getPersistentDataConnection(bool& persistent) {
+	DEB_MEMBER_FUNCT();
+	persistent = m_xh->isDataStream();
+	DEB_RETURN() << DEB_VAR1(persistent);
+}
+
+/**
+ * Open a second command connection to da.server reserved for status and
+ * slow-control queries (timing status, temperatures, HV and head ADCs),
+ * so that they are answered while a large read is in progress on the
+ * data connection.
+ *
+ * @param[in] enable true to use a separate control connection
+ */
+void Camera::setControlConnection(bool enable) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(enable);
+	if (enable == m_control_connection)
+		return;
+	if (enable) {
+		m_control_connection = true;
+		connectControl();
+	} else {
+		// stop handing out the connection before closing it
+		m_control_connection = false;
+		m_ctrl->disconnectFromServer();
+	}
+}
+
+/**
+ * Get whether status and slow-control queries use their own connection.
+ *
+ * @param[out] enable true if a separate control connection is in use
+ */
+void Camera::getControlConnection(bool& enable) {
+	DEB_MEMBER_FUNCT();
+	enable = m_control_connection;
+	DEB_RETURN() << DEB_VAR1(enable);
+}
+
+/**
+ * Split large reads over several data connections to da.server, read in
+ * parallel straight into their part of the destination. Each part is at
+ * least MIN_STREAM_BYTES.
+ *
+ * @param[in] nb_streams The number of data connections, 1 for the data connection only
+ */
+void Camera::setDataStreams(int nb_streams) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(nb_streams);
+	if (nb_streams < 1) {
+		THROW_HW_ERROR(InvalidValue) << "At least one data stream is needed";
+	}
+	AutoMutex aLock(m_stream_mutex);
+	disconnectStreams();
+	m_nb_streams = nb_streams;
+	connectStreams();
+}
+
+/**
+ * Get the number of data connections a large read is split over.
+ *
+ * @param[out] nb_streams The number of data connections
+ */
+void Camera::getDataStreams(int& nb_streams) {
+	DEB_MEMBER_FUNCT();
+	nb_streams = m_nb_streams;
+	DEB_RETURN() << DEB_VAR1(nb_streams);
+}
+
+/**
+ * Reconnect automatically when the connection to da.server is lost, and
+ * apply the configuration again. The configuration commands sent since
+ * init() or reset() are kept in a journal, one per setting, and replayed
+ * pipelined after the configuration file. The loss is noticed by the next
+ * command or status poll. A loss during an acquisition fails it, see
+ * getAcqError(), and the connection is only opened again once it stopped.
+ *
+ * @param[in] enable true to reconnect automatically (default)
+ */
+void Camera::setAutoReconnect(bool enable) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(enable);
+	m_auto_reconnect = enable;
+}
+
+/**
+ * Get whether a lost connection is opened again automatically.
+ *
+ * @param[out] enable true if the connection is opened again automatically
+ */
+void Camera::getAutoReconnect(bool& enable) {
+	DEB_MEMBER_FUNCT();
+	enable = m_auto_reconnect;
+	DEB_RETURN() << DEB_VAR1(enable);
+}
+
+/*
+ * Connect the extra data connections
+ */
+void Camera::connectStreams() {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_stream_mutex);
+	try {
+		while ((int) m_streams.size() < m_nb_streams - 1) {
+			StreamThread* stream = new StreamThread(*this);
+			m_streams.push_back(stream);
+			stream->start();
+			// connections 0 and 1 in a trace are the data and control connections
+			stream->connect(m_streams.size() + 1);
 		}
+	} catch (Exception&) {
+		disconnectStreams();
+		throw;
+	}
+}
+
+void Camera::disconnectStreams() {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_stream_mutex);
+	for (unsigned int i = 0; i < m_streams.size(); i++)
+		delete m_streams[i];
+	m_streams.clear();
+}
+
+/*
+ * Connect the control client, the data connection is used instead if that fails
+ */
+void Camera::connectControl() {
+	DEB_MEMBER_FUNCT();
+	m_control_connection = false;
+	m_ctrl->disconnectFromServer();
+	if (m_ctrl->connectToServer(m_hostname, m_port) < 0) {
+		DEB_WARNING() << "Cannot open control connection [ " << m_ctrl->getErrorMessage() << " ], using the data connection";
+		return;
+	}
+	m_control_connection = true;
+}
+
+/*
+ * Client for status and slow-control queries
+ */
+XhClient* Camera::controlClient() {
+	return m_control_connection ? m_ctrl : m_xh;
+}
+
+/**
+ * Limit the size of a single read command. Frames completed in the detector
+ * are then read and handed to LImA in chunks, so the first frames are
+ * available before the whole backlog is transferred.
+ *
+ * @param[in] max_frames The maximum number of frames per read, 0 for no limit
+ * @param[in] max_bytes The maximum number of bytes per read, 0 for no limit
+ */
+void Camera::setReadChunkSize(int max_frames, int max_bytes) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR2(max_frames, max_bytes);
+	if (max_frames < 0 || max_bytes < 0) {
+		THROW_HW_ERROR(InvalidValue) << "Read chunk size must be positive or 0";
+	}
+	m_chunk_frames = max_frames;
+	m_chunk_bytes = max_bytes;
+}
+
+/**
+ * Tune the data connections for the network interface of the host: receive
+ * buffer size, quick acknowledgements and busy polling. The read size is set
+ * with setReadChunkSize(), getTransferRate() shows the effect.
+ *
+ * @param[in] rcvbuf Socket receive buffer size in bytes, 0 for the system default (capped by net.core.rmem_max)
+ * @param[in] quickack Acknowledge each segment at once (TCP_QUICKACK)
+ * @param[in] busy_poll Busy poll the device queue for this many us when reading (SO_BUSY_POLL, needs CAP_NET_ADMIN), 0 for none
+ */
+void Camera::setDataSocketOptions(int rcvbuf, bool quickack, int busy_poll) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR3(rcvbuf, quickack, busy_poll);
+	if (rcvbuf < 0 || busy_poll < 0) {
+		THROW_HW_ERROR(InvalidValue) << "Receive buffer size and busy poll time must be positive or 0";
+	}
+	m_xh->setDataSocketOptions(rcvbuf, quickack, busy_poll);
+	AutoMutex aLock(m_stream_mutex);
+	for (unsigned int i = 0; i < m_streams.size(); i++)
+		m_streams[i]->client().setDataSocketOptions(rcvbuf, quickack, busy_poll);
+}
+
+/**
+ * Get the data connection tuning.
+ *
+ * @param[out] rcvbuf Socket receive buffer size in bytes, 0 for the system default
+ * @param[out] quickack Quick acknowledgements
+ * @param[out] busy_poll Busy polling time (us), 0 for none
+ */
+void Camera::getDataSocketOptions(int& rcvbuf, bool& quickack, int& busy_poll) {
+	DEB_MEMBER_FUNCT();
+	m_xh->getDataSocketOptions(rcvbuf, quickack, busy_poll);
+	DEB_RETURN() << DEB_VAR3(rcvbuf, quickack, busy_poll);
+}
+
+/**
+ * Get the data throughput achieved, from sending the read command to the
+ * last byte received, so including the server latency.
+ *
+ * @param[out] last MB/s of the last read
+ * @param[out] mean MB/s of all the reads since the acquisition was prepared
+ */
+void Camera::getTransferRate(double& last, double& mean) {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_rate_mutex);
+	last = m_last_rate;
+	mean = (m_read_time > 0.) ? m_read_bytes / m_read_time * 1e-6 : 0.;
+	DEB_RETURN() << DEB_VAR2(last, mean);
+}
+
+/**
+ * Record every command, server response and data block exchanged with
+ * da.server, timestamped, in a binary trace file (see XhTrace.h). The
+ * connections are opened again and the configuration replayed, so that the
+ * trace holds a complete session which the simulator can play back.
+ *
+ * @param[in] filename The trace file, overwritten
+ */
+void Camera::startTrace(const string& filename) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(filename);
+	AutoMutex aLock(m_journal_mutex);
+	stopTrace();
+	m_trace = new XhTraceWriter(filename);
+	m_xh->setTrace(m_trace, 0);
+	m_ctrl->setTrace(m_trace, 1);
+	reconnect(true);
+}
+
+/**
+ * Stop recording and close the trace file.
+ */
+void Camera::stopTrace() {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_journal_mutex);
+	if (!m_trace)
+		return;
+	AutoMutex sLock(m_stream_mutex);
+	for (unsigned int i = 0; i < m_streams.size(); i++)
+		m_streams[i]->client().setTrace(0);
+	sLock.unlock();
+	m_ctrl->setTrace(0);
+	m_xh->setTrace(0);
+	DEB_TRACE() << m_trace->getNbBytes() << " bytes traced";
+	if (m_trace->isFailed()) {
+		DEB_WARNING() << "Trace incomplete, writing it failed after " << m_trace->getNbBytes() << " bytes";
 	}
+	delete m_trace;
+	m_trace = 0;
 }
 
+/**
+ * Get the read chunk limits.
+ *
+ * @param[out] max_frames The maximum number of frames per read, 0 for no limit
+ * @param[out] max_bytes The maximum number of bytes per read, 0 for no limit
+ */
+void Camera::getReadChunkSize(int& max_frames, int& max_bytes) {
+	DEB_MEMBER_FUNCT();
+	max_frames = m_chunk_frames;
+	max_bytes = m_chunk_bytes;
+	DEB_RETURN() << DEB_VAR2(max_frames, max_bytes);
+}
+
+/*
+ * Number of frames, at most nframes, to read with the next read command.
+ * At least one frame is read whatever the byte limit.
+ */
+int Camera::getChunkFrames(int nframes, int frame_size) {
+	if (m_chunk_frames > 0 && nframes > m_chunk_frames)
+		nframes = m_chunk_frames;
+	if (m_chunk_bytes > 0 && frame_size > 0) {
+		int max_frames = m_chunk_bytes / frame_size;
+		if (max_frames < 1)
+			max_frames = 1;
+		if (nframes > max_frames)
+			nframes = max_frames;
+	}
+	return nframes;
+}
+
+/**
+ * Enable the dark subtraction and gain correction of the frames before they
+ * are handed to LImA: out = (raw - dark) * gain. Bpp32 frames are clipped at 0,
+ * use Bpp32F to keep negative values.
+ *
+ * @param[in] enable true to correct the frames
+ */
+void Camera::setCorrection(bool enable) {
+	DEB_MEMBER_FUNCT();
+	m_processor.setCorrection(enable);
+}
+
+/**
+ * Get whether the frames are corrected.
+ *
+ * @param[out] enable true if the frames are corrected
+ */
+void Camera::getCorrection(bool& enable) {
+	DEB_MEMBER_FUNCT();
+	enable = m_processor.getCorrection();
+	DEB_RETURN() << DEB_VAR1(enable);
+}
+
+/**
+ * Load the dark used for acquisitions with a given exposure time. The dark of
+ * the exposure time of the acquisition is selected in prepareAcq.
+ *
+ * @param[in] exp_time The exposure time in seconds
+ * @param[in] dark The dark value of each pixel
+ * @param[in] npixels The number of pixels in dark
+ */
+void Camera::setDark(double exp_time, const float* dark, int npixels) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR2(exp_time, npixels);
+	m_processor.setDark((int) round(exp_time / clockPeriod()), dark, npixels);
+}
+
+/**
+ * Forget all the darks loaded with setDark.
+ */
+void Camera::clearDarks() {
+	DEB_MEMBER_FUNCT();
+	m_processor.clearDarks();
+}
+
+/**
+ * Load the gain (flat field) factor of each pixel.
+ *
+ * @param[in] gain The gain factor of each pixel
+ * @param[in] npixels The number of pixels in gain
+ */
+void Camera::setGain(const float* gain, int npixels) {
+	DEB_MEMBER_FUNCT();
+	m_processor.setGain(gain, npixels);
+}
+
+/**
+ * Forget the gain loaded with setGain, a gain of 1 is used.
+ */
+void Camera::clearGain() {
+	DEB_MEMBER_FUNCT();
+	m_processor.clearGain();
+}
+
+/**
+ * Replace the dead pixels set with setDeadPixels by a linear interpolation
+ * of the nearest good pixels on each side before the frames are handed to LImA.
+ *
+ * @param[in] enable true to interpolate the dead pixels
+ */
+void Camera::setDeadPixelInterpolation(bool enable) {
+	DEB_MEMBER_FUNCT();
+	m_processor.setInterpolation(enable);
+}
+
+/**
+ * Get whether the dead pixels are interpolated.
+ *
+ * @param[out] enable true if the dead pixels are interpolated
+ */
+void Camera::getDeadPixelInterpolation(bool& enable) {
+	DEB_MEMBER_FUNCT();
+	enable = m_processor.getInterpolation();
+	DEB_RETURN() << DEB_VAR1(enable);
+}
+
+/**
+ * Sum consecutive detector frames into each frame handed to LImA, using 64 bit
+ * accumulators. The detector acquires nb_frames times the LImA number of
+ * frames. Bpp32 frames hold the sum, shifted right by setAccumulationShift(),
+ * Bpp32F frames the mean, computed in double precision. The dark and gain
+ * correction is applied to the accumulated frame. A sum beyond 32 bits once
+ * shifted fails the acquisition, see getAcqError().
+ *
+ * @param[in] nb_frames The number of detector frames per LImA frame, 1 for no accumulation
+ */
+void Camera::setAccumulation(int nb_frames) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(nb_frames);
+	if (nb_frames < 1) {
+		THROW_HW_ERROR(InvalidValue) << "Invalid number of accumulated frames " << nb_frames;
+	}
+	m_nb_accumulate = nb_frames;
+}
+
+/**
+ * Get the number of detector frames summed in each LImA frame.
+ *
+ * @param[out] nb_frames The number of detector frames per LImA frame
+ */
+void Camera::getAccumulation(int& nb_frames) {
+	DEB_MEMBER_FUNCT();
+	nb_frames = m_nb_accumulate;
+	DEB_RETURN() << DEB_VAR1(nb_frames);
+}
+
+/**
+ * Shift the accumulated sums right before writing them to Bpp32 frames, so
+ * that long accumulations keep their most significant bits. The sums are
+ * rounded to the nearest integer.
+ *
+ * @param[in] shift The number of bits dropped, 0 to 31
+ */
+void Camera::setAccumulationShift(int shift) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(shift);
+	if (shift < 0 || shift > 31) {
+		THROW_HW_ERROR(InvalidValue) << "Invalid accumulation shift " << shift;
+	}
+	m_acc_shift = shift;
+}
+
+/**
+ * Get the right shift of the accumulated sums in Bpp32 frames.
+ *
+ * @param[out] shift The number of bits dropped
+ */
+void Camera::getAccumulationShift(int& shift) {
+	DEB_MEMBER_FUNCT();
+	shift = m_acc_shift;
+	DEB_RETURN() << DEB_VAR1(shift);
+}
+
+/**
+ * Concatenate consecutive detector frames, after accumulation, as the rows of
+ * each frame handed to LImA. The image becomes nb_frames strips high and LImA
+ * gets one callback for each of them. The detector acquires nb_frames times
+ * the LImA number of frames.
+ *
+ * @param[in] nb_frames The number of strips in a LImA frame, 1 for no concatenation
+ */
+void Camera::setConcatFrames(int nb_frames) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(nb_frames);
+	if (nb_frames < 1) {
+		THROW_HW_ERROR(InvalidValue) << "Invalid number of concatenated frames " << nb_frames;
+	}
+	if (nb_frames == m_nb_concat)
+		return;
+	m_nb_concat = nb_frames;
+	maxImageSizeChanged(Size(m_npixels, m_nb_concat), m_image_type);
+}
+
+/**
+ * Get the number of strips in a LImA frame
+ *
+ * @param[out] nb_frames The number of strips in a LImA frame
+ */
+void Camera::getConcatFrames(int& nb_frames) {
+	DEB_MEMBER_FUNCT();
+	nb_frames = m_nb_concat;
+	DEB_RETURN() << DEB_VAR1(nb_frames);
+}
+
+/**
+ * Select how the acquisition thread waits for frames to complete.
+ *
+ * @param[in] mode selected from {@link #FrameWaitType}
+ */
+void Camera::setFrameWaitMode(FrameWaitType mode) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(mode);
+	m_frame_wait = mode;
+}
+
+/**
+ * Get the frame completion wait mode.
+ *
+ * @param[out] mode {@link #FrameWaitType}
+ */
+void Camera::getFrameWaitMode(FrameWaitType& mode) {
+	DEB_MEMBER_FUNCT();
+	mode = m_frame_wait;
+	DEB_RETURN() << DEB_VAR1(mode);
+}
+
+/*
+ * Delay in us before polling the status again when no new frame is complete
+ */
+int Camera::getPollInterval() {
+	const int min_interval = 100;
+	const int max_interval = 100000;
+	switch (m_frame_wait) {
+	case XhWaitServer:
+	case XhWaitAdaptive: {
+		// without server support, server wait polls as adaptive does
+		if (m_frame_wait == XhWaitServer && m_server_wait)
+			return 0;
+		// half a frame time, so a frame is seen at most half a frame late
+		int interval = (int) (m_frame_time * 1e6 / 2);
+		if (interval < min_interval)
+			return min_interval;
+		return (interval > max_interval) ? max_interval : interval;
+	}
+	case XhWaitPoll:
+	default:
+		return 1000;
+	}
+}
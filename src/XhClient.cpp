@@ -29,6 +29,8 @@
 #include <iostream>
 #include <string>
 #include <iomanip>
+#include <iterator>
+#include <cctype>
 #include <cmath>
 #include <cstring>
 
@@ -44,24 +46,54 @@
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <limits.h>
 #include <signal.h>
 
 #include "XhClient.h"
 #include "lima/ThreadUtils.h"
 #include "lima/Exceptions.h"
+#include "lima/Timestamp.h"
 #include "lima/Debug.h"
 
 //static char errorMessage[1024];
 
-const int MAX_ERRMSG = 1024;
 const int CR = '\15';				// carriage return
 const int LF = '\12';				// line feed
 const char QUIT[] = "quit\n";		// sent using 'send'
+const int MAX_PIPELINE = 64;		// most commands on the socket without reading their responses
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
 
 using namespace std;
 using namespace lima;
 using namespace lima::Xh;
 
+/*
+ * Writes the queued commands and parses the responses of one client
+ */
+class XhClient::IoThread: public Thread {
+DEB_CLASS_NAMESPC(DebModCamera, "XhClient", "IoThread");
+public:
+	IoThread(XhClient& client) : m_client(client) {
+		pthread_attr_setscope(&m_thread_attr, PTHREAD_SCOPE_PROCESS);
+	}
+
+protected:
+	virtual void threadFunction() {
+		m_client.ioLoop();
+	}
+
+private:
+	XhClient& m_client;
+};
+
 XhClient::XhClient() : m_debugMessages() {
 	DEB_CONSTRUCTOR();
 	// Ignore the sigpipe we get we try to send quit to
@@ -72,117 +104,766 @@ XhClient::XhClient() : m_debugMessages() {
 	pipe_act.sa_handler = SIG_IGN;
 	sigaction(SIGPIPE, &pipe_act, 0);
 	m_valid = 0;
+	m_skt = -1;
+	m_data_listen_skt = -1;
+	m_data_skt = -1;
+	m_data_stream = false;
+	m_shm = 0;
+	m_shm_size = 0;
+	m_shm_seq = 0;
+	m_batch = 0;
+	m_trace = 0;
+	m_trace_conn = 0;
+	m_io_quit = false;
+	m_closing = false;
+	m_nb_requests = 0;
+	m_nb_written = 0;
+	m_at_prompt = false;
+	m_out_pos = 0;
+	m_want_out = false;
+	m_rcvbuf = 0;
+	m_quickack = false;
+	m_busy_poll = 0;
+	if ((m_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		THROW_HW_ERROR(Error) << "Cannot create epoll instance";
+	}
+	if ((m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		close(m_epoll_fd);
+		THROW_HW_ERROR(Error) << "Cannot create eventfd";
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = m_wake_fd;
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &ev);
+	m_io_thread = new IoThread(*this);
+	m_io_thread->start();
 }
 
 XhClient::~XhClient() {
 	DEB_DESTRUCTOR();
+	disconnectFromServer();
+	AutoMutex aLock(m_cond.mutex());
+	m_io_quit = true;
+	wakeIoThread();
+	aLock.unlock();
+	m_io_thread->join();
+	delete m_io_thread;
+	close(m_wake_fd);
+	close(m_epoll_fd);
 }
 
-void XhClient::sendWait(string cmd) {
+/*
+ * Send a command and return at once, the reply is filled in when the
+ * response comes. Commands are sent and answered in the order of the calls.
+ */
+void XhClient::sendAsync(const string& cmd, XhReply& reply) {
+	DEB_MEMBER_FUNCT();
+	DEB_TRACE() << "sendAsync(" << cmd << ")";
+	AutoMutex aLock(m_cond.mutex());
+	flushBatch();
+	enqueue(cmd, &reply, 0, reply.type);
+}
+
+/*
+ * Like sendAsync, but cmd is not copied: the caller keeps it until the reply
+ * is there. With a reused reply a status poll does not allocate.
+ */
+void XhClient::sendRef(const string& cmd, XhReply& reply) {
+	DEB_MEMBER_FUNCT();
+	DEB_TRACE() << "sendRef(" << cmd << ")";
+	AutoMutex aLock(m_cond.mutex());
+	flushBatch();
+	enqueue(cmd, &reply, 0, reply.type, false);
+}
+
+/*
+ * Send a command and return at once, cb is called from the I/O thread with
+ * the reply.
+ */
+void XhClient::sendAsync(const string& cmd, XhReply::Callback& cb, XhReply::ReturnType type) {
+	DEB_MEMBER_FUNCT();
+	DEB_TRACE() << "sendAsync(" << cmd << ")";
+	AutoMutex aLock(m_cond.mutex());
+	flushBatch();
+	enqueue(cmd, 0, &cb, type);
+}
+
+void XhClient::sendWait(const string& cmd) {
 	DEB_MEMBER_FUNCT();
 	int rc;
 	DEB_TRACE() << "sendWait(" << cmd << ")";
 	AutoMutex aLock(m_cond.mutex());
-	if (waitForPrompt() != 0) {
-		disconnectFromServer();
-		THROW_HW_ERROR(Error) << "Time-out before client sent a prompt. Disconnecting.\n";
+	if (m_batch) {
+		m_batch->add(cmd);
+		return;
 	}
-	sendCmd(cmd);
-	if (waitForResponse(rc) < 0) {
-		THROW_HW_ERROR(Error) << "Waiting for response from server";
+	aLock.unlock();
+	sendWait(cmd, rc);
+}
+
+void XhClient::sendWait(const string& cmd, int& value) {
+	DEB_MEMBER_FUNCT();
+	DEB_TRACE() << "sendWait(" << cmd << ")";
+	XhReply reply(XhReply::XhReturnInt);
+	sendRef(cmd, reply);
+	reply.wait();
+	value = reply.ivalue;
+	if (!reply.ok) {
+		THROW_HW_ERROR(Error) << "[ " << reply.error << " ]";
 	}
-	if (rc < 0) {
-		THROW_HW_ERROR(Error) << "[ " << m_errorMessage << " ]";
+}
+
+void XhClient::sendWait(const string& cmd, double& value) {
+	DEB_MEMBER_FUNCT();
+	DEB_TRACE() << "sendWait(" << cmd << ")";
+	XhReply reply(XhReply::XhReturnDouble);
+	sendRef(cmd, reply);
+	reply.wait();
+	value = reply.dvalue;
+	if (!reply.ok) {
+		THROW_HW_ERROR(Error) << "[ " << reply.error << " ]";
 	}
 }
 
-void XhClient::sendWait(string cmd, int& value) {
+void XhClient::sendWait(const string& cmd, string& value) {
 	DEB_MEMBER_FUNCT();
 	DEB_TRACE() << "sendWait(" << cmd << ")";
-	AutoMutex aLock(m_cond.mutex());
-	if (waitForPrompt() != 0) {
-		disconnectFromServer();
-		THROW_HW_ERROR(Error) << "Time-out before client sent a prompt. Disconnecting.\n";
+	XhReply reply(XhReply::XhReturnString);
+	// parsed straight into the caller's buffer
+	reply.svalue.swap(value);
+	try {
+		sendRef(cmd, reply);
+	} catch (Exception&) {
+		value.swap(reply.svalue);
+		throw;
 	}
-	sendCmd(cmd);
-	if (waitForResponse(value) < 0) {
-		THROW_HW_ERROR(Error) << "! Waiting for response from server";
+	reply.wait();
+	value.swap(reply.svalue);
+	if (!reply.ok) {
+		THROW_HW_ERROR(Error) << "[ " << reply.error << " ]";
 	}
-	if (value < 0) {
-		THROW_HW_ERROR(Error) << "[ " << m_errorMessage << " ]";
+}
+
+/*
+ * Send a command without waiting for its response, errors are only traced
+ */
+void XhClient::sendNowait(const string& cmd) {
+	DEB_MEMBER_FUNCT();
+	DEB_TRACE() << "sendNowait(" << cmd << ")";
+	AutoMutex aLock(m_cond.mutex());
+	flushBatch();
+	enqueue(cmd, 0, 0, XhReply::XhReturnInt);
+}
+
+/*
+ * Send a read command and receive its data block and return value. Reads
+ * from several threads are kept in order with their data blocks, other
+ * commands may be sent meanwhile. The block must fill the scatter list.
+ */
+void XhClient::sendRead(const string& cmd, const struct iovec* iov, int iovcnt) {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_read_mutex);
+	int num = 0, nbytes;
+	for (int i = 0; i < iovcnt; i++)
+		num += iov[i].iov_len;
+	XhReply reply;
+	if (m_shm) {
+		// the block is in the shared memory once the server replied
+		if (num + sizeof(DataStreamHeader) > m_shm_size && setSharedMemory(num) < 0) {
+			THROW_HW_ERROR(Error) << "Cannot enlarge the shared memory to " << num << " bytes [ " << m_errorMessage << " ]";
+		}
+		sendRef(cmd, reply);
+		reply.wait();
+		if (!reply.ok) {
+			THROW_HW_ERROR(Error) << "[ " << reply.error << " ]";
+		}
+		nbytes = getData(iov, iovcnt);
+	} else {
+		sendRef(cmd, reply);
+		try {
+			nbytes = getData(iov, iovcnt);
+		} catch (Exception&) {
+			reply.wait();
+			throw;
+		}
+		reply.wait();
+		if (!reply.ok) {
+			THROW_HW_ERROR(Error) << "[ " << reply.error << " ]";
+		}
+	}
+	if (nbytes != num) {
+		THROW_HW_ERROR(Error) << "Short data block from server (" << nbytes << " bytes, expected " << num << ")";
 	}
 }
 
-void XhClient::sendWait(string cmd, double& value) {
+/*
+ * Send the commands of a batch which are not sent yet and wait for their
+ * responses. Errors returned by the server are kept in the batch, only a
+ * broken connection throws.
+ */
+void XhClient::sendBatch(XhBatch& batch) {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_cond.mutex());
+	flushBatch();
+	queueBatch(batch);
+	aLock.unlock();
+	waitBatch(batch);
+}
+
+/*
+ * Queue the commands without return value, sent with sendWait(cmd), until
+ * endBatch(). Any other command sends the queued ones first, so that the
+ * server sees the commands in order.
+ */
+void XhClient::beginBatch(XhBatch& batch) {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_cond.mutex());
+	flushBatch();
+	m_batch = &batch;
+}
+
+/*
+ * Send the queued commands, stop queueing and wait for all the responses.
+ * The results are in the batch given to beginBatch().
+ */
+void XhClient::endBatch() {
 	DEB_MEMBER_FUNCT();
-	DEB_TRACE() << "sendWait(" << cmd << ")";
 	AutoMutex aLock(m_cond.mutex());
-	if (waitForPrompt() != 0) {
-		disconnectFromServer();
-		THROW_HW_ERROR(Error) << "Time-out before client sent a prompt. Disconnecting.\n";
+	XhBatch* batch = m_batch;
+	m_batch = 0;
+	if (!batch)
+		return;
+	queueBatch(*batch);
+	aLock.unlock();
+	waitBatch(*batch);
+}
+
+void XhClient::flushBatch() {
+	if (m_batch)
+		queueBatch(*m_batch);
+}
+
+/*
+ * Hand the commands of the batch not sent yet to the I/O thread, which keeps
+ * at most MAX_PIPELINE of them on the socket.
+ */
+void XhClient::queueBatch(XhBatch& batch) {
+	DEB_MEMBER_FUNCT();
+	int n = batch.m_results.size();
+	for (; batch.m_nb_sent < n; batch.m_nb_sent++) {
+		XhReply& reply = batch.m_results[batch.m_nb_sent];
+		enqueue(reply.cmd, &reply, 0, reply.type);
 	}
-	sendCmd(cmd);
-	if (waitForResponse(value) < 0) {
-		THROW_HW_ERROR(Error) << "Waiting for response from server";
+}
+
+void XhClient::waitBatch(XhBatch& batch) {
+	for (int i = 0; i < batch.m_nb_sent; i++)
+		batch.m_results[i].wait();
+}
+
+/*
+ * Queue a command for the I/O thread, reply or cb may be 0. Unless copy_cmd,
+ * cmd must stay in place until the reply is done.
+ */
+void XhClient::enqueue(const string& cmd, XhReply* reply, XhReply::Callback* cb, XhReply::ReturnType type, bool copy_cmd) {
+	AutoMutex aLock(m_cond.mutex());
+	if (!m_valid) {
+		THROW_HW_ERROR(Error) << "Not connected to server ";
 	}
-	if (isnan(value)) {
-		THROW_HW_ERROR(Error) << "[ " << m_errorMessage << " ]";
+	// the list entries are recycled, a request in steady state does not allocate
+	if (m_spare_requests.empty())
+		m_spare_requests.push_back(Request());
+	m_requests.splice(m_requests.end(), m_spare_requests, m_spare_requests.begin());
+	m_nb_requests++;
+	Request& req = m_requests.back();
+	req.cb = cb;
+	req.reply = reply ? reply : &req.own;
+	if (copy_cmd) {
+		req.reply->cmd = cmd;
+		req.cmd = &req.reply->cmd;
+	} else {
+		req.cmd = &cmd;
 	}
+	req.reply->type = type;
+	req.reply->ok = false;
+	req.reply->error.clear();
+	req.reply->progress = 0;
+	req.reply->progress_total = 0;
+	req.reply->m_client = this;
+	req.reply->m_done = false;
+	// the I/O thread looks at the queue again when it is done with the others
+	if (m_nb_written == m_nb_requests - 1 && m_nb_written < MAX_PIPELINE)
+		wakeIoThread();
 }
 
-void XhClient::sendWait(string cmd, string& value) {
-	DEB_MEMBER_FUNCT();
-	DEB_TRACE() << "sendWait(" << cmd << ")";
+void XhClient::wakeIoThread() {
+	uint64_t one = 1;
+	if (write(m_wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		DEB_MEMBER_FUNCT();
+		DEB_ERROR() << "Cannot wake up the I/O thread";
+	}
+}
+
+/*
+ * Wait for the reply to be filled in, at most timeout seconds if positive.
+ * Returns false on time-out.
+ */
+bool XhClient::waitReply(const XhReply& reply, double timeout) {
 	AutoMutex aLock(m_cond.mutex());
-	if (waitForPrompt() != 0) {
-		disconnectFromServer();
-		THROW_HW_ERROR(Error) << "Time-out before client sent a prompt. Disconnecting.\n";
+	double end = Timestamp::now() + timeout;
+	while (!reply.m_done) {
+		if (timeout < 0) {
+			m_cond.wait();
+			continue;
+		}
+		double left = end - Timestamp::now();
+		if (left <= 0)
+			return false;
+		m_cond.wait(left);
 	}
-	sendCmd(cmd);
-	if (waitForResponse(value) < 0) {
-		THROW_HW_ERROR(Error) << "Waiting for response from server";
+	return true;
+}
+
+XhReply::XhReply(ReturnType type) :
+		type(type), ok(false), ivalue(0), dvalue(0.), progress(0), progress_total(0), m_client(0), m_done(false) {
+}
+
+/*
+ * Wait for the response, at most timeout seconds if positive. Returns false
+ * if the response is not there yet or the command was not sent.
+ */
+bool XhReply::wait(double timeout) const {
+	if (m_client == 0)
+		return false;
+	return m_client->waitReply(*this, timeout);
+}
+
+/*
+ * Add a command to the batch, returns its index
+ */
+int XhBatch::add(const string& cmd, XhReply::ReturnType type) {
+	XhReply reply(type);
+	reply.cmd = cmd;
+	m_results.push_back(reply);
+	return m_results.size() - 1;
+}
+
+void XhBatch::clear() {
+	m_results.clear();
+	m_nb_sent = 0;
+}
+
+int XhBatch::getNbErrors() const {
+	int nb_errors = 0;
+	for (int i = 0; i < m_nb_sent; i++) {
+		if (!m_results[i].ok)
+			nb_errors++;
 	}
-	if (value.compare("(null)") == 0) {
-		THROW_HW_ERROR(Error) << "[ " << m_errorMessage << " ]";
+	return nb_errors;
+}
+
+/*
+ * The failed commands with their errors, one per line
+ */
+string XhBatch::getErrors() const {
+	stringstream errors;
+	for (int i = 0; i < m_nb_sent; i++) {
+		if (!m_results[i].ok)
+			errors << m_results[i].cmd << ": " << m_results[i].error << "\n";
 	}
+	return errors.str();
+}
+
+XhLineBuffer::XhLineBuffer(int size) :
+		m_buff(size), m_head(0), m_tail(0) {
 }
 
-void XhClient::sendNowait(string cmd) {
+/*
+ * Free space at the end of the buffer, to receive into
+ */
+char* XhLineBuffer::getSpace(int& len) {
+	if (m_head == m_tail) {
+		m_head = m_tail = 0;
+	} else if (m_tail == (int) m_buff.size()) {
+		if (m_head == 0)
+			m_buff.resize(2 * m_buff.size());	// a line longer than the buffer
+		else
+			memmove(&m_buff[0], &m_buff[m_head], m_tail - m_head);
+		m_tail -= m_head;
+		m_head = 0;
+	}
+	len = m_buff.size() - m_tail;
+	return &m_buff[m_tail];
+}
+
+void XhLineBuffer::fill(int len) {
+	m_tail += len;
+}
+
+/*
+ * Get the next prompt ('> ', which has no line feed) or line, without its
+ * line end. A string return value may span several lines. Returns false if
+ * the next line is not complete yet.
+ */
+bool XhLineBuffer::nextLine(const char*& line, int& len) {
+	const char* buff = &m_buff[0];
+	while (m_head < m_tail && (buff[m_head] == CR || buff[m_head] == LF))
+		m_head++;
+	const char* ptr = buff + m_head;
+	const char* end = buff + m_tail;
+	if (end - ptr < 2)
+		return false;
+	if (ptr[0] == '>' && ptr[1] == ' ') {
+		line = ptr;
+		len = 2;
+		m_head += 2;
+		return true;
+	}
+	const char* from = ptr;
+	if (ptr[0] == '*' && end - ptr >= 3 && ptr[2] == '"') {
+		from = (const char*) memchr(ptr + 3, '"', end - ptr - 3);
+		if (from == 0)
+			return false;
+	}
+	const char* lf = (const char*) memchr(from, LF, end - from);
+	if (lf == 0)
+		return false;
+	line = ptr;
+	len = lf - ptr;
+	if (len > 0 && ptr[len - 1] == CR)
+		len--;
+	m_head = lf + 1 - buff;
+	return true;
+}
+
+void XhLineBuffer::clear() {
+	m_head = m_tail = 0;
+}
+
+/*
+ * Read a block of at most num bytes sent by the server on the data port.
+ * Returns the size of the block.
+ */
+int XhClient::getData(void* bptr, int num) {
 	DEB_MEMBER_FUNCT();
-	DEB_TRACE() << "sendNowait(" << cmd << ")";
-	AutoMutex aLock(m_cond.mutex());
-	if (waitForPrompt() != 0) {
-		disconnectFromServer();
-		THROW_HW_ERROR(Error) << "Time-out before client sent a prompt. Disconnecting.\n";
+	struct iovec iov;
+	iov.iov_base = bptr;
+	iov.iov_len = num;
+	return getData(&iov, 1);
+}
+
+/*
+ * Read a block sent by the server on the data port straight into a scatter
+ * list. With a persistent data stream the block comes with a DataStreamHeader
+ * on the long-lived connection, otherwise the server connects to our data
+ * port for this block only. Returns the size of the block, which may be
+ * less than the scatter list: the rest is left as it was.
+ */
+int XhClient::getData(const struct iovec* iov, int iovcnt) {
+	DEB_MEMBER_FUNCT();
+	int num = 0;
+	for (int i = 0; i < iovcnt; i++)
+		num += iov[i].iov_len;
+	if (m_shm) {
+		DataStreamHeader* header = (DataStreamHeader*) m_shm;
+		if (header->magic != DATA_STREAM_MAGIC || (int) header->nbytes > num || header->nbytes > m_shm_size - sizeof(*header)) {
+			THROW_HW_ERROR(Error) << "Bad block header in shared memory (" << header->nbytes << " bytes, expected " << num << ")";
+		}
+		const char* src = m_shm + sizeof(*header);
+		size_t left = header->nbytes;
+		for (int i = 0; i < iovcnt && left > 0; i++) {
+			size_t len = (iov[i].iov_len < left) ? iov[i].iov_len : left;
+			memcpy(iov[i].iov_base, src, len);
+			src += len;
+			left -= len;
+		}
+		// not to be taken for the next block
+		header->magic = 0;
+		if (m_trace)
+			m_trace->record(XhTraceRecord::XhTraceData, m_trace_conn, iov, iovcnt, header->nbytes);
+		return header->nbytes;
+	}
+	if (m_data_stream) {
+		DataStreamHeader header;
+		struct iovec hiov;
+		hiov.iov_base = &header;
+		hiov.iov_len = sizeof(header);
+		if (m_data_skt < 0 && (m_data_skt = acceptData()) < 0) {
+			THROW_HW_ERROR(Error) << "Server could not to connect to our data port";
+		}
+		try {
+			if (readData(m_data_skt, &hiov, 1, sizeof(header)) != sizeof(header)) {
+				THROW_HW_ERROR(Error) << "Data stream closed by server";
+			}
+			if (header.magic != DATA_STREAM_MAGIC || (int) header.nbytes > num) {
+				THROW_HW_ERROR(Error) << "Bad block header on data stream (" << header.nbytes << " bytes, expected " << num << ")";
+			}
+			if (readData(m_data_skt, iov, iovcnt, header.nbytes) != (int) header.nbytes) {
+				THROW_HW_ERROR(Error) << "Data stream closed by server";
+			}
+			if (m_trace)
+				m_trace->record(XhTraceRecord::XhTraceData, m_trace_conn, iov, iovcnt, header.nbytes);
+		} catch (Exception&) {
+			// stream is out of step, the server connects again for the next block
+			close(m_data_skt);
+			m_data_skt = -1;
+			throw;
+		}
+		return header.nbytes;
+	} else {
+		int dataPort = acceptData();
+		if (dataPort < 0) {
+			THROW_HW_ERROR(Error) << "Server could not to connect to our data port";
+		}
+		int nbytes;
+		try {
+			nbytes = readData(dataPort, iov, iovcnt, num);
+		} catch (Exception&) {
+			close(dataPort);
+			throw;
+		}
+		close(dataPort);
+		if (m_trace)
+			m_trace->record(XhTraceRecord::XhTraceData, m_trace_conn, iov, iovcnt, nbytes);
+		return nbytes;
 	}
-	sendCmd(cmd);
 }
 
-void XhClient::getData(void* bptr, int num) {
+/*
+ * Allow the server to connect to our data port.
+ */
+int XhClient::acceptData() {
 	DEB_MEMBER_FUNCT();
-	int rc;
-	int dataPort;
-	int readsize;
-	uint8_t* buffer = (uint8_t*) bptr;
-	// Allow the server to connect to our data port.
 	struct sockaddr_in addr;
-	int size = sizeof(struct sockaddr_in);
-	dataPort = accept(m_data_listen_skt, (struct sockaddr *) &addr, (socklen_t*)&size);
-	if (dataPort < 0) {
-		THROW_HW_ERROR(Error) << "Server could not to connect to our data port";
+	socklen_t size = sizeof(struct sockaddr_in);
+	int skt;
+	while ((skt = accept(m_data_listen_skt, (struct sockaddr *) &addr, &size)) < 0 && errno == EINTR)
+		;
+	if (skt >= 0)
+		tuneDataSocket(skt);
+	return skt;
+}
+
+/*
+ * Set the receive buffer size, quick acknowledgements and busy polling of
+ * the data connections. Applied to the data connections opened from now on,
+ * and to the persistent one.
+ *
+ * @param[in] rcvbuf Socket receive buffer size in bytes, 0 for the system default
+ * @param[in] quickack Acknowledge each segment at once (TCP_QUICKACK)
+ * @param[in] busy_poll Busy poll the device queue for this many us when reading (SO_BUSY_POLL), 0 for none
+ */
+void XhClient::setDataSocketOptions(int rcvbuf, bool quickack, int busy_poll) {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_read_mutex);
+	m_rcvbuf = rcvbuf;
+	m_quickack = quickack;
+	m_busy_poll = busy_poll;
+	// the accepted connections inherit the buffer size, and the window scale with it
+	if (m_data_listen_skt >= 0)
+		tuneDataSocket(m_data_listen_skt);
+	if (m_data_skt >= 0)
+		tuneDataSocket(m_data_skt);
+}
+
+void XhClient::getDataSocketOptions(int& rcvbuf, bool& quickack, int& busy_poll) const {
+	rcvbuf = m_rcvbuf;
+	quickack = m_quickack;
+	busy_poll = m_busy_poll;
+}
+
+void XhClient::tuneDataSocket(int skt) {
+	DEB_MEMBER_FUNCT();
+	int opt;
+	if (m_rcvbuf > 0 && setsockopt(skt, SOL_SOCKET, SO_RCVBUF, &m_rcvbuf, sizeof(m_rcvbuf)) < 0) {
+		DEB_WARNING() << "Cannot set data socket receive buffer to " << m_rcvbuf << " bytes";
+	}
+	opt = m_quickack;
+	setsockopt(skt, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+	// raising it needs CAP_NET_ADMIN
+	if (m_busy_poll > 0 && setsockopt(skt, SOL_SOCKET, SO_BUSY_POLL, &m_busy_poll, sizeof(m_busy_poll)) < 0) {
+		DEB_WARNING() << "Cannot set data socket busy polling to " << m_busy_poll << " us";
+	}
+}
+
+/*
+ * Read up to num bytes into the scatter list, stopping early if the server
+ * closes the connection. Returns the number of bytes read.
+ */
+int XhClient::readData(int skt, const struct iovec* iov, int iovcnt, int num) {
+	DEB_MEMBER_FUNCT();
+	int rc, one = 1;
+	int readsize = num;
+	m_iov.clear();
+	for (int i = 0; i < iovcnt && readsize > 0; i++) {
+		struct iovec v = iov[i];
+		if ((int) v.iov_len > readsize)
+			v.iov_len = readsize;
+		readsize -= v.iov_len;
+		m_iov.push_back(v);
 	}
+	num -= readsize;
 	readsize = num;
-	while (readsize > 0 && (rc = read(dataPort, buffer, readsize)) > 0) {
-		buffer += rc, readsize -= rc;
+	struct iovec *cur = m_iov.empty() ? 0 : &m_iov[0];
+	int left = m_iov.size();
+	while (left > 0) {
+		rc = readv(skt, cur, (left < IOV_MAX) ? left : IOV_MAX);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			THROW_HW_ERROR(Error) << "Read error from data port " << skt;
+		}
+		if (rc == 0)
+			break;
+		// the kernel leaves quick ack mode on its own, set it again
+		if (m_quickack)
+			setsockopt(skt, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+		readsize -= rc;
+		while (left > 0 && rc >= (int) cur->iov_len) {
+			rc -= cur->iov_len;
+			cur++, left--;
+		}
+		if (left > 0) {
+			cur->iov_base = (uint8_t*) cur->iov_base + rc;
+			cur->iov_len -= rc;
+		}
+	}
+	return num - readsize;
+}
+
+/*
+ * Select how the server sends data blocks. In persistent mode the server
+ * keeps one data connection open for the whole session and frames each
+ * block with a DataStreamHeader, otherwise it connects back to our data
+ * port for every block. Older servers only know the connect-back mode.
+ *
+ * @return 0 if the mode is active, -1 if the server refused it
+ */
+int XhClient::setDataStream(bool persistent) {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_read_mutex);
+	if (persistent == m_data_stream)
+		return 0;
+	if (m_shm) {
+		// used when going back from shared memory
+		m_data_stream = persistent;
+		return 0;
+	}
+	XhReply reply;
+	sendAsync(persistent ? "port-mode persistent" : "port-mode connect-back", reply);
+	reply.wait();
+	if (!reply.ok) {
+		DEB_TRACE() << "Server refused data port mode: " << reply.error;
+		return -1;
+	}
+	if (m_data_skt >= 0) {
+		close(m_data_skt);
+		m_data_skt = -1;
 	}
-	close(dataPort);
-	if (rc < 0) {
-		THROW_HW_ERROR(Error) << "Read error from data port " << dataPort;
+	m_data_stream = persistent;
+	return 0;
+}
+
+bool XhClient::isDataStream() const {
+	return m_data_stream;
+}
+
+/*
+ * Have a server running on this host put the data blocks in a shared memory
+ * area of size bytes, each with a DataStreamHeader in front, instead of
+ * sending them on a data connection. The area is created here and opened by
+ * the server by name, the name is removed once the server has it. Reads of
+ * larger blocks enlarge it. Size 0 goes back to the data connection.
+ *
+ * @return 0 if the mode is active, -1 if the server refused it
+ */
+int XhClient::setSharedMemory(size_t size) {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_read_mutex);
+	XhReply reply;
+	if (size == 0) {
+		if (m_shm == 0)
+			return 0;
+		sendAsync(m_data_stream ? "port-mode persistent" : "port-mode connect-back", reply);
+		reply.wait();
+		releaseSharedMemory();
+		if (!reply.ok) {
+			m_errorMessage = reply.error;
+			return -1;
+		}
+		return 0;
+	}
+	size += sizeof(DataStreamHeader);
+	char name[64];
+	snprintf(name, sizeof(name), "/xh-%d-%lx-%d", getpid(), (unsigned long) this, ++m_shm_seq);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		m_errorMessage = "can't create shared memory";
+		return -1;
+	}
+	void* ptr = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		shm_unlink(name);
+		m_errorMessage = "can't map shared memory";
+		return -1;
+	}
+	((DataStreamHeader*) ptr)->magic = 0;
+	stringstream cmd;
+	cmd << "port-mode shm " << name << " " << size;
+	try {
+		sendAsync(cmd.str(), reply);
+		reply.wait();
+	} catch (Exception&) {
+		shm_unlink(name);
+		munmap(ptr, size);
+		throw;
+	}
+	shm_unlink(name);
+	if (!reply.ok) {
+		DEB_TRACE() << "Server refused shared memory: " << reply.error;
+		m_errorMessage = reply.error;
+		munmap(ptr, size);
+		return -1;
 	}
+	releaseSharedMemory();
+	if (m_data_skt >= 0) {
+		close(m_data_skt);
+		m_data_skt = -1;
+	}
+	m_shm = (char*) ptr;
+	m_shm_size = size;
+	return 0;
 }
 
 /*
- * Connect to remote server
+ * Size of the shared memory area, 0 if the data comes on a data connection
+ */
+size_t XhClient::getSharedMemorySize() const {
+	return m_shm ? m_shm_size - sizeof(DataStreamHeader) : 0;
+}
+
+void XhClient::releaseSharedMemory() {
+	if (m_shm) {
+		munmap(m_shm, m_shm_size);
+		m_shm = 0;
+		m_shm_size = 0;
+	}
+}
+
+/*
+ * False once the connection is closed or lost
+ */
+bool XhClient::isConnected() const {
+	AutoMutex aLock(m_cond.mutex());
+	return m_valid;
+}
+
+/*
+ * Connect to remote server, or to a server on this host listening on the
+ * unix-domain socket at hostname if it starts with '/'
  */
 int XhClient::connectToServer(const string hostname, int port) {
 	DEB_MEMBER_FUNCT();
@@ -190,59 +871,120 @@ int XhClient::connectToServer(const string hostname, int port) {
 	struct protoent *protocol;
 	int opt;
 	int rc = 0;
+	int skt;
 
 	if (m_valid) {
 		m_errorMessage = "Already connected to server";
 		return -1;
 	}
-	if ((host = gethostbyname(hostname.c_str())) == 0) {
-		m_errorMessage = "can't get gethostbyname";
+	if (hostname.length() > 0 && hostname[0] == '/') {
+		// da.server on this host, listening on a unix-domain socket
+		if ((skt = connectUnix(hostname)) < 0)
+			return -1;
+	} else {
+		if ((host = gethostbyname(hostname.c_str())) == 0) {
+			m_errorMessage = "can't get gethostbyname";
+			endhostent();
+			return -1;
+		}
+		if ((skt = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+			m_errorMessage = "can't create socket";
+			endhostent();
+			return -1;
+		}
+		m_remote_addr.sin_family = host->h_addrtype;
+		m_remote_addr.sin_port = htons (port);
+		size_t len = host->h_length;
+		memcpy(&m_remote_addr.sin_addr.s_addr, host->h_addr, len);
 		endhostent();
+		if (connect(skt, (struct sockaddr *) &m_remote_addr, sizeof(struct sockaddr_in)) == -1) {
+			close(skt);
+			m_errorMessage = "Connection to server refused. Is the server running?";
+			return -1;
+		}
+		protocol = getprotobyname("tcp");
+		if (protocol == 0) {
+			m_errorMessage = "Cannot get protocol TCP\n";
+			rc = -1;
+		} else {
+			opt = 1;
+			if (setsockopt(skt, protocol->p_proto, TCP_NODELAY, (char *) &opt, 4) < 0) {
+				m_errorMessage = "Cannot Set socket options";
+				rc = -1;
+			}
+		}
+		endprotoent();
+	}
+	m_data_port = -1;
+	m_data_listen_skt = -1;
+	m_data_skt = -1;
+	m_data_stream = false;
+	releaseSharedMemory();
+	// hand the socket over to the I/O thread
+	AutoMutex aLock(m_cond.mutex());
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = skt;
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, skt, &ev) < 0) {
+		close(skt);
+		m_errorMessage = "Cannot watch the socket";
+		return -1;
+	}
+	m_skt = skt;
+	m_at_prompt = false;
+	m_valid = 1;
+	if (m_trace) {
+		stringstream addr;
+		addr << hostname << ":" << port;
+		m_trace->record(XhTraceRecord::XhTraceConnect, m_trace_conn, addr.str().data(), addr.str().length());
+	}
+	return rc;
+}
+
+/*
+ * Connect to the unix-domain socket at path, returns the socket or -1
+ */
+int XhClient::connectUnix(const string& path) {
+	struct sockaddr_un addr;
+	int skt;
+	if (path.length() >= sizeof(addr.sun_path)) {
+		m_errorMessage = "Socket path too long: " + path;
 		return -1;
 	}
-	if ((m_skt = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+	if ((skt = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
 		m_errorMessage = "can't create socket";
-		endhostent();
 		return -1;
 	}
-	m_remote_addr.sin_family = host->h_addrtype;
-	m_remote_addr.sin_port = htons (port);
-	size_t len = host->h_length;
-	memcpy(&m_remote_addr.sin_addr.s_addr, host->h_addr, len);
-	endhostent();
-	if (connect(m_skt, (struct sockaddr *) &m_remote_addr, sizeof(struct sockaddr_in)) == -1) {
-		close(m_skt);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+	if (connect(skt, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		close(skt);
 		m_errorMessage = "Connection to server refused. Is the server running?";
 		return -1;
 	}
-	protocol = getprotobyname("tcp");
-	if (protocol == 0) {
-		m_errorMessage = "Cannot get protocol TCP\n";
-		rc = -1;
-	} else {
-		opt = 1;
-		if (setsockopt(m_skt, protocol->p_proto, TCP_NODELAY, (char *) &opt, 4) < 0) {
-			m_errorMessage = "Cannot Set socket options";
-			rc = -1;
-		}
-	}
-	endprotoent();
-	m_valid = 1;
-	m_data_port = -1;
-	m_data_listen_skt = -1;
-	m_prompts = 0;
-	m_num_read = 0;
-	m_cur_pos = 0;
-	return rc;
+	return skt;
 }
 
 void XhClient::disconnectFromServer() {
 	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_cond.mutex());
 	if (m_valid) {
-		send(m_skt, QUIT, strlen(QUIT), 0);
-		shutdown(m_skt, 2);
-		close(m_skt);
-		m_valid = 0;
+		// the I/O thread sends quit and fails the commands in flight
+		m_closing = true;
+		wakeIoThread();
+		while (m_closing)
+			m_cond.wait();
+	}
+	aLock.unlock();
+	releaseSharedMemory();
+	if (m_data_skt >= 0) {
+		close(m_data_skt);
+		m_data_skt = -1;
+	}
+	if (m_data_listen_skt >= 0) {
+		close(m_data_listen_skt);
+		m_data_listen_skt = -1;
 	}
 }
 
@@ -261,6 +1003,7 @@ int XhClient::initServerDataPort() {
 			m_errorMessage = "can't set socket options";
 			return -1;
 		}
+		tuneDataSocket(m_data_listen_skt);
 		// Bind the listening socket so that the server may connect to it.
 		// Create a unique port number for the server to connect to.
 		// Assign a port number at random. Allow anyone to connect.
@@ -283,382 +1026,311 @@ int XhClient::initServerDataPort() {
 			return -1;
 		}
 		m_data_port = ntohs (data_addr.sin_port);
-		if (waitForPrompt() == -1)
-			return -1;
 		stringstream ss;
 		ss << "port " << m_data_port;
-		sendCmd(ss.str());
-		int null = 0;
-		if (waitForResponse(null) == -1)
+		XhReply reply;
+		sendAsync(ss.str(), reply);
+		reply.wait();
+		if (!reply.ok) {
+			m_errorMessage = reply.error;
 			return -1;
+		}
 	}
 
 	return m_data_port;
 }
 
 string XhClient::getErrorMessage() const {
+	AutoMutex aLock(m_cond.mutex());
 	return m_errorMessage;
 }
 
+/*
+ * Record the commands, the server output and the data blocks in trace under
+ * connection number conn. 0 stops recording, the trace must outlive the
+ * client or be removed first.
+ */
+void XhClient::setTrace(XhTraceWriter* trace, int conn) {
+	AutoMutex rLock(m_read_mutex);
+	AutoMutex aLock(m_cond.mutex());
+	m_trace = trace;
+	m_trace_conn = conn;
+}
+
+/*
+ * Debug messages ('# ') of the last response
+ */
 vector<string> XhClient::getDebugMessages() const {
+	AutoMutex aLock(m_cond.mutex());
 	return m_debugMessages;
 }
 
-void XhClient::sendCmd(const string cmd) {
+/*
+ * Body of the I/O thread. Moves the queued commands to the output buffer,
+ * writes them, and parses the responses from the command socket, sleeping in
+ * epoll_wait until the socket or the wake-up eventfd is ready.
+ */
+void XhClient::ioLoop() {
 	DEB_MEMBER_FUNCT();
-	int r, len;
-	char *p;
-	string command = cmd + "\n";
-	if (!m_valid) {
-		THROW_HW_ERROR(Error) << "Not connected to server ";
-	}
-	len = command.length();
-	p = (char*) command.c_str();
-	while (len > 0 && (r = send(m_skt, p, len, 0)) > 0)
-		p += r, len -= r;
+	struct epoll_event events[2];
+	vector<Request> ready;
+	AutoMutex aLock(m_cond.mutex());
+
+	while (!m_io_quit) {
+		if (m_closing) {
+			if (m_valid)
+				send(m_skt, QUIT, strlen(QUIT), MSG_DONTWAIT);
+			connectionLost("Disconnected from server");
+			m_closing = false;
+			m_cond.broadcast();
+			continue;
+		}
+		list<Request>::iterator next = m_requests.begin();
+		advance(next, m_nb_written);
+		while (m_valid && m_nb_written < m_nb_requests && m_nb_written < MAX_PIPELINE) {
+			const string& cmd = *(next++)->cmd;
+			m_nb_written++;
+			if (m_trace)
+				m_trace->record(XhTraceRecord::XhTraceCommand, m_trace_conn, cmd.data(), cmd.length());
+			m_out += cmd;
+			m_out += '\n';
+		}
+		int skt = m_valid ? m_skt : -1;
+		aLock.unlock();
+
+		string lost;
+		int nread = 0;
+		char* received = 0;
+		if (skt >= 0 && !writeOut(skt))
+			lost = "server write error (disconnected?)";
+		int nevents = lost.empty() ? epoll_wait(m_epoll_fd, events, 2, -1) : 0;
+		for (int i = 0; i < nevents; i++) {
+			if (events[i].data.fd == m_wake_fd) {
+				uint64_t count;
+				while (read(m_wake_fd, &count, sizeof(count)) > 0)
+					;
+			} else if (events[i].data.fd == skt && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+				int space;
+				received = m_rd_buff.getSpace(space);
+				while ((nread = recv(skt, received, space, MSG_DONTWAIT)) < 0 && errno == EINTR)
+					;
+				if (nread == 0 || (nread < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+					lost = "server read error (disconnected?)";
+			}
+		}
 
-	if (r <= 0) {
-		THROW_HW_ERROR(Error) << "Sending command " << cmd << " to server failed";
+		aLock.lock();
+		if (nread > 0) {
+			if (m_trace)
+				m_trace->record(XhTraceRecord::XhTraceServer, m_trace_conn, received, nread);
+			m_rd_buff.fill(nread);
+			parseInput();
+		}
+		if (!lost.empty() && skt == m_skt)
+			connectionLost(lost);
+		if (!m_ready.empty()) {
+			ready.swap(m_ready);
+			aLock.unlock();
+			for (unsigned int i = 0; i < ready.size(); i++)
+				ready[i].cb->replyReady(ready[i].own);
+			ready.clear();
+			aLock.lock();
+		}
 	}
 }
 
-int XhClient::waitForPrompt() {
-	DEB_MEMBER_FUNCT();
-	int r;
-	char tmp;
-
-	if (!m_valid) {
-		THROW_HW_ERROR(Error) << "Not connected to server ";
+/*
+ * Write as much of the output buffer as the socket takes, and wait for
+ * EPOLLOUT while some is left. Returns false if the connection is broken.
+ */
+bool XhClient::writeOut(int skt) {
+	while (m_out_pos < (int) m_out.length()) {
+		int r = send(skt, m_out.data() + m_out_pos, m_out.length() - m_out_pos, MSG_DONTWAIT);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (r <= 0)
+			return false;
+		m_out_pos += r;
 	}
-	DEB_TRACE() << "checking connection with recv";
-	r = recv(m_skt, &tmp, 1, MSG_PEEK | MSG_DONTWAIT);
-	if (r == 0 || (r < 0 && errno != EWOULDBLOCK)) {
-		DEB_TRACE() << "waitForPrompt: Connection broken, r= " << r << " errno=" << errno;
-		return -1;
+	bool want_out = m_out_pos < (int) m_out.length();
+	if (!want_out) {
+		m_out.clear();
+		m_out_pos = 0;
 	}
-	if (m_prompts == 0) {
-		do {
-			r = nextLine(0, 0, 0, 0, 0, 0);
-		} while (r != CLN_NEXT_PROMPT);
-	} else {
-		m_prompts--;
+	if (want_out != m_want_out) {
+		struct epoll_event ev;
+		ev.events = want_out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		ev.data.fd = skt;
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, skt, &ev);
+		m_want_out = want_out;
 	}
-	return 0;
+	return true;
 }
 
 /*
- *  Wait for an integer response
+ * Handle the complete lines received
  */
-int XhClient::waitForResponse(int& value) {
-	DEB_MEMBER_FUNCT();
-	int r, code, done, outoff;
-	string errmsg;
-	m_debugMessages.clear();
-
-	if (!m_valid) {
-		THROW_HW_ERROR(Error) << "Not connected to server ";
-	}
-	for (;;) {
-		r = nextLine(&errmsg, &code, 0, 0, &done, &outoff);
-		switch (r) {
-		case CLN_NEXT_PROMPT:
-			error_handler("(warning) No return code from the server.");
-			m_prompts++;
-			return -1;
-		case CLN_NEXT_ERRMSG:
-			errmsg_handler(errmsg);
-			break;
-		case CLN_NEXT_DEBUGMSG:
-			debugmsg_handler(errmsg);
-			break;
-		case CLN_NEXT_UNKNOWN:
-			error_handler("Unknown string from server: "+ errmsg);
-			break;
-		case CLN_NEXT_TIMEBAR:
-			timebar_handler(done, outoff, errmsg);
-			break;
-		case CLN_NEXT_INTRET:
-			value = code;
-			return 0;
-		case CLN_NEXT_DBLRET:
-			error_handler("Unexpected double return code.");
-			return -1;
-		case CLN_NEXT_STRRET:
-			error_handler("Server responded with a string.");
-			return -1;
-		default:
-			THROW_HW_ERROR(Error) << "Programming error. Please report";
-		}
-	}
-	return 0;
+void XhClient::parseInput() {
+	const char* line;
+	int len;
+	while (m_rd_buff.nextLine(line, len))
+		parseLine(line, len);
 }
 
 /*
- *  Wait for an double response
+ * Handle a prompt or a line from the server, len excludes the line end
  */
-int XhClient::waitForResponse(double& value) {
+void XhClient::parseLine(const char* line, int len) {
 	DEB_MEMBER_FUNCT();
-	int r, done, outoff;
-	double code;
-	string errmsg;
-	m_debugMessages.clear();
+	const char* text = line + ((len > 2) ? 2 : len);	// after the type and ' '
+	int text_len = line + len - text;
+	int done = 0, outoff = 0;
+	char* end;
 
-	if (!m_valid) {
-		THROW_HW_ERROR(Error) << "Not connected to server ";
-	}
-	for (;;) {
-		r = nextLine(&errmsg, 0, &code, 0, &done, &outoff);
-		switch (r) {
-		case CLN_NEXT_PROMPT:
+	switch (line[0]) {
+	case '>':						// at prompt
+		// two prompts in a row, the command had no response
+		if (m_at_prompt && m_nb_written > 0) {
 			error_handler("(warning) No return code from the server.");
-			m_prompts++;
-			return -1;
-		case CLN_NEXT_ERRMSG:
-			errmsg_handler(errmsg);
-			break;
-		case CLN_NEXT_DEBUGMSG:
-			debugmsg_handler(errmsg);
-			break;
-		case CLN_NEXT_UNKNOWN:
-			error_handler("Unknown string from server: "+ errmsg);
-			break;
-		case CLN_NEXT_TIMEBAR:
-			timebar_handler(done, outoff, errmsg);
-			break;
-		case CLN_NEXT_INTRET:
-			error_handler("Unexpected integer return code.");
-			return -1;
-		case CLN_NEXT_DBLRET:
-			value = code;
-			return 0;
-		case CLN_NEXT_STRRET:
-			error_handler("Server responded with a string.");
-			return -1;
-		default:
-			THROW_HW_ERROR(Error) << "Programming error. Please report";
+			completeRequest(0, 0);
+		}
+		m_at_prompt = true;
+		break;
+	case '!':						// error message
+		errmsg_handler(string(text, text_len));
+		break;
+	case '#':						// comment
+		debugmsg_handler(string(text, text_len));
+		break;
+	case '@':						// timebar message ("done outoff 'text'")
+		// parsed in the receive buffer, strtol must not run into the next line
+		if (text_len > 0 && isdigit(text[0])) {
+			done = strtol(text, &end, 10);
+			if (end + 1 < text + text_len && *end == ' ' && isdigit(end[1]))
+				outoff = strtol(end + 1, 0, 10);
 		}
+		DEB_TRACE() << string(text, text_len);
+		timebar_handler(done, outoff);
+		break;
+	case '*':						// return value
+		m_at_prompt = false;
+		completeRequest(text, text_len);
+		break;
+	default:
+		error_handler("Unknown string from server: " + string(line, len));
+		break;
 	}
-	return 0;
 }
 
 /*
- *  Waits for a string response
+ * Fill in the reply of the oldest command in flight with the return value,
+ * or the error if value is 0. The value is parsed in the receive buffer,
+ * where it is followed by the line end.
  */
-int XhClient::waitForResponse(string& value) {
+void XhClient::completeRequest(const char* value, int len) {
 	DEB_MEMBER_FUNCT();
-	int r, done, outoff;
-	string errmsg;
-	m_debugMessages.clear();
-
-	if (!m_valid) {
-		THROW_HW_ERROR(Error) << "Not connected to server ";
+	if (m_nb_written == 0) {
+		DEB_WARNING() << "Response without a command: " << (value ? string(value, len) : m_cur_error);
+		m_cur_error.clear();
+		return;
 	}
-	for (;;) {
-		r = nextLine(&errmsg, 0, 0, &value, &done, &outoff);
-		switch (r) {
-		case CLN_NEXT_PROMPT:
-			error_handler("(warning) No return code from the server.");
-			m_prompts++;
-			return -1;
-		case CLN_NEXT_ERRMSG:
-			errmsg_handler(errmsg);
-			break;
-		case CLN_NEXT_DEBUGMSG:
-			debugmsg_handler(errmsg);
-			break;
-		case CLN_NEXT_UNKNOWN:
-			error_handler("Unknown string from server.");
-			break;
-		case CLN_NEXT_TIMEBAR:
-			timebar_handler(done, outoff, errmsg);
-			break;
-		case CLN_NEXT_INTRET:
-			error_handler("Server responded with an integer");
-			return -1;
-		case CLN_NEXT_DBLRET:
-			error_handler("Server responded with a double");
-			return -1;
-		case CLN_NEXT_STRRET:
-			return (value.length() == 0) ? -1 : 0;
-		default:
-			THROW_HW_ERROR(Error) << "Programming error. Please report";
-		}
+	Request& req = m_requests.front();
+	XhReply& reply = *req.reply;
+	if (value == 0) {
+		reply.ok = false;
+	} else if (len > 0 && (value[0] == '"' || value[0] == '(')) {
+		// string, '(null)' if none
+		const char* end = (const char*) memchr(value + 1, '"', len - 1);
+		if (value[0] == '"')
+			reply.svalue.assign(value + 1, end ? end - value - 1 : len - 1);
+		else
+			reply.svalue.clear();
+		// an empty string is a value, only '(null)' is an error
+		if (reply.type == XhReply::XhReturnString)
+			reply.ok = value[0] == '"';
+		else
+			error_handler("Server responded with a string.");
+	} else if (reply.type == XhReply::XhReturnInt) {
+		reply.ivalue = strtol(value, 0, 10);
+		reply.ok = reply.ivalue >= 0;
+	} else if (reply.type == XhReply::XhReturnDouble) {
+		reply.dvalue = strtod(value, 0);
+		reply.ok = !isnan(reply.dvalue);
+	} else if (m_cur_error.empty()) {
+		// a refused command answers with a number, keep the server's reason
+		error_handler("Server responded with a number");
 	}
-	return 0;
+	if (!reply.ok) {
+		reply.error = m_cur_error;
+		m_errorMessage = m_cur_error;
+		if (req.reply == &req.own && req.cb == 0)
+			DEB_TRACE() << *req.cmd << ": " << m_cur_error;
+	}
+	m_cur_error.clear();
+	m_debugMessages.swap(m_cur_debug);
+	m_cur_debug.clear();
+	reply.m_done = true;
+	if (req.cb)
+		m_ready.push_back(req);
+	m_spare_requests.splice(m_spare_requests.begin(), m_requests, m_requests.begin());
+	m_nb_requests--;
+	m_nb_written--;
+	m_cond.broadcast();
 }
 
 /*
- * Get the next line from the server
+ * Close the command socket and fail the commands in flight with msg
  */
-int XhClient::nextLine(string *errmsg, int *ivalue, double *dvalue, string *svalue, int *done, int *outoff) {
+void XhClient::connectionLost(const string& msg) {
 	DEB_MEMBER_FUNCT();
-	int r;
-	char timestr[80], *tp;
-	char buff[MAX_ERRMSG + 2];
-	char *bptr = buff;
-	char *bptr2 = buff;
-	int n, len;
-	// Assume we are either at the beginning of a line now, or we are right
-	// at the end of the previous line.
-	do {
-		r = getChar();
-	} while (r == CR || r == LF);
-
-	switch (r) {
-	case -1:						// read error (disconnected?)
-		THROW_HW_ERROR(Error) << "server read error (disconnected?)";
-
-	case '>':						// at prompt
-		getChar();					// discard ' '
-		return CLN_NEXT_PROMPT;
-
-	case '!':						// error message
-		getChar();					// discard ' '
-		while ((r = getChar()) != -1 && r != CR && r != LF) {
-			*bptr++ = r;
-		}
-		*bptr = '\0';
-		if(errmsg != 0)
-			*errmsg = buff;
-		return CLN_NEXT_ERRMSG;
-
-	case '#':						// comment
-		getChar();					// discard ' '
-		while ((r = getChar()) != -1 && r != CR && r != LF) {
-			*bptr++ = r;
-		}
-		*bptr = '\0';
-		if(errmsg != 0)
-			*errmsg = buff;
-			return CLN_NEXT_DEBUGMSG;
-
-	case '@':						// timebar message ("a/b")
-		getChar();					// discard ' '
-		tp = timestr;				// read time message
-		for (;;) {
-			r = getChar();
-			if (r == '\'' || r == '"' || r == CR || r == LF || r == -1)
-				break;
-			*tp++ = r;
-		}
-		*tp = '\0';
-		if (done != 0 && outoff != 0)
-			sscanf(timestr, "%d %d", done, outoff);
-		if (r == '\'' || r == '"') {
-			while ((r = getChar()) != -1 && r != CR && r != LF) {
-				*bptr++ = r;
-			}
-		} else {
-			*bptr = '\0';
-		}
-		*bptr = '\0';
-		len = strlen(buff);
-		if (len > 0 && (bptr2[len - 1] == '\'' || bptr2[len - 1] == '"')) {
-			bptr2[len - 1] = 0;
-		}
-		return CLN_NEXT_TIMEBAR;
-
-	case '*': 						// return value
-		getChar(); 					// discard ' '
-		r = getChar();				// distinguish strings/nums
-		if (r == '(')				// (null)
-		{
-
-			while ((r = getChar()) != -1 && r != ')' && r != CR && r != LF)
-				;
-			if (svalue != 0)
-				*svalue = "";
-			return CLN_NEXT_STRRET;
-		} else if (r == '"') /*		string */
-		{
-			while ((r = getChar()) != -1 && r != '"') {
-				*bptr++ = r;
-			}
-			*bptr = '\0';
-			if (svalue != 0)
-				*svalue = buff;
-			return CLN_NEXT_STRRET;
-		} else {  // integer or double
-			char buffer[80], *p;
-
-			buffer[0] = r;
-			p = &buffer[1];
-
-			while ((r = getChar()) != -1 && r != CR && r != LF)
-				*p++ = r;
-			*p = '\0';
-
-			if (dvalue) {
-				if (strcmp(buffer, "nan") == 0) {
-					*dvalue = NAN;
-				} else {
-					*dvalue = atof(buffer);
-				}
-				return CLN_NEXT_DBLRET;
-			}
-			if (ivalue) {
-				*ivalue = atoi(buffer);
-			}
-			return CLN_NEXT_INTRET;
-		}
-
-	default: // don't know: abort to end of line
-		n = 0;
-		while ((r = getChar()) != -1 && r != CR && r != LF) {
-			if (++n == MAX_ERRMSG)
-				break;
-			*bptr++ = r;
-		}
-		bptr += '\0';
-		if (errmsg != 0)
-			*errmsg = buff;
-		return CLN_NEXT_UNKNOWN;
-	}
-}
-
-int XhClient::getChar() {
-	int r;
-
-	if (!m_valid) {
-		throw Error; //<< "Not connected to xh server ";
+	DEB_TRACE() << msg;
+	if (m_skt >= 0) {
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, m_skt, 0);
+		shutdown(m_skt, SHUT_RDWR);
+		close(m_skt);
+		m_skt = -1;
 	}
-	if (m_num_read == m_cur_pos) {
-		while ((r = recv(m_skt, m_rd_buff, RD_BUFF, 0)) < 0 && errno == EINTR)
-			;
-		if (r <= 0) {
-			return -1;
-		}
-		m_cur_pos = 0;
-		m_num_read = r;
-		m_just_read = 1;
-	} else {
-		m_just_read = 0;
+	m_valid = 0;
+	m_out.clear();
+	m_out_pos = 0;
+	m_want_out = false;
+	m_rd_buff.clear();
+	m_at_prompt = false;
+	m_nb_written = m_nb_requests;
+	while (!m_requests.empty()) {
+		m_cur_error = msg;
+		completeRequest(0, 0);
 	}
-	//std::cout << "[" << m_rd_buff[m_cur_pos] << "]";
-	return m_rd_buff[m_cur_pos++];
-
 }
 
 void XhClient::errmsg_handler(const string errmsg) {
 	DEB_MEMBER_FUNCT();
-	m_errorMessage = errmsg;
-	DEB_TRACE() << m_errorMessage;
+	m_cur_error = errmsg;
+	DEB_TRACE() << m_cur_error;
 }
 
 void XhClient::debugmsg_handler(const string msg) {
 	DEB_MEMBER_FUNCT();
 	DEB_TRACE() << msg;
-	m_debugMessages.push_back(msg);
+	m_cur_debug.push_back(msg);
 }
 
-void XhClient::timebar_handler(int done, int outoff, const string errmsg) {
-	DEB_MEMBER_FUNCT();
-	/* do nothing */
+/*
+ * Keep the progress in the reply of the command in flight
+ */
+void XhClient::timebar_handler(int done, int outoff) {
+	if (m_nb_written == 0)
+		return;
+	XhReply& reply = *m_requests.front().reply;
+	reply.progress = done;
+	reply.progress_total = outoff;
 }
 
 void XhClient::error_handler(const string errmsg) {
 	DEB_MEMBER_FUNCT();
-	m_errorMessage = errmsg;
-	DEB_TRACE() << m_errorMessage;
+	m_cur_error = errmsg;
+	DEB_TRACE() << m_cur_error;
 }
 
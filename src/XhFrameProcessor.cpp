@@ -0,0 +1,870 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2011
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+/*
+ * XhFrameProcessor.cpp
+ * Client side conversion of the frames read from da.server.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define XH_X86_SIMD
+#include <immintrin.h>
+#endif
+#include <cmath>
+#include <algorithm>
+#include "XhFrameProcessor.h"
+#include "lima/Exceptions.h"
+
+using namespace lima;
+using namespace lima::Xh;
+
+FrameProcessor::SimdType FrameProcessor::s_simd = FrameProcessor::getBestSimd();
+
+/*
+ * Scalar kernels, also used for the tails of the vector loops
+ */
+static void widen16Scalar(const uint16_t* src, uint32_t* dst, int npixels) {
+	for (int i = 0; i < npixels; i++)
+		dst[i] = src[i];
+}
+
+template <class T>
+static void deinterleaveScalar(const T* src, T* dst, int first, int npixels) {
+	int half = npixels / 2;
+	for (int i = first; i < half; i++) {
+		dst[i] = src[2 * i];
+		dst[half + i] = src[2 * i + 1];
+	}
+	if (npixels & 1)
+		dst[npixels - 1] = src[npixels - 1];
+}
+
+static void correct32Scalar(const uint32_t* src, const float* dark, const float* gain, uint32_t* dst, int npixels) {
+	for (int i = 0; i < npixels; i++) {
+		float v = ((float) (int32_t) src[i] - dark[i]) * gain[i];
+		// saturate to the 32 bit range as the SIMD kernels do
+		if (v >= 4294967296.f)
+			dst[i] = 0xffffffff;
+		else
+			dst[i] = (v > 0.f) ? (uint32_t) lrintf(v) : 0;
+	}
+}
+
+static void correct32FScalar(const uint32_t* src, const float* dark, const float* gain, float* dst, int npixels) {
+	for (int i = 0; i < npixels; i++)
+		dst[i] = ((float) (int32_t) src[i] - dark[i]) * gain[i];
+}
+
+/*
+ * Dead pixel interpolation, frame[pixel] = frame[left] + (frame[right] - frame[left]) * weight.
+ * Only good pixels are read, so the frame is updated in place.
+ */
+template <class T>
+static void interpolateScalar(T* frame, const int32_t* pixel, const int32_t* left, const int32_t* right,
+		const float* weight, int first, int n) {
+	for (int k = first; k < n; k++) {
+		float l = (float) frame[left[k]];
+		float v = l + ((float) frame[right[k]] - l) * weight[k];
+		frame[pixel[k]] = (T) lrintf(v);
+	}
+}
+
+static void interpolateScalar(float* frame, const int32_t* pixel, const int32_t* left, const int32_t* right,
+		const float* weight, int first, int n) {
+	for (int k = first; k < n; k++) {
+		float l = frame[left[k]];
+		frame[pixel[k]] = l + (frame[right[k]] - l) * weight[k];
+	}
+}
+
+template <class T>
+static void accumulateScalar(uint64_t* acc, const T* src, int first, int npixels) {
+	for (int i = first; i < npixels; i++)
+		acc[i] += src[i];
+}
+
+#ifdef XH_X86_SIMD
+static void widen16SSE2(const uint16_t* src, uint32_t* dst, int npixels) {
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 8 <= npixels; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_unpacklo_epi16(v, zero));
+		_mm_storeu_si128((__m128i*) (dst + i + 4), _mm_unpackhi_epi16(v, zero));
+	}
+	widen16Scalar(src + i, dst + i, npixels - i);
+}
+
+__attribute__((target("avx2")))
+static void widen16AVX2(const uint16_t* src, uint32_t* dst, int npixels) {
+	int i = 0;
+	for (; i + 16 <= npixels; i += 16) {
+		__m128i lo = _mm_loadu_si128((const __m128i*) (src + i));
+		__m128i hi = _mm_loadu_si128((const __m128i*) (src + i + 8));
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_cvtepu16_epi32(lo));
+		_mm256_storeu_si256((__m256i*) (dst + i + 8), _mm256_cvtepu16_epi32(hi));
+	}
+	widen16Scalar(src + i, dst + i, npixels - i);
+}
+
+/*
+ * Even words go to the first half of dst, odd words to the second half.
+ * The 16 bit words are sign extended so that the signed pack keeps them intact.
+ */
+static void deinterleave16SSE2(const uint16_t* src, uint16_t* dst, int npixels) {
+	int half = npixels / 2;
+	int i = 0;
+	for (; i + 8 <= half; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i*) (src + 2 * i));
+		__m128i b = _mm_loadu_si128((const __m128i*) (src + 2 * i + 8));
+		__m128i even = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+		__m128i odd = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+		_mm_storeu_si128((__m128i*) (dst + i), even);
+		_mm_storeu_si128((__m128i*) (dst + half + i), odd);
+	}
+	deinterleaveScalar(src, dst, i, npixels);
+}
+
+__attribute__((target("avx2")))
+static void deinterleave16AVX2(const uint16_t* src, uint16_t* dst, int npixels) {
+	int half = npixels / 2;
+	int i = 0;
+	for (; i + 16 <= half; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i*) (src + 2 * i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (src + 2 * i + 16));
+		// the pack works within 128 bit lanes, the permute puts the quads back in order
+		__m256i even = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16), _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16));
+		__m256i odd = _mm256_packs_epi32(_mm256_srai_epi32(a, 16), _mm256_srai_epi32(b, 16));
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_permute4x64_epi64(even, 0xd8));
+		_mm256_storeu_si256((__m256i*) (dst + half + i), _mm256_permute4x64_epi64(odd, 0xd8));
+	}
+	deinterleaveScalar(src, dst, i, npixels);
+}
+
+static void deinterleave32SSE2(const uint32_t* src, uint32_t* dst, int npixels) {
+	int half = npixels / 2;
+	int i = 0;
+	for (; i + 4 <= half; i += 4) {
+		__m128 a = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) (src + 2 * i)));
+		__m128 b = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) (src + 2 * i + 4)));
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))));
+		_mm_storeu_si128((__m128i*) (dst + half + i), _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+	}
+	deinterleaveScalar(src, dst, i, npixels);
+}
+
+__attribute__((target("avx2")))
+static void deinterleave32AVX2(const uint32_t* src, uint32_t* dst, int npixels) {
+	const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	int half = npixels / 2;
+	int i = 0;
+	for (; i + 8 <= half; i += 8) {
+		__m256i a = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*) (src + 2 * i)), split);
+		__m256i b = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*) (src + 2 * i + 8)), split);
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i*) (dst + half + i), _mm256_permute2x128_si256(a, b, 0x31));
+	}
+	deinterleaveScalar(src, dst, i, npixels);
+}
+
+/*
+ * The correction kernels may work in place, src == dst.
+ * The counts are below 2^31, so the signed conversion is exact. The corrected
+ * values are saturated to [0, 2^32 - 1]: there is only a signed conversion,
+ * values from 2^31 up are converted less 2^31 and the top bit put back.
+ */
+static void correct32SSE2(const uint32_t* src, const float* dark, const float* gain, uint32_t* dst, int npixels) {
+	const __m128 two31 = _mm_set1_ps(2147483648.f);
+	const __m128 two32 = _mm_set1_ps(4294967296.f);
+	int i = 0;
+	for (; i + 4 <= npixels; i += 4) {
+		__m128 v = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) (src + i)));
+		v = _mm_mul_ps(_mm_sub_ps(v, _mm_loadu_ps(dark + i)), _mm_loadu_ps(gain + i));
+		v = _mm_max_ps(v, _mm_setzero_ps());
+		__m128 high = _mm_cmpge_ps(v, two31);
+		__m128i r = _mm_cvtps_epi32(_mm_sub_ps(v, _mm_and_ps(high, two31)));
+		r = _mm_xor_si128(r, _mm_slli_epi32(_mm_castps_si128(high), 31));
+		r = _mm_or_si128(r, _mm_castps_si128(_mm_cmpge_ps(v, two32)));
+		_mm_storeu_si128((__m128i*) (dst + i), r);
+	}
+	correct32Scalar(src + i, dark + i, gain + i, dst + i, npixels - i);
+}
+
+static void correct32FSSE2(const uint32_t* src, const float* dark, const float* gain, float* dst, int npixels) {
+	int i = 0;
+	for (; i + 4 <= npixels; i += 4) {
+		__m128 v = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) (src + i)));
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_sub_ps(v, _mm_loadu_ps(dark + i)), _mm_loadu_ps(gain + i)));
+	}
+	correct32FScalar(src + i, dark + i, gain + i, dst + i, npixels - i);
+}
+
+__attribute__((target("avx2")))
+static void correct32AVX2(const uint32_t* src, const float* dark, const float* gain, uint32_t* dst, int npixels) {
+	const __m256 two31 = _mm256_set1_ps(2147483648.f);
+	const __m256 two32 = _mm256_set1_ps(4294967296.f);
+	int i = 0;
+	for (; i + 8 <= npixels; i += 8) {
+		__m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*) (src + i)));
+		v = _mm256_mul_ps(_mm256_sub_ps(v, _mm256_loadu_ps(dark + i)), _mm256_loadu_ps(gain + i));
+		v = _mm256_max_ps(v, _mm256_setzero_ps());
+		__m256 high = _mm256_cmp_ps(v, two31, _CMP_GE_OQ);
+		__m256i r = _mm256_cvtps_epi32(_mm256_sub_ps(v, _mm256_and_ps(high, two31)));
+		r = _mm256_xor_si256(r, _mm256_slli_epi32(_mm256_castps_si256(high), 31));
+		r = _mm256_or_si256(r, _mm256_castps_si256(_mm256_cmp_ps(v, two32, _CMP_GE_OQ)));
+		_mm256_storeu_si256((__m256i*) (dst + i), r);
+	}
+	correct32Scalar(src + i, dark + i, gain + i, dst + i, npixels - i);
+}
+
+__attribute__((target("avx2")))
+static void correct32FAVX2(const uint32_t* src, const float* dark, const float* gain, float* dst, int npixels) {
+	int i = 0;
+	for (; i + 8 <= npixels; i += 8) {
+		__m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*) (src + i)));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_sub_ps(v, _mm256_loadu_ps(dark + i)), _mm256_loadu_ps(gain + i)));
+	}
+	correct32FScalar(src + i, dark + i, gain + i, dst + i, npixels - i);
+}
+#endif
+
+#ifdef XH_X86_SIMD
+/*
+ * AVX2 has gathers but no scatter, the results are stored one by one
+ */
+__attribute__((target("avx2")))
+static void interpolate32AVX2(uint32_t* frame, const int32_t* pixel, const int32_t* left, const int32_t* right,
+		const float* weight, int n) {
+	int32_t out[8] __attribute__((aligned(32)));
+	int k = 0;
+	for (; k + 8 <= n; k += 8) {
+		__m256 l = _mm256_cvtepi32_ps(_mm256_i32gather_epi32((const int*) frame, _mm256_loadu_si256((const __m256i*) (left + k)), 4));
+		__m256 r = _mm256_cvtepi32_ps(_mm256_i32gather_epi32((const int*) frame, _mm256_loadu_si256((const __m256i*) (right + k)), 4));
+		__m256 v = _mm256_add_ps(l, _mm256_mul_ps(_mm256_sub_ps(r, l), _mm256_loadu_ps(weight + k)));
+		_mm256_store_si256((__m256i*) out, _mm256_cvtps_epi32(v));
+		for (int j = 0; j < 8; j++)
+			frame[pixel[k + j]] = out[j];
+	}
+	interpolateScalar(frame, pixel, left, right, weight, k, n);
+}
+
+__attribute__((target("avx2")))
+static void interpolate32FAVX2(float* frame, const int32_t* pixel, const int32_t* left, const int32_t* right,
+		const float* weight, int n) {
+	float out[8] __attribute__((aligned(32)));
+	int k = 0;
+	for (; k + 8 <= n; k += 8) {
+		__m256 l = _mm256_i32gather_ps(frame, _mm256_loadu_si256((const __m256i*) (left + k)), 4);
+		__m256 r = _mm256_i32gather_ps(frame, _mm256_loadu_si256((const __m256i*) (right + k)), 4);
+		_mm256_store_ps(out, _mm256_add_ps(l, _mm256_mul_ps(_mm256_sub_ps(r, l), _mm256_loadu_ps(weight + k))));
+		for (int j = 0; j < 8; j++)
+			frame[pixel[k + j]] = out[j];
+	}
+	interpolateScalar(frame, pixel, left, right, weight, k, n);
+}
+
+static void accumulate32SSE2(uint64_t* acc, const uint32_t* src, int npixels) {
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 4 <= npixels; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+		__m128i* a = (__m128i*) (acc + i);
+		_mm_storeu_si128(a, _mm_add_epi64(_mm_loadu_si128(a), _mm_unpacklo_epi32(v, zero)));
+		_mm_storeu_si128(a + 1, _mm_add_epi64(_mm_loadu_si128(a + 1), _mm_unpackhi_epi32(v, zero)));
+	}
+	accumulateScalar(acc, src, i, npixels);
+}
+
+__attribute__((target("avx2")))
+static void accumulate32AVX2(uint64_t* acc, const uint32_t* src, int npixels) {
+	int i = 0;
+	for (; i + 8 <= npixels; i += 8) {
+		__m256i lo = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*) (src + i)));
+		__m256i hi = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*) (src + i + 4)));
+		__m256i* a = (__m256i*) (acc + i);
+		_mm256_storeu_si256(a, _mm256_add_epi64(_mm256_loadu_si256(a), lo));
+		_mm256_storeu_si256(a + 1, _mm256_add_epi64(_mm256_loadu_si256(a + 1), hi));
+	}
+	accumulateScalar(acc, src, i, npixels);
+}
+
+__attribute__((target("avx2")))
+static void accumulate16AVX2(uint64_t* acc, const uint16_t* src, int npixels) {
+	int i = 0;
+	for (; i + 4 <= npixels; i += 4) {
+		__m256i v = _mm256_cvtepu16_epi64(_mm_loadl_epi64((const __m128i*) (src + i)));
+		__m256i* a = (__m256i*) (acc + i);
+		_mm256_storeu_si256(a, _mm256_add_epi64(_mm256_loadu_si256(a), v));
+	}
+	accumulateScalar(acc, src, i, npixels);
+}
+#endif
+
+/**
+ * Select the instruction set used by the pixel kernels. A set the processor
+ * does not support is replaced by the best one it does.
+ *
+ * @param[in] simd selected from {@link #SimdType}
+ */
+void FrameProcessor::setSimd(SimdType simd) {
+	DEB_STATIC_FUNCT();
+	SimdType best = getBestSimd();
+	s_simd = (simd > best) ? best : simd;
+	DEB_TRACE() << "using SIMD type " << s_simd;
+}
+
+/**
+ * Get the instruction set used by the pixel kernels.
+ */
+FrameProcessor::SimdType FrameProcessor::getSimd() {
+	return s_simd;
+}
+
+/**
+ * Get the best instruction set supported by the processor.
+ */
+FrameProcessor::SimdType FrameProcessor::getBestSimd() {
+#ifdef XH_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return XhSimdAVX2;
+	return XhSimdSSE2;
+#else
+	return XhSimdScalar;
+#endif
+}
+
+/*
+ * Zero extend 16 bit pixels to 32 bit
+ */
+void FrameProcessor::widen16(const uint16_t* src, uint32_t* dst, int npixels) {
+	switch (s_simd) {
+#ifdef XH_X86_SIMD
+	case XhSimdAVX2:
+		widen16AVX2(src, dst, npixels);
+		break;
+	case XhSimdSSE2:
+		widen16SSE2(src, dst, npixels);
+		break;
+#endif
+	default:
+		widen16Scalar(src, dst, npixels);
+		break;
+	}
+}
+
+/*
+ * Separate the pixels of the two heads: even pixels go to the first half of
+ * the frame, odd pixels to the second half, as the server 'un-interleave' does.
+ */
+void FrameProcessor::deinterleave16(const uint16_t* src, uint16_t* dst, int npixels) {
+	switch (s_simd) {
+#ifdef XH_X86_SIMD
+	case XhSimdAVX2:
+		deinterleave16AVX2(src, dst, npixels);
+		break;
+	case XhSimdSSE2:
+		deinterleave16SSE2(src, dst, npixels);
+		break;
+#endif
+	default:
+		deinterleaveScalar(src, dst, 0, npixels);
+		break;
+	}
+}
+
+/*
+ * 32 bit version of deinterleave16()
+ */
+void FrameProcessor::deinterleave32(const uint32_t* src, uint32_t* dst, int npixels) {
+	switch (s_simd) {
+#ifdef XH_X86_SIMD
+	case XhSimdAVX2:
+		deinterleave32AVX2(src, dst, npixels);
+		break;
+	case XhSimdSSE2:
+		deinterleave32SSE2(src, dst, npixels);
+		break;
+#endif
+	default:
+		deinterleaveScalar(src, dst, 0, npixels);
+		break;
+	}
+}
+
+/*
+ * Dark subtraction and gain correction to Bpp32, negative values are clipped to 0
+ */
+void FrameProcessor::correct32(const uint32_t* src, const float* dark, const float* gain, uint32_t* dst, int npixels) {
+	switch (s_simd) {
+#ifdef XH_X86_SIMD
+	case XhSimdAVX2:
+		correct32AVX2(src, dark, gain, dst, npixels);
+		break;
+	case XhSimdSSE2:
+		correct32SSE2(src, dark, gain, dst, npixels);
+		break;
+#endif
+	default:
+		correct32Scalar(src, dark, gain, dst, npixels);
+		break;
+	}
+}
+
+/*
+ * Dark subtraction and gain correction to Bpp32F
+ */
+void FrameProcessor::correct32F(const uint32_t* src, const float* dark, const float* gain, float* dst, int npixels) {
+	switch (s_simd) {
+#ifdef XH_X86_SIMD
+	case XhSimdAVX2:
+		correct32FAVX2(src, dark, gain, dst, npixels);
+		break;
+	case XhSimdSSE2:
+		correct32FSSE2(src, dark, gain, dst, npixels);
+		break;
+#endif
+	default:
+		correct32FScalar(src, dark, gain, dst, npixels);
+		break;
+	}
+}
+
+/*
+ * Dead pixel interpolation of 16 bit frames
+ */
+void FrameProcessor::interpolate16(uint16_t* frame, const int32_t* pixel, const int32_t* left, const int32_t* right,
+		const float* weight, int n) {
+	interpolateScalar(frame, pixel, left, right, weight, 0, n);
+}
+
+/*
+ * Dead pixel interpolation of 32 bit frames
+ */
+void FrameProcessor::interpolate32(uint32_t* frame, const int32_t* pixel, const int32_t* left, const int32_t* right,
+		const float* weight, int n) {
+#ifdef XH_X86_SIMD
+	if (s_simd == XhSimdAVX2) {
+		interpolate32AVX2(frame, pixel, left, right, weight, n);
+		return;
+	}
+#endif
+	interpolateScalar(frame, pixel, left, right, weight, 0, n);
+}
+
+/*
+ * Dead pixel interpolation of float frames
+ */
+void FrameProcessor::interpolate32F(float* frame, const int32_t* pixel, const int32_t* left, const int32_t* right,
+		const float* weight, int n) {
+#ifdef XH_X86_SIMD
+	if (s_simd == XhSimdAVX2) {
+		interpolate32FAVX2(frame, pixel, left, right, weight, n);
+		return;
+	}
+#endif
+	interpolateScalar(frame, pixel, left, right, weight, 0, n);
+}
+
+/*
+ * Add 16 bit pixels to 64 bit accumulators
+ */
+void FrameProcessor::accumulate16(uint64_t* acc, const uint16_t* src, int npixels) {
+#ifdef XH_X86_SIMD
+	if (s_simd == XhSimdAVX2) {
+		accumulate16AVX2(acc, src, npixels);
+		return;
+	}
+#endif
+	accumulateScalar(acc, src, 0, npixels);
+}
+
+/*
+ * Add 32 bit pixels to 64 bit accumulators
+ */
+void FrameProcessor::accumulate32(uint64_t* acc, const uint32_t* src, int npixels) {
+	switch (s_simd) {
+#ifdef XH_X86_SIMD
+	case XhSimdAVX2:
+		accumulate32AVX2(acc, src, npixels);
+		break;
+	case XhSimdSSE2:
+		accumulate32SSE2(acc, src, npixels);
+		break;
+#endif
+	default:
+		accumulateScalar(acc, src, 0, npixels);
+		break;
+	}
+}
+
+FrameProcessor::FrameProcessor() :
+		m_correction(false), m_cur_dark(0), m_cur_gain(0), m_interpolation(false), m_roi_x(0), m_roi_width(0), m_npixels(0), m_type(Bpp32),
+		m_active(false), m_convert(false), m_nb_accumulate(1), m_acc_count(0), m_acc_shift(0) {
+	DEB_CONSTRUCTOR();
+}
+
+FrameProcessor::~FrameProcessor() {
+	DEB_DESTRUCTOR();
+}
+
+/**
+ * Enable or disable the dark and gain correction
+ *
+ * @param[in] enable true to correct the frames before they are handed to LImA
+ */
+void FrameProcessor::setCorrection(bool enable) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(enable);
+	m_correction = enable;
+}
+
+bool FrameProcessor::getCorrection() const {
+	return m_correction;
+}
+
+/**
+ * Load the dark of an integration time, replacing any previous one
+ *
+ * @param[in] int_time The integration time in clock cycles
+ * @param[in] dark The dark value of each pixel
+ * @param[in] npixels The number of pixels in dark
+ */
+void FrameProcessor::setDark(int int_time, const float* dark, int npixels) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR2(int_time, npixels);
+	m_darks[int_time].assign(dark, dark + npixels);
+}
+
+/**
+ * Forget all the darks
+ */
+void FrameProcessor::clearDarks() {
+	DEB_MEMBER_FUNCT();
+	m_darks.clear();
+}
+
+/**
+ * Load the gain of each pixel
+ *
+ * @param[in] gain The gain factor of each pixel
+ * @param[in] npixels The number of pixels in gain
+ */
+void FrameProcessor::setGain(const float* gain, int npixels) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(npixels);
+	m_gain.assign(gain, gain + npixels);
+}
+
+/**
+ * Forget the gain, a gain of 1 is used
+ */
+void FrameProcessor::clearGain() {
+	DEB_MEMBER_FUNCT();
+	m_gain.clear();
+}
+
+/**
+ * Restrict the frames to a range of pixels. The dark, gain and dead pixel
+ * tables stay in full frame order, the frames of the next acquisitions only
+ * hold the pixels of the roi.
+ *
+ * @param[in] x First pixel of the roi
+ * @param[in] width Number of pixels in the roi, 0 for the full frame
+ */
+void FrameProcessor::setRoi(int x, int width) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR2(x, width);
+	m_roi_x = (width > 0) ? x : 0;
+	m_roi_width = width;
+}
+
+/**
+ * Mark pixels as dead, as sent to the server with 'xstrip set-dead-pixels'
+ *
+ * @param[in] first First dead pixel of sequence
+ * @param[in] num Number of dead pixels
+ * @param[in] reset Mark all the other pixels as good
+ */
+void FrameProcessor::setDeadPixels(int first, int num, bool reset) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR3(first, num, reset);
+	if (first < 0 || num < 0) {
+		THROW_HW_ERROR(InvalidValue) << "Invalid dead pixel range";
+	}
+	if (reset)
+		m_dead.assign(m_dead.size(), 0);
+	if ((int) m_dead.size() < first + num)
+		m_dead.resize(first + num, 0);
+	for (int i = first; i < first + num; i++)
+		m_dead[i] = 1;
+}
+
+/**
+ * Enable the interpolation of the dead pixels
+ *
+ * @param[in] enable true to replace dead pixels by a linear interpolation
+ *            of the nearest good pixels on each side
+ */
+void FrameProcessor::setInterpolation(bool enable) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(enable);
+	m_interpolation = enable;
+}
+
+bool FrameProcessor::getInterpolation() const {
+	return m_interpolation;
+}
+
+/**
+ * Select the tables for the next acquisition and check they fit the frames.
+ * Bpp32F frames are always converted, with a dark of 0 and a gain of 1 when
+ * the correction is disabled.
+ *
+ * @param[in] int_time The integration time of the acquisition in clock cycles, 0 if unknown
+ * @param[in] npixels The number of pixels in a frame
+ * @param[in] type The image type handed to LImA
+ * @param[in] uninterleaved true if the frames hold one head after the other
+ * @param[in] nb_accumulate The number of detector frames summed in each frame, 1 for none
+ * @param[in] acc_shift The right shift of the sums in Bpp32 frames
+ */
+void FrameProcessor::prepare(int int_time, int npixels, ImageType type, bool uninterleaved, int nb_accumulate, int acc_shift) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR5(int_time, npixels, type, uninterleaved, nb_accumulate) << ", " << DEB_VAR1(acc_shift);
+	if (m_roi_x + m_roi_width > npixels) {
+		THROW_HW_ERROR(InvalidValue) << "Roi of " << m_roi_width << " pixels at " << m_roi_x << " is outside the "
+				<< npixels << " pixel frame";
+	}
+	int width = (m_roi_width > 0) ? m_roi_width : npixels;
+	m_type = type;
+	m_npixels = width;
+	m_nb_accumulate = nb_accumulate;
+	m_acc_shift = acc_shift;
+	m_convert = m_correction || type == Bpp32F;
+	prepareInterpolation(npixels, uninterleaved);
+	m_active = m_convert || !m_interp_pixel.empty();
+	if (nb_accumulate > 1) {
+		if (type != Bpp32 && type != Bpp32F) {
+			THROW_HW_ERROR(InvalidValue) << "Accumulation needs Bpp32 or Bpp32F frames";
+		}
+		m_acc.assign(width, 0);
+		m_acc_count = 0;
+	}
+	if (!m_convert && nb_accumulate <= 1)
+		return;
+	if (type != Bpp32 && type != Bpp32F) {
+		THROW_HW_ERROR(InvalidValue) << "Dark and gain correction needs Bpp32 or Bpp32F frames";
+	}
+	m_zero.assign(width, 0.f);
+	m_one.assign(width, 1.f);
+	m_cur_dark = &m_zero[0];
+	m_cur_gain = &m_one[0];
+	if (!m_correction)
+		return;
+
+	if (!m_darks.empty()) {
+		std::map<int, std::vector<float> >::const_iterator it = m_darks.find(int_time);
+		if (it == m_darks.end() && int_time == 0 && m_darks.size() == 1)
+			it = m_darks.begin();	// timing groups programmed by hand, a single dark
+		if (it == m_darks.end()) {
+			THROW_HW_ERROR(InvalidValue) << "No dark for an integration time of " << int_time << " cycles";
+		}
+		if ((int) it->second.size() != npixels) {
+			THROW_HW_ERROR(InvalidValue) << "Dark has " << it->second.size() << " pixels, frames have " << npixels;
+		}
+		m_cur_dark = &it->second[m_roi_x];
+	}
+	if (!m_gain.empty()) {
+		if ((int) m_gain.size() != npixels) {
+			THROW_HW_ERROR(InvalidValue) << "Gain has " << m_gain.size() << " pixels, frames have " << npixels;
+		}
+		m_cur_gain = &m_gain[m_roi_x];
+	}
+}
+
+/*
+ * Build the interpolation tables: for each dead pixel in the frame, the
+ * nearest good pixel on each side and the weight of the right one. A run of
+ * dead pixels at the end of a head takes the value of its only good neighbour.
+ * In un-interleaved frames the heads are interpolated separately. With a roi
+ * only the pixels inside it are used, in roi coordinates.
+ */
+void FrameProcessor::prepareInterpolation(int npixels, bool uninterleaved) {
+	DEB_MEMBER_FUNCT();
+	m_interp_pixel.clear();
+	m_interp_left.clear();
+	m_interp_right.clear();
+	m_interp_weight.clear();
+	if (!m_interpolation)
+		return;
+
+	// dead pixel map in the frame layout
+	std::vector<uint8_t> dead(npixels, 0);
+	int half = npixels / 2;
+	for (int p = 0; p < (int) m_dead.size() && p < npixels; p++) {
+		if (!m_dead[p])
+			continue;
+		int pos = p;
+		if (uninterleaved && p < 2 * half)
+			pos = (p & 1) ? half + p / 2 : p / 2;
+		dead[pos] = 1;
+	}
+
+	int nheads = uninterleaved ? 2 : 1;
+	int roi_start = m_roi_x;
+	int roi_end = (m_roi_width > 0) ? m_roi_x + m_roi_width : npixels;
+	for (int h = 0; h < nheads; h++) {
+		int start = std::max(uninterleaved ? h * half : 0, roi_start);
+		int end = std::min(uninterleaved ? (h + 1) * half : npixels, roi_end);
+		int left = -1;
+		for (int i = start; i < end; i++) {
+			if (!dead[i]) {
+				left = i;
+				continue;
+			}
+			int right = i + 1;
+			while (right < end && dead[right])
+				right++;
+			if (right == end)
+				right = -1;
+			if (left < 0 && right < 0) {
+				DEB_WARNING() << "No good pixel to interpolate pixels " << start << " to " << end - 1;
+				break;
+			}
+			// dead run from i to right-1
+			for (int j = i; j < ((right < 0) ? end : right); j++) {
+				m_interp_pixel.push_back(j - roi_start);
+				if (left < 0) {
+					m_interp_left.push_back(right - roi_start);
+					m_interp_right.push_back(right - roi_start);
+					m_interp_weight.push_back(0.f);
+				} else if (right < 0) {
+					m_interp_left.push_back(left - roi_start);
+					m_interp_right.push_back(left - roi_start);
+					m_interp_weight.push_back(0.f);
+				} else {
+					m_interp_left.push_back(left - roi_start);
+					m_interp_right.push_back(right - roi_start);
+					m_interp_weight.push_back((float) (j - left) / (right - left));
+				}
+			}
+			if (right < 0)
+				break;
+			i = right - 1;
+		}
+	}
+	DEB_TRACE() << m_interp_pixel.size() << " dead pixels to interpolate";
+}
+
+/**
+ * True if frames must go through process() in this acquisition
+ */
+bool FrameProcessor::isActive() const {
+	return m_active;
+}
+
+/**
+ * Correct a frame in place with the tables selected by prepare(), then
+ * interpolate its dead pixels. When accumulating, only the dead pixels of
+ * the frame written by emit() are interpolated.
+ *
+ * @param[in,out] frame The frame, raw 32 bit words when a correction is applied
+ */
+void FrameProcessor::process(void* frame) const {
+	// accumulated frames are corrected by emit()
+	if (m_convert && m_nb_accumulate <= 1) {
+		if (m_type == Bpp32F)
+			correct32F((const uint32_t*) frame, m_cur_dark, m_cur_gain, (float*) frame, m_npixels);
+		else
+			correct32((const uint32_t*) frame, m_cur_dark, m_cur_gain, (uint32_t*) frame, m_npixels);
+	}
+	int n = m_interp_pixel.size();
+	if (n == 0)
+		return;
+	const int32_t* pixel = &m_interp_pixel[0];
+	const int32_t* left = &m_interp_left[0];
+	const int32_t* right = &m_interp_right[0];
+	const float* weight = &m_interp_weight[0];
+	switch (m_type) {
+	case Bpp16:
+		interpolate16((uint16_t*) frame, pixel, left, right, weight, n);
+		break;
+	case Bpp32F:
+		interpolate32F((float*) frame, pixel, left, right, weight, n);
+		break;
+	default:
+		interpolate32((uint32_t*) frame, pixel, left, right, weight, n);
+		break;
+	}
+}
+
+/**
+ * Add a detector frame to the accumulators
+ *
+ * @param[in] frame The detector frame, 16 or 32 bit words
+ * @param[in] word16 true for 16 bit words
+ * @return true once nb_accumulate frames are summed, emit() must then be called
+ */
+bool FrameProcessor::accumulate(const void* frame, bool word16) {
+	if (word16)
+		accumulate16(&m_acc[0], (const uint16_t*) frame, m_npixels);
+	else
+		accumulate32(&m_acc[0], (const uint32_t*) frame, m_npixels);
+	return ++m_acc_count >= m_nb_accumulate;
+}
+
+/**
+ * Write the accumulated frame and clear the accumulators. Bpp32F frames get
+ * the corrected mean of the detector frames, (sum / n - dark) * gain,
+ * computed in double and rounded once to a float. Bpp32 frames get the
+ * corrected sum, (sum - n * dark) * gain, shifted right by the shift given to
+ * prepare() and rounded, clipped to [0, 2^32 - 1] for a gain above 1. Throws
+ * if a sum itself does not fit the frame once shifted.
+ *
+ * @param[out] frame The frame handed to LImA
+ */
+void FrameProcessor::emit(void* frame) {
+	DEB_MEMBER_FUNCT();
+	double n = m_acc_count;
+	uint64_t max_sum = 0;
+	if (m_type == Bpp32F) {
+		float* out = (float*) frame;
+		for (int i = 0; i < m_npixels; i++)
+			out[i] = (float) (((double) m_acc[i] / n - m_cur_dark[i]) * m_cur_gain[i]);
+	} else {
+		uint32_t* out = (uint32_t*) frame;
+		double scale = 1. / (double) ((uint64_t) 1 << m_acc_shift);
+		for (int i = 0; i < m_npixels; i++) {
+			double v = ((double) m_acc[i] - n * m_cur_dark[i]) * m_cur_gain[i] * scale;
+			out[i] = (v <= 0.) ? 0 : (v >= 4294967295.) ? 0xffffffffu : (uint32_t) llrint(v);
+			if (m_acc[i] > max_sum)
+				max_sum = m_acc[i];
+		}
+	}
+	m_acc.assign(m_npixels, 0);
+	m_acc_count = 0;
+	if ((max_sum >> m_acc_shift) > 0xffffffffu) {
+		int bits = 0;
+		while ((max_sum >> bits) > 0xffffffffu)
+			bits++;
+		THROW_HW_ERROR(Error) << "Sum of " << n << " frames overflows Bpp32 frames, shift it by at least " << bits << " bits";
+	}
+}
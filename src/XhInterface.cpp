@@ -31,7 +31,7 @@ using namespace lima;
 using namespace lima::Xh;
 
 Interface::Interface(Camera& cam) :
-		m_cam(cam), m_det_info(cam), m_sync(cam)
+		m_cam(cam), m_det_info(cam), m_sync(cam), m_roi(cam)
 {
 	DEB_CONSTRUCTOR();
 	HwDetInfoCtrlObj *det_info = &m_det_info;
@@ -44,6 +44,9 @@ Interface::Interface(Camera& cam) :
 	HwSyncCtrlObj *sync = &m_sync;
 	m_cap_list.push_back(sync);
 
+	HwRoiCtrlObj *roi = &m_roi;
+	m_cap_list.push_back(roi);
+
 	m_sync.setNbFrames(1);
 	m_sync.setExpTime(1.0);
 	m_sync.setLatTime(0.0);
@@ -60,8 +63,6 @@ Interface::Interface(Camera& cam) :
 
 Interface::~Interface() {
 	DEB_DESTRUCTOR();
-	delete &m_det_info;
-	delete &m_sync;
 }
 
 void Interface::getCapList(CapList &cap_list) const {
@@ -95,7 +96,14 @@ void Interface::stopAcq() {
 void Interface::getStatus(StatusType& status) {
 	DEB_MEMBER_FUNCT();
 	Camera::XhStatus xhStatus;
+	string error;
 	m_cam.getStatus(xhStatus);
+	m_cam.getAcqError(error);
+	if (!error.empty()) {
+		status.acq = AcqFault;
+		status.det = DetFault;
+		return;
+	}
 	switch (xhStatus.state) {
 	case Camera::XhStatus::Idle:
 		status.acq = AcqReady;
@@ -0,0 +1,156 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2011
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+/*
+ * XhTrace.cpp
+ * Binary trace of the traffic between XhClient and da.server.
+ */
+
+#include <cstring>
+#include "XhTrace.h"
+#include "lima/Exceptions.h"
+#include "lima/Timestamp.h"
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+XhTraceWriter::XhTraceWriter(const string& filename) : m_nb_bytes(0), m_failed(false) {
+	DEB_CONSTRUCTOR();
+	if ((m_file = fopen(filename.c_str(), "wb")) == 0) {
+		THROW_HW_ERROR(Error) << "Cannot create trace file " << filename;
+	}
+	// large blocks are written straight from the caller's buffers
+	setvbuf(m_file, 0, _IOFBF, 1 << 20);
+	XhTraceHeader header;
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.start = m_start = Timestamp::now();
+	if (fwrite(&header, sizeof(header), 1, m_file) != 1) {
+		fclose(m_file);
+		THROW_HW_ERROR(Error) << "Cannot write trace file " << filename;
+	}
+	m_nb_bytes = sizeof(header);
+}
+
+XhTraceWriter::~XhTraceWriter() {
+	DEB_DESTRUCTOR();
+	if (fclose(m_file) != 0 && !m_failed) {
+		DEB_ERROR() << "Cannot write the end of the trace file";
+	}
+}
+
+/*
+ * Record a payload. Tracing stops at the first write error, the clients
+ * go on without it.
+ */
+void XhTraceWriter::record(int type, int conn, const void* data, size_t len) {
+	AutoMutex aLock(m_mutex);
+	if (m_failed)
+		return;
+	if (writeHeader(type, conn, len) && writeData(data, len))
+		m_nb_bytes += sizeof(XhTraceRecord) + len;
+}
+
+/*
+ * Record the first len bytes of a scatter list as one payload
+ */
+void XhTraceWriter::record(int type, int conn, const struct iovec* iov, int iovcnt, size_t len) {
+	AutoMutex aLock(m_mutex);
+	if (m_failed || !writeHeader(type, conn, len))
+		return;
+	size_t left = len;
+	for (int i = 0; i < iovcnt && left > 0; i++) {
+		size_t n = (iov[i].iov_len < left) ? iov[i].iov_len : left;
+		if (!writeData(iov[i].iov_base, n))
+			return;
+		left -= n;
+	}
+	m_nb_bytes += sizeof(XhTraceRecord) + len;
+}
+
+/*
+ * Bytes of the complete records written
+ */
+long long XhTraceWriter::getNbBytes() const {
+	AutoMutex aLock(m_mutex);
+	return m_nb_bytes;
+}
+
+/*
+ * True once a write error stopped the tracing
+ */
+bool XhTraceWriter::isFailed() const {
+	AutoMutex aLock(m_mutex);
+	return m_failed;
+}
+
+bool XhTraceWriter::writeHeader(int type, int conn, size_t len) {
+	XhTraceRecord record;
+	record.type = type;
+	record.conn = conn;
+	record.reserved = 0;
+	record.len = len;
+	record.time = Timestamp::now() - m_start;
+	return writeData(&record, sizeof(record));
+}
+
+bool XhTraceWriter::writeData(const void* data, size_t len) {
+	DEB_MEMBER_FUNCT();
+	if (len == 0 || fwrite(data, 1, len, m_file) == len)
+		return true;
+	DEB_ERROR() << "Cannot write the trace file, tracing stopped";
+	m_failed = true;
+	return false;
+}
+
+XhTraceReader::XhTraceReader(const string& filename) {
+	DEB_CONSTRUCTOR();
+	XhTraceHeader header;
+	if ((m_file = fopen(filename.c_str(), "rb")) == 0) {
+		THROW_HW_ERROR(Error) << "Cannot open trace file " << filename;
+	}
+	if (fread(&header, sizeof(header), 1, m_file) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+		fclose(m_file);
+		THROW_HW_ERROR(Error) << filename << " is not an Xh trace file";
+	}
+	m_start = header.start;
+}
+
+XhTraceReader::~XhTraceReader() {
+	DEB_DESTRUCTOR();
+	fclose(m_file);
+}
+
+/*
+ * Read the next record and its payload, returns false at the end of the file
+ * or on a truncated record
+ */
+bool XhTraceReader::next(XhTraceRecord& record, vector<char>& payload) {
+	if (fread(&record, sizeof(record), 1, m_file) != 1)
+		return false;
+	payload.resize(record.len);
+	return record.len == 0 || fread(&payload[0], 1, record.len, m_file) == record.len;
+}
+
+double XhTraceReader::getStartTime() const {
+	return m_start;
+}
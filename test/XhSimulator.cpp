@@ -0,0 +1,793 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+/*
+ * XhSimulator.cpp
+ * Loopback da.server simulator used for offline tests and benchmarks.
+ */
+
+#include <sstream>
+#include <string>
+#include <cstring>
+#include <cmath>
+#include <deque>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "XhSimulator.h"
+#include "XhClient.h"
+#include "XhTrace.h"
+#include "lima/Exceptions.h"
+#include "lima/Timestamp.h"
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+//---------------------------
+//- listening thread
+//---------------------------
+class Simulator::ListenThread: public Thread {
+public:
+	ListenThread(Simulator& sim, int skt) : m_sim(sim), m_skt(skt) {}
+	virtual ~ListenThread() { join(); }
+protected:
+	virtual void threadFunction() { m_sim.run(m_skt); }
+private:
+	Simulator& m_sim;
+	int m_skt;
+};
+
+//---------------------------
+//- one thread per client connection
+//---------------------------
+class Simulator::Session: public Thread {
+public:
+	Session(Simulator& sim, int skt) : m_sim(sim), m_skt(skt) {}
+	virtual ~Session() { join(); }
+protected:
+	virtual void threadFunction() { m_sim.handleSession(m_skt); }
+private:
+	Simulator& m_sim;
+	int m_skt;
+};
+
+Simulator::Simulator(int port, int npixels) : m_port(port), m_listen_skt(-1), m_unix_skt(-1), m_npixels(npixels), m_max_frames(65536),
+		m_frame_rate(0.), m_latency(0.), m_short_blocks(0), m_legacy(false), m_running(false), m_started(false), m_start_time(0.), m_stopped_frames(0), m_next_handle(1), m_nb_status(0),
+		m_real_time(false), m_nb_replayed(0),
+		m_listen_thread(0), m_unix_thread(0) {
+	DEB_CONSTRUCTOR();
+}
+
+Simulator::~Simulator() {
+	DEB_DESTRUCTOR();
+	stop();
+}
+
+/*
+ * Bind the listening socket and start serving clients
+ */
+void Simulator::start() {
+	DEB_MEMBER_FUNCT();
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int one = 1;
+
+	if (m_started)
+		return;
+	if ((m_listen_skt = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		THROW_HW_ERROR(Error) << "Simulator: can't create socket";
+	setsockopt(m_listen_skt, SOL_SOCKET, SO_REUSEADDR, (char *) &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(m_port);
+	if (bind(m_listen_skt, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(m_listen_skt, 8) == -1) {
+		close(m_listen_skt);
+		THROW_HW_ERROR(Error) << "Simulator: can't bind to port " << m_port;
+	}
+	getsockname(m_listen_skt, (struct sockaddr *) &addr, &len);
+	m_port = ntohs(addr.sin_port);
+	if (!m_unix_path.empty()) {
+		struct sockaddr_un uaddr;
+		memset(&uaddr, 0, sizeof(uaddr));
+		uaddr.sun_family = AF_UNIX;
+		strncpy(uaddr.sun_path, m_unix_path.c_str(), sizeof(uaddr.sun_path) - 1);
+		unlink(m_unix_path.c_str());
+		if ((m_unix_skt = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 || bind(m_unix_skt, (struct sockaddr *) &uaddr, sizeof(uaddr)) == -1
+				|| listen(m_unix_skt, 8) == -1) {
+			if (m_unix_skt >= 0)
+				close(m_unix_skt);
+			close(m_listen_skt);
+			THROW_HW_ERROR(Error) << "Simulator: can't listen on " << m_unix_path;
+		}
+	}
+	m_started = true;
+	m_listen_thread = new ListenThread(*this, m_listen_skt);
+	m_listen_thread->start();
+	if (m_unix_skt >= 0) {
+		m_unix_thread = new ListenThread(*this, m_unix_skt);
+		m_unix_thread->start();
+	}
+	DEB_TRACE() << "Simulator listening on port " << m_port;
+}
+
+/*
+ * Close all connections and wait for the serving threads
+ */
+void Simulator::stop() {
+	DEB_MEMBER_FUNCT();
+	if (!m_started)
+		return;
+	AutoMutex aLock(m_cond.mutex());
+	m_started = false;
+	shutdown(m_listen_skt, SHUT_RDWR);
+	if (m_unix_skt >= 0)
+		shutdown(m_unix_skt, SHUT_RDWR);
+	for (size_t i = 0; i < m_session_skts.size(); i++)
+		shutdown(m_session_skts[i], SHUT_RDWR);
+	aLock.unlock();
+	delete m_listen_thread;
+	m_listen_thread = 0;
+	close(m_listen_skt);
+	if (m_unix_skt >= 0) {
+		delete m_unix_thread;
+		m_unix_thread = 0;
+		close(m_unix_skt);
+		m_unix_skt = -1;
+		unlink(m_unix_path.c_str());
+	}
+	for (size_t i = 0; i < m_sessions.size(); i++)
+		delete m_sessions[i];
+	m_sessions.clear();
+}
+
+int Simulator::getPort() const {
+	return m_port;
+}
+
+void Simulator::setFrameRate(double frame_rate) {
+	AutoMutex aLock(m_cond.mutex());
+	m_frame_rate = frame_rate;
+}
+
+void Simulator::setNbPixels(int npixels) {
+	AutoMutex aLock(m_cond.mutex());
+	m_npixels = npixels;
+}
+
+void Simulator::setMaxFrames(int max_frames) {
+	AutoMutex aLock(m_cond.mutex());
+	m_max_frames = max_frames;
+}
+
+void Simulator::setLegacyProtocol(bool legacy) {
+	AutoMutex aLock(m_cond.mutex());
+	m_legacy = legacy;
+}
+
+void Simulator::setCommandLatency(double latency) {
+	AutoMutex aLock(m_cond.mutex());
+	m_latency = latency;
+}
+
+void Simulator::setShortBlocks(int nbytes) {
+	AutoMutex aLock(m_cond.mutex());
+	m_short_blocks = nbytes;
+}
+
+void Simulator::setUnixPath(const string& path) {
+	AutoMutex aLock(m_cond.mutex());
+	m_unix_path = path;
+}
+
+int Simulator::getNbStatusRequests() const {
+	AutoMutex aLock(m_cond.mutex());
+	return m_nb_status;
+}
+
+/*
+ * Break the client connections as a network failure would. With restart the
+ * timing groups, handles and configuration are lost as if the server had
+ * been restarted.
+ */
+void Simulator::dropConnections(bool restart) {
+	DEB_MEMBER_FUNCT();
+	AutoMutex aLock(m_cond.mutex());
+	for (size_t i = 0; i < m_session_skts.size(); i++)
+		shutdown(m_session_skts[i], SHUT_RDWR);
+	if (restart) {
+		m_groups.clear();
+		m_handles.clear();
+		m_config.clear();
+		m_running = false;
+		m_stopped_frames = 0;
+	}
+}
+
+vector<string> Simulator::getConfigCommands() const {
+	AutoMutex aLock(m_cond.mutex());
+	return m_config;
+}
+
+/*
+ * Value of a pixel as stored in the (interleaved) detector memory
+ */
+uint32_t Simulator::pixelValue(int frame, int pixel) {
+	return (uint32_t) frame * 4096 + pixel;
+}
+
+void Simulator::run(int listen_skt) {
+	DEB_MEMBER_FUNCT();
+	for (;;) {
+		int skt = accept(listen_skt, 0, 0);
+		if (skt < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		AutoMutex aLock(m_cond.mutex());
+		if (!m_started) {
+			close(skt);
+			break;
+		}
+		int one = 1;
+		setsockopt(skt, IPPROTO_TCP, TCP_NODELAY, (char *) &one, sizeof(one));
+		m_session_skts.push_back(skt);
+		Session *session = new Session(*this, skt);
+		m_sessions.push_back(session);
+		session->start();
+	}
+}
+
+void Simulator::reply(int skt, const string& text) {
+	const char *p = text.c_str();
+	int len = text.length();
+	int r;
+	while (len > 0 && (r = send(skt, p, len, MSG_NOSIGNAL)) > 0)
+		p += r, len -= r;
+}
+
+void Simulator::handleSession(int skt) {
+	DEB_MEMBER_FUNCT();
+	Connection conn;
+	socklen_t len = sizeof(struct sockaddr_storage);
+	string pending;
+	char buff[4096];
+
+	conn.skt = skt;
+	conn.data_port = -1;
+	conn.persistent = false;
+	conn.data_skt = -1;
+	conn.shm = 0;
+	conn.shm_size = 0;
+	struct sockaddr_storage peer;
+	getpeername(skt, (struct sockaddr *) &peer, &len);
+	memcpy(&conn.peer, &peer, sizeof(conn.peer));
+	if (peer.ss_family != AF_INET) {
+		// client on a unix-domain socket, its data port is on this host
+		memset(&conn.peer, 0, sizeof(conn.peer));
+		conn.peer.sin_family = AF_INET;
+		conn.peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	}
+	reply(skt, "> ");
+	for (;;) {
+		int r = recv(skt, buff, sizeof(buff), 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		pending.append(buff, r);
+		double arrival = Timestamp::now();
+		size_t pos;
+		bool quit = false;
+		while (!quit && (pos = pending.find('\n')) != string::npos) {
+			string line = pending.substr(0, pos);
+			pending.erase(0, pos + 1);
+			if (!line.empty() && line[line.length() - 1] == '\r')
+				line.erase(line.length() - 1);
+			double wait = arrival + m_latency - double(Timestamp::now());
+			if (wait > 0.)
+				usleep((int) (wait * 1e6));
+			quit = !execute(conn, line);
+		}
+		if (quit)
+			break;
+	}
+	if (conn.data_skt >= 0)
+		close(conn.data_skt);
+	if (conn.shm)
+		munmap(conn.shm, conn.shm_size);
+	AutoMutex aLock(m_cond.mutex());
+	for (size_t i = 0; i < m_session_skts.size(); i++) {
+		if (m_session_skts[i] == skt) {
+			m_session_skts.erase(m_session_skts.begin() + i);
+			break;
+		}
+	}
+	close(skt);
+}
+
+/*
+ * Number of frames completed so far by the emulated timing generator
+ */
+void Simulator::getTimingState(int& completed, bool& running) {
+	int total = 0;
+	for (size_t i = 0; i < m_groups.size(); i++)
+		total += m_groups[i].nframes;
+	if (!m_running) {
+		completed = m_stopped_frames;
+		running = false;
+		return;
+	}
+	if (m_frame_rate <= 0.) {
+		completed = total;
+	} else {
+		double now = Timestamp::now();
+		completed = (int) floor((now - m_start_time) * m_frame_rate);
+		if (completed > total)
+			completed = total;
+	}
+	running = completed < total;
+	if (!running) {
+		m_running = false;
+		m_stopped_frames = completed;
+	}
+}
+
+/*
+ * Status line as returned by 'xstrip timing read-status'
+ */
+string Simulator::getStatusString() {
+	int completed;
+	bool running;
+	stringstream out;
+	m_nb_status++;
+	getTimingState(completed, running);
+	int group_nb = 0, frame_nb = completed;
+	for (size_t i = 0; i < m_groups.size() && frame_nb >= m_groups[i].nframes; i++)
+		frame_nb -= m_groups[i].nframes, group_nb++;
+	out << "  " << (running ? "Running" : "Idle") << ": group=" << group_nb << ", frame=" << frame_nb
+			<< ", scan=0, cycle=0, completed=" << completed;
+	return out.str();
+}
+
+/*
+ * Execute one command line and send the reply followed by a new prompt.
+ * Returns false when the client asked to quit.
+ */
+bool Simulator::execute(Connection& conn, const string& line) {
+	DEB_MEMBER_FUNCT();
+	istringstream is(line);
+	vector<string> args;
+	string word, response;
+	stringstream out;
+	while (is >> word)
+		args.push_back(word);
+
+	DEB_TRACE() << "Simulator command: " << line;
+	if (args.empty()) {
+		reply(conn.skt, "> ");
+		return true;
+	}
+	AutoMutex aLock(m_cond.mutex());
+	const string& cmd = args[0];
+	if (cmd == "quit") {
+		return false;
+	} else if (cmd == "port" && args.size() == 2) {
+		conn.data_port = atoi(args[1].c_str());
+		out << "* 0\n";
+	} else if (cmd == "port-mode" && args.size() >= 2 && !m_legacy) {
+		if (conn.data_skt >= 0) {
+			close(conn.data_skt);
+			conn.data_skt = -1;
+		}
+		if (conn.shm) {
+			munmap(conn.shm, conn.shm_size);
+			conn.shm = 0;
+		}
+		conn.persistent = args[1] == "persistent";
+		if (args[1] == "shm" && args.size() == 4) {
+			// shared memory created by the client, on this host
+			size_t size = strtoul(args[3].c_str(), 0, 10);
+			int fd = shm_open(args[2].c_str(), O_RDWR, 0);
+			void *ptr = (fd < 0 || size < sizeof(DataStreamHeader)) ? MAP_FAILED : mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (fd >= 0)
+				close(fd);
+			if (ptr == MAP_FAILED) {
+				out << "! port-mode: cannot open shared memory " << args[2] << "\n* -1\n";
+			} else {
+				conn.shm = (char *) ptr;
+				conn.shm_size = size;
+				out << "* 0\n";
+			}
+		} else {
+			out << "* 0\n";
+		}
+	} else if (!m_trace.empty() && replay(conn, line, response, aLock)) {
+		out << response;
+	} else if (cmd[0] == '~') {
+		out << "# executing " << cmd.substr(1) << "\n* 0\n";
+	} else if (cmd == "%xstrip_num_tf") {
+		int total = 0;
+		for (size_t i = 0; i < m_groups.size(); i++)
+			total += m_groups[i].nframes;
+		out << "* " << total << "\n";
+	} else if (cmd == "echo") {
+		// string value for the client tests, '(null)' answers no string
+		if (args.size() == 2 && args[1] == "(null)")
+			out << "* (null)\n";
+		else
+			out << "* \"" << (line.length() > 5 ? line.substr(5) : "") << "\"\n";
+	} else if (cmd == "unif-get-nx") {
+		out << "* " << m_npixels << "\n";
+	} else if (cmd == "close" && args.size() == 2) {
+		m_handles.erase(atoi(args[1].c_str()));
+		out << "* 0\n";
+	} else if (cmd == "read" && args.size() >= 10 && args[7] == "from") {
+		int handle_nb = atoi(args[8].c_str());
+		map<int, Handle>::iterator it = m_handles.find(handle_nb);
+		if (it == m_handles.end()) {
+			out << "! read: invalid handle " << handle_nb << "\n* -1\n";
+		} else if (conn.data_port < 0 && !conn.shm) {
+			out << "! read: no data port\n* -1\n";
+		} else if (conn.shm && sizeof(DataStreamHeader) + (size_t) atoi(args[4].c_str()) * atoi(args[5].c_str()) * atoi(args[6].c_str())
+				* (args[9] == "raw" ? sizeof(uint16_t) : sizeof(uint32_t)) > conn.shm_size) {
+			out << "! read: block larger than the shared memory\n* -1\n";
+		} else {
+			Handle handle = it->second;
+			int x = atoi(args[1].c_str()), y = atoi(args[2].c_str()), t = atoi(args[3].c_str());
+			int w = atoi(args[4].c_str()), h = atoi(args[5].c_str()), n = atoi(args[6].c_str());
+			aLock.unlock();
+			sendData(conn, x, y, t, w, h, n, handle, args[9] == "raw");
+			aLock.lock();
+			out << "* 0\n";
+		}
+	} else if (cmd == "xstrip" && args.size() >= 3 && args[1] == "open") {
+		Handle handle;
+		handle.timing = false;
+		handle.uninterleave = args.size() > 3 && args[3] == "un-interleave";
+		m_handles[m_next_handle] = handle;
+		out << "* " << m_next_handle++ << "\n";
+	} else if (cmd == "xstrip" && args.size() >= 4 && args[1] == "timing") {
+		const string& sub = args[2];
+		if (sub == "open") {
+			Handle handle;
+			handle.timing = true;
+			handle.uninterleave = false;
+			m_handles[m_next_handle] = handle;
+			out << "* " << m_next_handle++ << "\n";
+		} else if (sub == "setup-group" && args.size() >= 8) {
+			int group_nb = atoi(args[4].c_str());
+			Group group;
+			group.nframes = atoi(args[5].c_str());
+			group.nscans = atoi(args[6].c_str());
+			group.intTime = atoi(args[7].c_str());
+			if (group_nb < 0 || group_nb > (int) m_groups.size() || group.nframes <= 0) {
+				out << "! setup-group: invalid group " << group_nb << "\n* -1\n";
+			} else {
+				m_groups.resize(group_nb);
+				m_groups.push_back(group);
+				int total = 0;
+				for (size_t i = 0; i < m_groups.size(); i++)
+					total += m_groups[i].nframes;
+				if (total > m_max_frames)
+					out << "! setup-group: too many frames " << total << "\n* -1\n";
+				else
+					out << "* " << total << "\n";
+			}
+		} else if (sub == "start") {
+			m_running = true;
+			m_stopped_frames = 0;
+			m_start_time = Timestamp::now();
+			out << "* 0\n";
+		} else if (sub == "stop") {
+			int completed;
+			bool running;
+			getTimingState(completed, running);
+			m_running = false;
+			m_stopped_frames = completed;
+			out << "* 0\n";
+		} else if (sub == "read-status") {
+			out << "* \"" << getStatusString() << "\"\n";
+		} else if (sub == "wait-frames" && args.size() >= 6 && !m_legacy) {
+			// wait until nframes are complete or the timing generator stops
+			int nframes = atoi(args[4].c_str());
+			double timeout = atoi(args[5].c_str()) * 1e-3;
+			double end = double(Timestamp::now()) + timeout;
+			int reported = -1;
+			for (;;) {
+				int completed;
+				bool running;
+				getTimingState(completed, running);
+				double now = Timestamp::now();
+				if (completed >= nframes || !running || now >= end)
+					break;
+				// progress as a timebar line, one per newly completed frame
+				if (completed != reported) {
+					out << "@ " << completed << " " << nframes << " 'frames'\n";
+					reported = completed;
+				}
+				double next = m_start_time + (completed + 1) / m_frame_rate;
+				m_cond.wait(((next < end) ? next : end) - now);
+			}
+			out << "* \"" << getStatusString() << "\"\n";
+		} else if (sub == "wait-frames") {
+			// older servers refuse the command
+			out << "! xstrip timing: bad sub-command\n* -1\n";
+		} else {
+			m_config.push_back(line);
+			out << "* 0\n";
+		}
+	} else if (cmd == "xstrip") {
+		// other xstrip configuration commands are accepted and recorded
+		m_config.push_back(line);
+		out << "* 0\n";
+	} else {
+		out << "! Unknown command: " << cmd << "\n* -1\n";
+	}
+	out << "> ";
+	reply(conn.skt, out.str());
+	return true;
+}
+
+/*
+ * Connect back to the client data port and send the requested block
+ */
+void Simulator::sendData(Connection& conn, int x, int y, int t, int w, int h, int n, const Handle& handle, bool raw) {
+	DEB_MEMBER_FUNCT();
+	int skt = conn.shm ? -1 : dataSocket(conn);
+	if (!conn.shm && skt < 0)
+		return;
+	int npixels = w * h;
+	int word = raw ? sizeof(uint16_t) : sizeof(uint32_t);
+	vector<char> buff;
+	AutoMutex aLock(m_cond.mutex());
+	int missing = m_short_blocks;
+	aLock.unlock();
+	DataStreamHeader header;
+	header.magic = DATA_STREAM_MAGIC;
+	header.nbytes = n * npixels * word - missing;
+	if (conn.shm) {
+		memcpy(conn.shm, &header, sizeof(header));
+	} else {
+		buff.resize(npixels * word);
+		if (conn.persistent)
+			reply(skt, string((const char *) &header, sizeof(header)));
+	}
+	for (int f = t; f < t + n; f++) {
+		// the frames are written straight into the shared memory
+		char *frame = conn.shm ? conn.shm + sizeof(header) + (size_t) (f - t) * npixels * word : &buff[0];
+		for (int row = 0; row < h; row++) {
+			for (int col = 0; col < w; col++) {
+				uint32_t value;
+				if (handle.timing) {
+					value = (y + row) * 100 + x + col;
+				} else if (handle.uninterleave) {
+					// row is the head, columns are the pixels of that head
+					value = pixelValue(f, 2 * (x + col) + y + row);
+				} else {
+					value = pixelValue(f, (y + row) * w + x + col);
+				}
+				int i = row * w + col;
+				if (raw)
+					((uint16_t *) frame)[i] = value;
+				else
+					((uint32_t *) frame)[i] = value;
+			}
+		}
+		if (conn.shm)
+			continue;
+		const char *p = frame;
+		int len = buff.size() - ((f == t + n - 1) ? missing : 0);
+		int r = 0;
+		while (len > 0 && (r = send(skt, p, len, MSG_NOSIGNAL)) > 0)
+			p += r, len -= r;
+		if (r <= 0)
+			break;
+	}
+	if (!conn.persistent && skt >= 0)
+		close(skt);
+}
+
+/*
+ * Data connection for the next block: the persistent one, or a new
+ * connection to the client data port. -1 if the client cannot be reached.
+ */
+int Simulator::dataSocket(Connection& conn) {
+	int skt = conn.data_skt;
+	if (skt >= 0)
+		return skt;
+	struct sockaddr_in addr = conn.peer;
+	addr.sin_port = htons(conn.data_port);
+	if ((skt = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(skt, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		close(skt);
+		return -1;
+	}
+	int one = 1;
+	setsockopt(skt, IPPROTO_TCP, TCP_NODELAY, (char *) &one, sizeof(one));
+	if (conn.persistent)
+		conn.data_skt = skt;
+	return skt;
+}
+
+/*
+ * Send a recorded data block the way the client expects it now, which need
+ * not be the way it was recorded
+ */
+void Simulator::sendBlock(Connection& conn, const vector<char>& data) {
+	DataStreamHeader header;
+	header.magic = DATA_STREAM_MAGIC;
+	header.nbytes = data.size();
+	if (conn.shm) {
+		if (sizeof(header) + data.size() > conn.shm_size)
+			return;
+		memcpy(conn.shm + sizeof(header), &data[0], data.size());
+		memcpy(conn.shm, &header, sizeof(header));
+		return;
+	}
+	int skt = dataSocket(conn);
+	if (skt < 0)
+		return;
+	if (conn.persistent)
+		reply(skt, string((const char *) &header, sizeof(header)));
+	reply(skt, string(data.begin(), data.end()));
+	if (!conn.persistent)
+		close(skt);
+}
+
+/*
+ * Connection of a trace being loaded: responses being received, commands
+ * waiting for them (exchange index, -1 if not replayed, and time sent) and
+ * reads waiting for their block
+ */
+struct TraceConnection {
+	TraceConnection() : greeting(true) {}
+	XhLineBuffer buff;
+	bool greeting;				// the prompt sent on connection is not a response
+	deque<pair<int, double> > commands;
+	deque<int> reads;
+};
+
+/*
+ * Load a trace recorded with Camera::startTrace(). Each command found in it
+ * is then answered with its recorded responses, in the order recorded, the
+ * last one again once they are used up. Other commands are simulated, the
+ * data port handshakes always are. In real time, the replies come after the
+ * recorded latency, otherwise at once.
+ */
+void Simulator::loadTrace(const string& filename, bool real_time) {
+	DEB_MEMBER_FUNCT();
+	XhTraceReader reader(filename);
+	XhTraceRecord record;
+	vector<char> payload;
+	map<int, TraceConnection> pending;
+	vector<Exchange> exchanges;
+	map<string, TraceCommand> trace;
+
+	while (reader.next(record, payload)) {
+		TraceConnection& p = pending[record.conn];
+		if (record.type == XhTraceRecord::XhTraceConnect) {
+			p = TraceConnection();
+		} else if (record.type == XhTraceRecord::XhTraceCommand) {
+			string cmd(payload.begin(), payload.end());
+			if (cmd.compare(0, 5, "port ") == 0 || cmd.compare(0, 10, "port-mode ") == 0)
+				cmd.clear();				// answered by the simulator, but its response is in the trace
+			else
+				trace[cmd].exchanges.push_back(exchanges.size());
+			exchanges.push_back(Exchange());
+			exchanges.back().has_data = false;
+			exchanges.back().latency = 0.;
+			p.commands.push_back(make_pair(cmd.empty() ? -1 : (int) exchanges.size() - 1, record.time));
+			if (cmd.compare(0, 5, "read ") == 0)
+				p.reads.push_back(exchanges.size() - 1);
+		} else if (record.type == XhTraceRecord::XhTraceData) {
+			if (!p.reads.empty()) {
+				Exchange& ex = exchanges[p.reads.front()];
+				ex.data.swap(payload);
+				ex.has_data = true;
+				p.reads.pop_front();
+			}
+		} else if (record.type == XhTraceRecord::XhTraceServer) {
+			size_t done = 0;
+			while (done < payload.size()) {
+				int space;
+				char* ptr = p.buff.getSpace(space);
+				int len = (payload.size() - done < (size_t) space) ? payload.size() - done : space;
+				memcpy(ptr, &payload[done], len);
+				p.buff.fill(len);
+				done += len;
+				const char* line;
+				while (p.buff.nextLine(line, len)) {
+					bool prompt = len == 2 && line[0] == '>';
+					if (prompt && p.greeting) {
+						p.greeting = false;
+						continue;
+					}
+					if (p.commands.empty())
+						continue;
+					int index = p.commands.front().first;
+					if (index >= 0 && !prompt) {
+						exchanges[index].response.append(line, len);
+						exchanges[index].response += '\n';
+					} else if (prompt) {
+						if (index >= 0) {
+							Exchange& ex = exchanges[index];
+							ex.latency = record.time - p.commands.front().second;
+							// a failed read has no block
+							if (!ex.has_data && !p.reads.empty() && p.reads.front() == index
+									&& ex.response.find("* -") != string::npos)
+								p.reads.pop_front();
+						}
+						p.commands.pop_front();
+					}
+				}
+			}
+		}
+	}
+	for (map<string, TraceCommand>::iterator it = trace.begin(); it != trace.end(); ++it)
+		it->second.next = 0;
+	DEB_TRACE() << trace.size() << " commands in " << exchanges.size() << " exchanges";
+
+	AutoMutex aLock(m_cond.mutex());
+	m_exchanges.swap(exchanges);
+	m_trace.swap(trace);
+	m_real_time = real_time;
+	m_nb_replayed = 0;
+}
+
+int Simulator::getNbReplayed() const {
+	AutoMutex aLock(m_cond.mutex());
+	return m_nb_replayed;
+}
+
+/*
+ * Answer a command from the trace: deliver its recorded block, if any, and
+ * get its recorded response. Returns false if the command is not in the
+ * trace. Called with the lock held, released while sending.
+ */
+bool Simulator::replay(Connection& conn, const string& line, string& response, AutoMutex& aLock) {
+	map<string, TraceCommand>::iterator it = m_trace.find(line);
+	if (it == m_trace.end())
+		return false;
+	TraceCommand& tc = it->second;
+	const Exchange& ex = m_exchanges[tc.exchanges[(tc.next < tc.exchanges.size()) ? tc.next++ : tc.exchanges.size() - 1]];
+	m_nb_replayed++;
+	aLock.unlock();
+	if (m_real_time && ex.latency > 0.)
+		usleep((int) (ex.latency * 1e6));
+	if (ex.has_data)
+		sendBlock(conn, ex.data);
+	aLock.lock();
+	response = ex.response;
+	return true;
+}
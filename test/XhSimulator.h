@@ -0,0 +1,158 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+/*
+ * XhSimulator.h
+ * Loopback da.server simulator used for offline tests and benchmarks.
+ */
+
+#ifndef XHSIMULATOR_H_
+#define XHSIMULATOR_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "lima/Debug.h"
+#include "lima/ThreadUtils.h"
+
+namespace lima {
+namespace Xh {
+
+/*******************************************************************
+ * \class Simulator
+ * \brief In-process emulation of the da.server text protocol
+ *
+ * Speaks the same line protocol as XhClient expects ('> ' prompts,
+ * '* ' return values, '! ', '# ' and '@ ' lines), accepts the
+ * 'port N' handshake and connects back to the client data port for
+ * every 'read ... from <handle> long|raw' command. The 'xstrip timing'
+ * state machine completes frames at the configured frame rate.
+ * With a trace loaded, the commands found in it are answered with
+ * the recorded responses and data blocks instead.
+ *******************************************************************/
+class Simulator {
+DEB_CLASS_NAMESPC(DebModCamera, "Simulator", "Xh");
+
+public:
+	Simulator(int port=0, int npixels=1024);
+	~Simulator();
+
+	void start();
+	void stop();
+	int getPort() const;
+
+	void setFrameRate(double frame_rate);	///< frames per second, <= 0 completes all frames at once
+	void setNbPixels(int npixels);
+	void setMaxFrames(int max_frames);
+	void setLegacyProtocol(bool legacy);	///< behave as an older server without protocol extensions
+	void setCommandLatency(double latency);	///< seconds from receiving a command to replying, as a network round trip
+	void setUnixPath(const std::string& path);	///< also listen on a unix-domain socket, before start()
+	void setShortBlocks(int nbytes);		///< leave out the last nbytes of every data block, as a faulty server
+
+	int getNbStatusRequests() const;		///< read-status and wait-frames commands served
+	void dropConnections(bool restart=false);	///< close all client connections, restart forgets the detector state
+	std::vector<std::string> getConfigCommands() const;	///< xstrip configuration commands received, in order
+	void loadTrace(const std::string& filename, bool real_time=false);	///< answer the commands recorded in a trace as recorded
+	int getNbReplayed() const;				///< commands answered from the trace
+
+	static uint32_t pixelValue(int frame, int pixel);
+
+private:
+	class ListenThread;
+	class Session;
+
+	struct Group {
+		int nframes;
+		int nscans;
+		int intTime;
+	};
+	struct Handle {
+		bool timing;
+		bool uninterleave;
+	};
+	struct Connection {
+		int skt;					///< command socket
+		struct sockaddr_in peer;	///< client address for the data connection
+		int data_port;				///< client data port, -1 before the 'port' handshake
+		bool persistent;			///< keep the data connection open between reads
+		int data_skt;				///< persistent data connection, -1 if none
+		char *shm;					///< shared memory the blocks are put in, 0 if none
+		size_t shm_size;
+	};
+	struct Exchange {
+		std::string response;		///< server lines up to the prompt, without it
+		std::vector<char> data;		///< data block of a read
+		bool has_data;
+		double latency;				///< seconds from the command to the prompt
+	};
+	struct TraceCommand {
+		std::vector<int> exchanges;	///< recorded exchanges of the command, in order
+		size_t next;				///< next one to replay
+	};
+
+	void run(int listen_skt);
+	void handleSession(int skt);
+	bool execute(Connection& conn, const std::string& line);
+	void getTimingState(int& completed, bool& running);
+	std::string getStatusString();
+	void sendData(Connection& conn, int x, int y, int t, int w, int h, int n, const Handle& handle, bool raw);
+	void sendBlock(Connection& conn, const std::vector<char>& data);
+	int dataSocket(Connection& conn);
+	bool replay(Connection& conn, const std::string& line, std::string& response, AutoMutex& aLock);
+
+	static void reply(int skt, const std::string& text);
+
+	mutable Cond m_cond;
+	int m_port;
+	int m_listen_skt;
+	std::string m_unix_path;
+	int m_unix_skt;
+	int m_npixels;
+	int m_max_frames;
+	double m_frame_rate;
+	double m_latency;
+	int m_short_blocks;
+	bool m_legacy;
+	bool m_running;
+	bool m_started;
+	double m_start_time;
+	int m_stopped_frames;
+	int m_next_handle;
+	int m_nb_status;
+	std::vector<Group> m_groups;
+	std::vector<std::string> m_config;
+	std::map<int, Handle> m_handles;
+	std::vector<Exchange> m_exchanges;
+	std::map<std::string, TraceCommand> m_trace;
+	bool m_real_time;
+	int m_nb_replayed;
+	std::vector<int> m_session_skts;
+	ListenThread *m_listen_thread;
+	ListenThread *m_unix_thread;
+	std::vector<Session*> m_sessions;
+};
+
+} // namespace Xh
+} // namespace lima
+
+#endif /* XHSIMULATOR_H_ */
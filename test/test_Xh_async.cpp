@@ -0,0 +1,226 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+//
+// Checks the asynchronous XhClient interface against the loopback da.server
+// simulator: replies in order, callbacks, errors of single commands, blocking
+// calls from several threads sharing the I/O thread, and the commands in
+// flight when the connection is closed. With a simulated network latency it
+// also compares blocking and overlapped commands.
+//
+// usage: test_Xh_async [ncommands] [latency_ms]
+//
+
+#include "lima/Timestamp.h"
+
+#include "XhClient.h"
+#include "XhSimulator.h"
+#include "lima/Debug.h"
+#include "lima/Exceptions.h"
+#include "lima/ThreadUtils.h"
+#include <iostream>
+#include <cstdlib>
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+DEB_GLOBAL(DebModTest);
+
+// every xstrip open returns a new handle, one more than the one before
+static const char OPEN_CMD[] = "xstrip timing open xh0";
+
+class CountingCallback : public XhReply::Callback {
+public:
+	CountingCallback() : m_count(0), m_errors(0), m_last(-1) {}
+
+	virtual void replyReady(const XhReply& reply) {
+		AutoMutex aLock(m_cond.mutex());
+		if (!reply.ok || reply.ivalue <= m_last)
+			m_errors++;
+		m_last = reply.ivalue;
+		m_count++;
+		m_cond.broadcast();
+	}
+
+	int waitCount(int count) {
+		AutoMutex aLock(m_cond.mutex());
+		while (m_count < count && m_cond.wait(5.))
+			;
+		return m_count;
+	}
+
+	int getErrors() const {
+		AutoMutex aLock(m_cond.mutex());
+		return m_errors;
+	}
+
+private:
+	mutable Cond m_cond;
+	int m_count;
+	int m_errors;
+	int m_last;
+};
+
+// blocking commands from a thread of its own
+class SenderThread : public Thread {
+public:
+	SenderThread(XhClient& client, int ncommands) :
+			m_client(client), m_ncommands(ncommands), m_errors(0) {}
+
+	int getErrors() const { return m_errors; }
+
+protected:
+	virtual void threadFunction() {
+		int last = -1, handle;
+		for (int i = 0; i < m_ncommands; i++) {
+			try {
+				m_client.sendWait(OPEN_CMD, handle);
+				if (handle <= last)
+					m_errors++;
+				last = handle;
+			} catch (Exception&) {
+				m_errors++;
+			}
+		}
+	}
+
+private:
+	XhClient& m_client;
+	int m_ncommands;
+	int m_errors;
+};
+
+static int check(bool ok, const string& what) {
+	cout << (ok ? "ok:     " : "FAILED: ") << what << endl;
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+	DEB_GLOBAL_FUNCT();
+	int ncommands = (argc > 1) ? atoi(argv[1]) : 500;
+	double latency = ((argc > 2) ? atof(argv[2]) : 1.) * 1e-3;
+	int rc = 0;
+
+	try {
+		Simulator simulator;
+		simulator.start();
+		XhClient client;
+		if (client.connectToServer("localhost", simulator.getPort()) < 0) {
+			THROW_HW_ERROR(Error) << client.getErrorMessage();
+		}
+
+		// futures, answered in the order sent
+		vector<XhReply> replies(ncommands);
+		for (int i = 0; i < ncommands; i++)
+			client.sendAsync(OPEN_CMD, replies[i]);
+		bool in_order = true;
+		for (int i = 0; i < ncommands; i++) {
+			in_order = in_order && replies[i].wait(5.) && replies[i].ok;
+			in_order = in_order && (i == 0 || replies[i].ivalue == replies[i - 1].ivalue + 1);
+		}
+		rc |= check(in_order, "replies in order");
+
+		// callbacks
+		CountingCallback cb;
+		for (int i = 0; i < ncommands; i++)
+			client.sendAsync(OPEN_CMD, cb);
+		rc |= check(cb.waitCount(ncommands) == ncommands && cb.getErrors() == 0, "callbacks");
+
+		// a refused command does not disturb the next ones
+		XhReply before, bad, after, str(XhReply::XhReturnString);
+		client.sendAsync(OPEN_CMD, before);
+		client.sendAsync("no-such-command", bad);
+		client.sendAsync(OPEN_CMD, after);
+		client.sendAsync("xstrip timing read-status xh0", str);
+		after.wait();
+		str.wait();
+		rc |= check(before.ok && !bad.ok && bad.error.find("no-such-command") != string::npos
+				&& after.ok && after.ivalue == before.ivalue + 1, "error of a single command: " + bad.error);
+		rc |= check(str.ok && !str.svalue.empty(), "string reply: " + str.svalue);
+		XhReply empty(XhReply::XhReturnString), null(XhReply::XhReturnString);
+		client.sendAsync("echo", empty);
+		client.sendAsync("echo (null)", null);
+		null.wait();
+		rc |= check(empty.ok && empty.svalue.empty() && !null.ok, "empty and null string replies");
+
+		// timebar progress sent while the server waits is kept in the reply
+		XhReply wait(XhReply::XhReturnString);
+		simulator.setFrameRate(1000.);
+		client.sendWait("xstrip timing setup-group xh0 0 20 1 0");
+		client.sendWait("xstrip timing start xh0");
+		client.sendAsync("xstrip timing wait-frames xh0 10 5000", wait);
+		wait.wait();
+		rc |= check(wait.ok && wait.progress > 0 && wait.progress < 10 && wait.progress_total == 10, "timebar progress");
+
+		// blocking calls from several threads
+		const int nthreads = 4;
+		SenderThread* senders[nthreads];
+		for (int t = 0; t < nthreads; t++) {
+			senders[t] = new SenderThread(client, ncommands / nthreads);
+			senders[t]->start();
+		}
+		int errors = 0;
+		for (int t = 0; t < nthreads; t++) {
+			senders[t]->join();
+			errors += senders[t]->getErrors();
+			delete senders[t];
+		}
+		rc |= check(errors == 0, "blocking calls from several threads");
+
+		// latency of blocking and overlapped commands
+		simulator.setCommandLatency(latency);
+		int nslow = 50, handle;
+		double t0 = Timestamp::now();
+		for (int i = 0; i < nslow; i++)
+			client.sendWait(OPEN_CMD, handle);
+		double t1 = Timestamp::now();
+		for (int i = 0; i < nslow; i++)
+			client.sendAsync(OPEN_CMD, replies[i]);
+		for (int i = 0; i < nslow; i++)
+			replies[i].wait();
+		double t2 = Timestamp::now();
+		cout << nslow << " commands with " << latency * 1e3 << " ms latency: " << (t1 - t0) * 1e3 << " ms blocking, "
+				<< (t2 - t1) * 1e3 << " ms overlapped" << endl;
+		rc |= check(t2 - t1 < (t1 - t0) / 2, "overlapped commands");
+
+		// commands in flight when the connection is closed get an error
+		for (int i = 0; i < nslow; i++)
+			client.sendAsync(OPEN_CMD, replies[i]);
+		client.disconnectFromServer();
+		bool all_done = true;
+		for (int i = 0; i < nslow; i++)
+			all_done = all_done && replies[i].wait(0.);
+		rc |= check(all_done && !replies[nslow - 1].ok, "commands in flight on disconnect: " + replies[nslow - 1].error);
+		bool refused = false;
+		try {
+			client.sendAsync(OPEN_CMD, replies[0]);
+		} catch (Exception&) {
+			refused = true;
+		}
+		rc |= check(refused, "commands refused once disconnected");
+	} catch (Exception& ex) {
+		DEB_ERROR() << "LIMA Exception: " << ex;
+		rc = 1;
+	}
+	return rc;
+}
@@ -32,6 +32,7 @@
 #include "lima/Debug.h"
 #include <iostream>
 #include <unistd.h>
+#include <cstdlib>
 
 using namespace std;
 using namespace lima;
@@ -50,10 +51,10 @@ int main(int argc, char *argv[])
 	Interface *m_interface;
 	CtControl* m_control;
 
-	//xh configuration properties
-	string hostname = "gmvig1"; //"rnice31";
+	//xh configuration properties, the defaults target the ID24 detector
+	string hostname = (argc > 1) ? argv[1] : "gmvig1"; //"rnice31";
 	string configName = "config";
-	int port = 1972;
+	int port = (argc > 2) ? atoi(argv[2]) : 1972;
 
 	try {
 
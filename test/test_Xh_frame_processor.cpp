@@ -0,0 +1,428 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+//
+// Checks the FrameProcessor conversions against plain scalar loops and
+// reports their throughput.
+//
+// usage: test_Xh_frame_processor [npixels] [iterations]
+//
+
+#include "lima/Timestamp.h"
+
+#include "XhFrameProcessor.h"
+#include "lima/Exceptions.h"
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+static const char* simdName(FrameProcessor::SimdType simd) {
+	switch (simd) {
+	case FrameProcessor::XhSimdAVX2: return "avx2";
+	case FrameProcessor::XhSimdSSE2: return "sse2";
+	default: return "scalar";
+	}
+}
+
+template <class T>
+static int checkDeinterleave(const vector<T>& src, const vector<T>& dst, int npixels) {
+	int half = npixels / 2;
+	for (int i = 0; i < half; i++) {
+		if (dst[i] != src[2 * i] || dst[half + i] != src[2 * i + 1]) {
+			cout << "deinterleave error at pixel " << i << " of " << npixels << endl;
+			return 1;
+		}
+	}
+	if ((npixels & 1) && dst[npixels - 1] != src[npixels - 1]) {
+		cout << "deinterleave error at the odd last pixel of " << npixels << endl;
+		return 1;
+	}
+	return 0;
+}
+
+template <class T>
+static int testDeinterleave(int npixels, int iterations,
+		void (*kernel)(const T*, T*, int), const char* name) {
+	vector<T> src(npixels), dst(npixels);
+	for (int i = 0; i < npixels; i++)
+		src[i] = (T) (i * 2654435761u + 0x8000);
+
+	FrameProcessor::SimdType best = FrameProcessor::getBestSimd();
+	cout << name << ":";
+	for (int simd = FrameProcessor::XhSimdScalar; simd <= best; simd++) {
+		FrameProcessor::setSimd((FrameProcessor::SimdType) simd);
+		for (int n = 0; n <= 67 && n <= npixels; n++) {
+			kernel(&src[0], &dst[0], n);
+			if (checkDeinterleave(src, dst, n))
+				return 1;
+		}
+		double t0 = Timestamp::now();
+		for (int k = 0; k < iterations; k++)
+			kernel(&src[0], &dst[0], npixels);
+		double t1 = Timestamp::now();
+		if (checkDeinterleave(src, dst, npixels))
+			return 1;
+		cout << " " << simdName((FrameProcessor::SimdType) simd) << " "
+				<< (double) npixels * iterations / 1e6 / (t1 - t0) << " Mpixels/s";
+	}
+	cout << endl;
+	FrameProcessor::setSimd(best);
+	return 0;
+}
+
+// dark subtraction and gain correction, each SIMD type against the scalar kernel
+static int testCorrection(int npixels, int iterations) {
+	vector<uint32_t> src(npixels), ref(npixels), dst(npixels);
+	vector<float> dark(npixels), gain(npixels), ref_f(npixels), dst_f(npixels);
+	for (int i = 0; i < npixels; i++) {
+		src[i] = (i * 7919) % 100000;
+		dark[i] = 500.f + (i % 37);
+		gain[i] = 0.5f + (i % 11) * 0.1f;
+		// corrected values above 2^31, and above 2^32 which saturate
+		if (i % 13 == 0) {
+			src[i] = 0x7fff0000 + i;
+			gain[i] = (i % 26 == 0) ? 2.5f : 1.5f;
+		}
+	}
+	FrameProcessor::SimdType best = FrameProcessor::getBestSimd();
+	FrameProcessor::setSimd(FrameProcessor::XhSimdScalar);
+	FrameProcessor::correct32(&src[0], &dark[0], &gain[0], &ref[0], npixels);
+	FrameProcessor::correct32F(&src[0], &dark[0], &gain[0], &ref_f[0], npixels);
+	for (int i = 0; i < npixels; i += 13) {
+		if (ref[i] != ((i % 26 == 0) ? 0xffffffff : (uint32_t) lrintf(ref_f[i]))) {
+			cout << "correction not saturated at pixel " << i << ": " << ref[i] << endl;
+			return 1;
+		}
+	}
+
+	cout << "correct32/correct32F:";
+	for (int simd = FrameProcessor::XhSimdScalar; simd <= best; simd++) {
+		FrameProcessor::setSimd((FrameProcessor::SimdType) simd);
+		double t0 = Timestamp::now();
+		for (int k = 0; k < iterations; k++)
+			FrameProcessor::correct32(&src[0], &dark[0], &gain[0], &dst[0], npixels);
+		double t1 = Timestamp::now();
+		for (int k = 0; k < iterations; k++)
+			FrameProcessor::correct32F(&src[0], &dark[0], &gain[0], &dst_f[0], npixels);
+		double t2 = Timestamp::now();
+		for (int i = 0; i < npixels; i++) {
+			if (dst[i] != ref[i] || dst_f[i] != ref_f[i]) {
+				cout << endl << simdName((FrameProcessor::SimdType) simd) << " correction error at pixel " << i << endl;
+				return 1;
+			}
+		}
+		double mpixels = (double) npixels * iterations / 1e6;
+		cout << " " << simdName((FrameProcessor::SimdType) simd) << " " << mpixels / (t1 - t0)
+				<< "/" << mpixels / (t2 - t1) << " Mpixels/s";
+	}
+	cout << endl;
+	FrameProcessor::setSimd(best);
+
+	// in place, through the tables selected for an acquisition
+	FrameProcessor processor;
+	processor.setDark(100, &dark[0], npixels);
+	processor.setGain(&gain[0], npixels);
+	processor.setCorrection(true);
+	processor.prepare(100, npixels, Bpp32F, false);
+	dst = src;
+	processor.process(&dst[0]);
+	if (memcmp(&dst[0], &ref_f[0], npixels * sizeof(float)) != 0) {
+		cout << "in place correction error" << endl;
+		return 1;
+	}
+	return 0;
+}
+
+// dead pixels against a straightforward reference: the nearest good pixels on
+// each side within the head, or the only one at the ends of a head
+static int testInterpolation(int npixels, int iterations) {
+	FrameProcessor::SimdType best = FrameProcessor::getBestSimd();
+	vector<bool> dead_pixel(npixels, false);
+	FrameProcessor processor;
+	processor.setDeadPixels(0, 3, false);
+	processor.setDeadPixels(10, 5, false);
+	for (int p = 40; p + 3 < npixels - 6; p += 17)
+		processor.setDeadPixels(p, 3, false);
+	processor.setDeadPixels(npixels - 6, 6, false);
+	processor.setInterpolation(true);
+	for (int p = 0; p < npixels; p++)
+		dead_pixel[p] = (p < 3) || (p >= 10 && p < 15) || (p >= npixels - 6)
+				|| (p >= 40 && (p - 40) % 17 < 3 && p - (p - 40) % 17 + 3 < npixels - 6);
+
+	cout << "correction to Bpp32F and interpolation:";
+	for (int uninterleaved = 0; uninterleaved < 2; uninterleaved++) {
+		int half = npixels / 2;
+		int head_size = uninterleaved ? half : npixels;
+		vector<uint32_t> frame(npixels);	// raw counts in, Bpp32F out
+		vector<float> ref(npixels);
+		vector<bool> dead(npixels);
+		for (int i = 0; i < npixels; i++) {
+			// an odd last pixel belongs to no head when un-interleaved
+			int p = (uninterleaved && i < 2 * half) ? 2 * (i % half) + i / half : i;
+			dead[i] = dead_pixel[p] && (!uninterleaved || i < 2 * half);
+			ref[i] = dead[i] ? -1.f : (float) ((i * 7919) % 1000);
+		}
+		for (int i = 0; i < npixels; i++) {
+			if (!dead[i])
+				continue;
+			int start = (i / head_size) * head_size, end = start + head_size;
+			int l = i, r = i;
+			while (l >= start && dead[l])
+				l--;
+			while (r < end && dead[r])
+				r++;
+			if (l < start)
+				ref[i] = ref[r];
+			else if (r >= end)
+				ref[i] = ref[l];
+			else
+				ref[i] = ref[l] + (ref[r] - ref[l]) * ((float) (i - l) / (r - l));
+		}
+		processor.prepare(0, npixels, Bpp32F, uninterleaved);
+
+		for (int simd = FrameProcessor::XhSimdScalar; simd <= best; simd++) {
+			FrameProcessor::setSimd((FrameProcessor::SimdType) simd);
+			for (int i = 0; i < npixels; i++)
+				frame[i] = dead[i] ? 0xffffff : (uint32_t) ref[i];
+			processor.process(&frame[0]);
+			const float* out = (const float*) &frame[0];
+			for (int i = 0; i < npixels; i++) {
+				if (out[i] != ref[i]) {
+					cout << endl << simdName((FrameProcessor::SimdType) simd) << " interpolation error at pixel " << i
+							<< ": " << out[i] << " instead of " << ref[i] << endl;
+					return 1;
+				}
+			}
+			if (uninterleaved)
+				continue;
+			// the frame is float now, timing only
+			double t0 = Timestamp::now();
+			for (int k = 0; k < iterations; k++)
+				processor.process(&frame[0]);
+			double t1 = Timestamp::now();
+			cout << " " << simdName((FrameProcessor::SimdType) simd) << " " << iterations / (t1 - t0) << " frames/s";
+		}
+	}
+	cout << endl;
+	FrameProcessor::setSimd(best);
+	return 0;
+}
+
+// 64 bit accumulation, each SIMD type against the scalar kernel, then whole frames
+static int testAccumulation(int npixels, int iterations) {
+	vector<uint16_t> src16(npixels);
+	vector<uint32_t> src32(npixels), dst(npixels);
+	vector<uint64_t> ref16(npixels, 0), ref32(npixels, 0), acc16(npixels), acc32(npixels);
+	vector<float> dst_f(npixels);
+	for (int i = 0; i < npixels; i++) {
+		src16[i] = (uint16_t) (i * 7919 + 0x8000);
+		src32[i] = 0xfffffff0u - i;
+	}
+	FrameProcessor::SimdType best = FrameProcessor::getBestSimd();
+	FrameProcessor::setSimd(FrameProcessor::XhSimdScalar);
+	for (int k = 0; k < 3; k++) {
+		FrameProcessor::accumulate16(&ref16[0], &src16[0], npixels);
+		FrameProcessor::accumulate32(&ref32[0], &src32[0], npixels);
+	}
+
+	cout << "accumulate16/accumulate32:";
+	for (int simd = FrameProcessor::XhSimdScalar; simd <= best; simd++) {
+		FrameProcessor::setSimd((FrameProcessor::SimdType) simd);
+		acc16.assign(npixels, 0);
+		acc32.assign(npixels, 0);
+		for (int k = 0; k < 3; k++) {
+			FrameProcessor::accumulate16(&acc16[0], &src16[0], npixels);
+			FrameProcessor::accumulate32(&acc32[0], &src32[0], npixels);
+		}
+		if (acc16 != ref16 || acc32 != ref32) {
+			cout << endl << simdName((FrameProcessor::SimdType) simd) << " accumulation error" << endl;
+			return 1;
+		}
+		double t0 = Timestamp::now();
+		for (int k = 0; k < iterations; k++)
+			FrameProcessor::accumulate16(&acc16[0], &src16[0], npixels);
+		double t1 = Timestamp::now();
+		for (int k = 0; k < iterations; k++)
+			FrameProcessor::accumulate32(&acc32[0], &src32[0], npixels);
+		double t2 = Timestamp::now();
+		double mpixels = (double) npixels * iterations / 1e6;
+		cout << " " << simdName((FrameProcessor::SimdType) simd) << " " << mpixels / (t1 - t0)
+				<< "/" << mpixels / (t2 - t1) << " Mpixels/s";
+	}
+	cout << endl;
+	FrameProcessor::setSimd(best);
+	for (int i = 0; i < npixels; i++) {
+		if (ref32[i] != 3 * (uint64_t) src32[i]) {
+			cout << "accumulate32 overflow at pixel " << i << endl;
+			return 1;
+		}
+	}
+
+	// sums above 2^32 overflow unshifted Bpp32 frames, the frame is refused
+	FrameProcessor processor;
+	processor.prepare(0, npixels, Bpp32, false, 3);
+	for (int k = 0; k < 3; k++) {
+		if (processor.accumulate(&src32[0], false) != (k == 2)) {
+			cout << "accumulate completed after " << k + 1 << " frames" << endl;
+			return 1;
+		}
+	}
+	bool caught = false;
+	try {
+		processor.emit(&dst[0]);
+	} catch (Exception&) {
+		caught = true;
+	}
+	if (!caught) {
+		cout << "Bpp32 overflow accepted" << endl;
+		return 1;
+	}
+
+	// shifted Bpp32 frames keep the high bits, unshifted ones every bit of
+	// sums which fit, Bpp32F frames get the mean of any sum
+	vector<uint32_t> dst_small(npixels);
+	vector<float> dst_f16(npixels);
+	processor.prepare(0, npixels, Bpp32, false, 3, 2);
+	for (int k = 0; k < 3; k++)
+		processor.accumulate(&src32[0], false);
+	processor.emit(&dst[0]);
+	processor.prepare(0, npixels, Bpp32, false, 3);
+	for (int k = 0; k < 3; k++)
+		processor.accumulate(&src16[0], true);
+	processor.emit(&dst_small[0]);
+	processor.prepare(0, npixels, Bpp32F, false, 3);
+	for (int k = 0; k < 3; k++)
+		processor.accumulate(&src32[0], false);
+	processor.emit(&dst_f[0]);
+	const int nb_long = 1000;
+	processor.prepare(0, npixels, Bpp32F, false, nb_long);
+	for (int k = 0; k < nb_long; k++)
+		processor.accumulate(&src16[0], true);
+	processor.emit(&dst_f16[0]);
+	for (int i = 0; i < npixels; i++) {
+		if (ref32[i] <= 0xffffffffu || dst[i] != (uint32_t) llrint(ref32[i] / 4.) || dst_small[i] != ref16[i]
+				|| dst_f[i] != (float) src32[i] || dst_f16[i] != (float) src16[i]) {
+			cout << "accumulated frame error at pixel " << i << endl;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// a roi starting inside a run of dead pixels, with the tables of the full frame
+static int testRoi(int npixels) {
+	const int x = 12, width = 20;
+	if (npixels < x + width)
+		return 0;
+	vector<uint32_t> src(npixels), frame(width);
+	vector<float> dark(npixels), gain(npixels), ref(npixels);
+	for (int i = 0; i < npixels; i++) {
+		src[i] = 1000 + (i * 7919) % 1000;
+		dark[i] = 100.f + i;
+		gain[i] = 0.5f + (i % 11) * 0.1f;
+	}
+	FrameProcessor::correct32F(&src[0], &dark[0], &gain[0], &ref[0], npixels);
+	FrameProcessor processor;
+	processor.setDark(0, &dark[0], npixels);
+	processor.setGain(&gain[0], npixels);
+	processor.setCorrection(true);
+	processor.setDeadPixels(10, 5, false);
+	processor.setInterpolation(true);
+	processor.setRoi(x, width);
+	processor.prepare(0, npixels, Bpp32F, false);
+	memcpy(&frame[0], &src[x], width * sizeof(uint32_t));
+	processor.process(&frame[0]);
+	const float* out = (const float*) &frame[0];
+	for (int i = 0; i < width; i++) {
+		float expected = (x + i < 15) ? ref[15] : ref[x + i];
+		if (out[i] != expected) {
+			cout << "roi error at pixel " << i << ": " << out[i] << " instead of " << expected << endl;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int testWiden(int npixels, int iterations) {
+	vector<uint16_t> src(npixels);
+	vector<uint32_t> dst(npixels + 1), ref(npixels);
+	for (int i = 0; i < npixels; i++)
+		src[i] = (uint16_t) (i * 7919 + 0x8000);
+	dst[npixels] = 0xdeadbeef;
+
+	// all lengths around the vector width, for the tail handling
+	for (int n = 0; n <= 17 && n <= npixels; n++) {
+		FrameProcessor::widen16(&src[0], &dst[0], n);
+		for (int i = 0; i < n; i++) {
+			if (dst[i] != src[i]) {
+				cout << "widen16 error at pixel " << i << " of " << n << endl;
+				return 1;
+			}
+		}
+	}
+
+	double t0 = Timestamp::now();
+	for (int k = 0; k < iterations; k++) {
+		for (int i = 0; i < npixels; i++)
+			ref[i] = src[i];
+	}
+	double t1 = Timestamp::now();
+	for (int k = 0; k < iterations; k++)
+		FrameProcessor::widen16(&src[0], &dst[0], npixels);
+	double t2 = Timestamp::now();
+
+	for (int i = 0; i < npixels; i++) {
+		if (dst[i] != ref[i]) {
+			cout << "widen16 error at pixel " << i << endl;
+			return 1;
+		}
+	}
+	if (dst[npixels] != 0xdeadbeef) {
+		cout << "widen16 wrote past the end of the frame" << endl;
+		return 1;
+	}
+	double mpixels = (double) npixels * iterations / 1e6;
+	cout << "widen16 scalar: " << mpixels / (t1 - t0) << " Mpixels/s, FrameProcessor: "
+			<< mpixels / (t2 - t1) << " Mpixels/s" << endl;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int npixels = (argc > 1) ? atoi(argv[1]) : 1027;
+	int iterations = (argc > 2) ? atoi(argv[2]) : 10000;
+	int rc = 0;
+
+	rc |= testWiden(npixels, iterations);
+	rc |= testDeinterleave<uint16_t>(npixels, iterations, FrameProcessor::deinterleave16, "deinterleave16");
+	rc |= testDeinterleave<uint32_t>(npixels, iterations, FrameProcessor::deinterleave32, "deinterleave32");
+	rc |= testCorrection(npixels, iterations);
+	rc |= testInterpolation(npixels, iterations);
+	rc |= testAccumulation(npixels, iterations);
+	rc |= testRoi(npixels);
+	return rc;
+}
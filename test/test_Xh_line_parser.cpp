@@ -0,0 +1,270 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+//
+// Checks XhLineBuffer against the former per-byte response parser of
+// XhClient and compares the number of response lines per second each can
+// split and decode. Both read a recorded session from memory in recv sized
+// pieces, 1000 bytes for the former one.
+//
+// usage: test_Xh_line_parser [ncommands]
+//
+
+#include "lima/Timestamp.h"
+
+#include "XhClient.h"
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+// what a session parser found
+struct Totals {
+	long prompts;
+	long ints;
+	long int_sum;
+	long strings;
+	long string_bytes;
+	long messages;
+
+	Totals() : prompts(0), ints(0), int_sum(0), strings(0), string_bytes(0), messages(0) {}
+	bool operator==(const Totals& o) const {
+		return prompts == o.prompts && ints == o.ints && int_sum == o.int_sum && strings == o.strings
+				&& string_bytes == o.string_bytes && messages == o.messages;
+	}
+};
+
+// the parser used by XhClient before it read whole lines, getChar() reads
+// from the session instead of the socket
+class LegacyParser {
+public:
+	enum { CLN_NEXT_PROMPT, CLN_NEXT_ERRMSG, CLN_NEXT_DEBUGMSG, CLN_NEXT_UNKNOWN, CLN_NEXT_INTRET, CLN_NEXT_STRRET, CLN_EOF };
+
+	LegacyParser(const string& session) : m_session(session), m_pos(0), m_num_read(0), m_cur_pos(0) {}
+
+	int nextLine(string *errmsg, int *ivalue, string *svalue) {
+		int r, type;
+		char buff[1024 + 2];
+		char *bptr = buff;
+		do {
+			r = getChar();
+		} while (r == '\r' || r == '\n');
+
+		switch (r) {
+		case -1:
+			return CLN_EOF;
+		case '>':
+			getChar();
+			return CLN_NEXT_PROMPT;
+		case '!':
+		case '#':
+			type = r;
+			getChar();
+			while ((r = getChar()) != -1 && r != '\r' && r != '\n')
+				*bptr++ = r;
+			*bptr = '\0';
+			*errmsg = buff;
+			return (type == '!') ? CLN_NEXT_ERRMSG : CLN_NEXT_DEBUGMSG;
+		case '*':
+			getChar();
+			r = getChar();
+			if (r == '"') {
+				while ((r = getChar()) != -1 && r != '"')
+					*bptr++ = r;
+				*bptr = '\0';
+				*svalue = buff;
+				return CLN_NEXT_STRRET;
+			} else {
+				char buffer[80], *p;
+				buffer[0] = r;
+				p = &buffer[1];
+				while ((r = getChar()) != -1 && r != '\r' && r != '\n')
+					*p++ = r;
+				*p = '\0';
+				*ivalue = atoi(buffer);
+				return CLN_NEXT_INTRET;
+			}
+		default:
+			while ((r = getChar()) != -1 && r != '\r' && r != '\n')
+				*bptr++ = r;
+			*bptr = '\0';
+			*errmsg = buff;
+			return CLN_NEXT_UNKNOWN;
+		}
+	}
+
+private:
+	int getChar() {
+		if (m_num_read == m_cur_pos) {
+			int r = m_session.length() - m_pos;
+			if (r > 1000)
+				r = 1000;
+			if (r <= 0)
+				return -1;
+			memcpy(m_rd_buff, m_session.data() + m_pos, r);
+			m_pos += r;
+			m_cur_pos = 0;
+			m_num_read = r;
+		}
+		return m_rd_buff[m_cur_pos++];
+	}
+
+	const string& m_session;
+	int m_pos;
+	int m_num_read, m_cur_pos;
+	char m_rd_buff[1000];
+};
+
+static Totals legacyParse(const string& session) {
+	LegacyParser parser(session);
+	Totals totals;
+	string msg, svalue;
+	int ivalue;
+	for (;;) {
+		switch (parser.nextLine(&msg, &ivalue, &svalue)) {
+		case LegacyParser::CLN_EOF:
+			return totals;
+		case LegacyParser::CLN_NEXT_PROMPT:
+			totals.prompts++;
+			break;
+		case LegacyParser::CLN_NEXT_INTRET:
+			totals.ints++;
+			totals.int_sum += ivalue;
+			break;
+		case LegacyParser::CLN_NEXT_STRRET:
+			totals.strings++;
+			totals.string_bytes += svalue.length();
+			break;
+		default:
+			totals.messages++;
+			break;
+		}
+	}
+}
+
+// as XhClient::parseLine and completeRequest
+static Totals lineBufferParse(const string& session) {
+	XhLineBuffer buffer;
+	Totals totals;
+	string svalue;
+	int pos = 0;
+	while (pos < (int) session.length()) {
+		int len;
+		char* space = buffer.getSpace(len);
+		if (len > (int) session.length() - pos)
+			len = session.length() - pos;
+		memcpy(space, session.data() + pos, len);
+		pos += len;
+		buffer.fill(len);
+		const char* line;
+		while (buffer.nextLine(line, len)) {
+			switch (line[0]) {
+			case '>':
+				totals.prompts++;
+				break;
+			case '*':
+				if (line[2] == '"') {
+					const char* end = (const char*) memchr(line + 3, '"', len - 3);
+					svalue.assign(line + 3, end ? end - line - 3 : len - 3);
+					totals.strings++;
+					totals.string_bytes += svalue.length();
+				} else {
+					totals.ints++;
+					totals.int_sum += strtol(line + 2, 0, 10);
+				}
+				break;
+			default:
+				totals.messages++;
+				break;
+			}
+		}
+	}
+	return totals;
+}
+
+int main(int argc, char *argv[])
+{
+	int ncommands = (argc > 1) ? atoi(argv[1]) : 1000000;
+	int rc = 0;
+
+	// prompts and responses of a session: mostly integers, some status
+	// strings, error and debug messages
+	stringstream ss;
+	long nlines = 0;
+	for (int i = 0; i < ncommands; i++) {
+		ss << "> ";
+		switch (i % 10) {
+		case 0:
+			ss << "* \"  Running: group=3, frame=" << i << ", scan=7, cycle=2, completed=98765\"\n";
+			break;
+		case 1:
+			ss << "! setup-group: invalid group " << i << "\n* -1\n";
+			nlines++;
+			break;
+		case 2:
+			ss << "# executing " << i << "\n* 0\n";
+			nlines++;
+			break;
+		default:
+			ss << "* " << i << "\n";
+			break;
+		}
+		nlines += 2;
+	}
+	string session = ss.str();
+
+	double t0 = Timestamp::now();
+	Totals legacy = legacyParse(session);
+	double t1 = Timestamp::now();
+	Totals lines = lineBufferParse(session);
+	double t2 = Timestamp::now();
+
+	if (!(legacy == lines) || lines.prompts != ncommands) {
+		cout << "mismatch: " << legacy.prompts << "/" << lines.prompts << " prompts, "
+				<< legacy.int_sum << "/" << lines.int_sum << " sum, "
+				<< legacy.string_bytes << "/" << lines.string_bytes << " string bytes" << endl;
+		rc = 1;
+	}
+	// a string longer than the buffer, across several lines (the fixed
+	// buffers of the former parser would overflow)
+	string long_str(3 * RD_BUFF, 'x');
+	for (int i = 100; i < (int) long_str.length(); i += 100)
+		long_str[i] = '\n';
+	session = "> * \"" + long_str + "\"\n> * 7\n";
+	Totals expected;
+	expected.prompts = 2;
+	expected.ints = 1;
+	expected.int_sum = 7;
+	expected.strings = 1;
+	expected.string_bytes = long_str.length();
+	if (!(lineBufferParse(session) == expected)) {
+		cout << "mismatch parsing a string of " << long_str.length() << " bytes" << endl;
+		rc = 1;
+	}
+
+	cout << "per-byte parser:   " << nlines / (t1 - t0) << " lines/s" << endl;
+	cout << "line buffer:       " << nlines / (t2 - t1) << " lines/s" << endl;
+	return rc;
+}
@@ -0,0 +1,344 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+//
+// Breaks the connection to the loopback da.server simulator, with and
+// without losing the server state, and checks that the camera reconnects by
+// itself and replays its configuration and timing program, within a second.
+// A connection lost during an acquisition fails the acquisition, and is only
+// opened again once the acquisition thread stopped using it. A reconnect does
+// not hold the acquisition lock over the network. A camera which cannot
+// connect leaves no thread behind.
+//
+// usage: test_Xh_reconnect [nb_heads] [latency_ms]
+//
+
+#include "lima/HwInterface.h"
+#include "lima/HwFrameCallback.h"
+#include "lima/ThreadUtils.h"
+#include "lima/Timestamp.h"
+
+#include "XhCamera.h"
+#include "XhInterface.h"
+#include "XhSimulator.h"
+#include "lima/Debug.h"
+#include "lima/Exceptions.h"
+#include <iostream>
+#include <cstdlib>
+#include <unistd.h>
+#include <dirent.h>
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+DEB_GLOBAL(DebModTest);
+
+static const double MAX_RECOVERY = 1.;		// seconds
+
+static int countThreads() {
+	int n = 0;
+	DIR* dir = opendir("/proc/self/task");
+	if (dir == 0)
+		return -1;
+	while (struct dirent* entry = readdir(dir)) {
+		if (entry->d_name[0] != '.')
+			n++;
+	}
+	closedir(dir);
+	return n;
+}
+
+static void configure(Camera& camera, int nb_heads) {
+	camera.setupClock(Camera::XhESRF5468MHz);
+	for (int head = 0; head < nb_heads; head++) {
+		camera.setHeadCaps(2, 2, head);
+		camera.setHeadDac(-0.5, Camera::XhVdd, head);
+		camera.setOffsets(head * 512, 512, 100 + head);
+		camera.setDeadPixels(head * 512 + 7, 2);
+	}
+	for (int out = 0; out < 8; out++)
+		camera.setExtTrigOutput(out, Camera::XhTrigOut_dc, 1);
+	camera.setTimingOrbit(10);
+}
+
+static int check(Simulator& simulator, Camera& camera, const vector<string>& replayed, int total, const char* what) {
+	int rc = 0;
+	// the next status poll notices the lost connection
+	double t0 = Timestamp::now();
+	Camera::XhStatus status;
+	camera.getStatus(status);
+	double t1 = Timestamp::now();
+	cout << what << ": recovered in " << (t1 - t0) * 1e3 << " ms" << endl;
+	if (t1 - t0 > MAX_RECOVERY) {
+		cout << what << ": recovery too slow" << endl;
+		rc = 1;
+	}
+	if (simulator.getConfigCommands() != replayed) {
+		cout << what << ": configuration not replayed in order" << endl;
+		rc = 1;
+	}
+	int total_frames;
+	camera.getTotalFrames(total_frames);
+	if (total_frames != total) {
+		cout << what << ": timing program lost, " << total_frames << " frames instead of " << total << endl;
+		rc = 1;
+	}
+	// the data handle is usable again
+	vector<uint32_t> frame(1024);
+	camera.readFrame(&frame[0], 3, 1);
+	for (int i = 0; i < 1024; i++) {
+		if (frame[i] != Simulator::pixelValue(3, i)) {
+			cout << what << ": wrong pixel " << i << " after reconnecting" << endl;
+			rc = 1;
+			break;
+		}
+	}
+	return rc;
+}
+
+/*
+ * Holds the frames while closed: once the buffers are full the acquisition
+ * thread waits for a free one, without using the connection.
+ */
+class FrameGate : public HwFrameCallback {
+public:
+	FrameGate() : m_open(true) {}
+
+	virtual bool newFrameReady(const HwFrameInfoType& frame_info) {
+		AutoMutex aLock(m_cond.mutex());
+		while (!m_open)
+			m_cond.wait();
+		return true;
+	}
+
+	void setOpen(bool open) {
+		AutoMutex aLock(m_cond.mutex());
+		m_open = open;
+		m_cond.broadcast();
+	}
+
+private:
+	Cond m_cond;
+	bool m_open;
+};
+
+/*
+ * Polls the status once, reconnecting if the connection was lost
+ */
+class PollThread : public Thread {
+public:
+	PollThread(Camera& camera) : m_camera(camera), m_ok(false) {}
+
+	bool isOk() const { return m_ok; }
+
+protected:
+	virtual void threadFunction() {
+		try {
+			Camera::XhStatus status;
+			m_camera.getStatus(status);
+			m_ok = true;
+		} catch (Exception&) {
+		}
+	}
+
+private:
+	Camera& m_camera;
+	bool m_ok;
+};
+
+static int pollDuringReconnect(Simulator& simulator, Camera& camera, double latency) {
+	int rc = 0;
+	simulator.setCommandLatency(0.05);
+	simulator.dropConnections();
+	usleep(10000);
+	PollThread poll(camera);
+	poll.start();
+	usleep(20000);
+	double t0 = Timestamp::now();
+	camera.getNbHwAcquiredFrames();
+	double elapsed = Timestamp::now() - t0;
+	poll.join();
+	simulator.setCommandLatency(latency);
+	cout << "reconnecting: frame count read in " << elapsed * 1e3 << " ms" << endl;
+	if (elapsed > 0.01) {
+		cout << "reconnecting: acquisition lock held over the network" << endl;
+		rc = 1;
+	}
+	if (!poll.isOk()) {
+		cout << "reconnecting: status poll failed" << endl;
+		rc = 1;
+	}
+	return rc;
+}
+
+static int dropDuringAcquisition(Simulator& simulator, Camera& camera, FrameGate& gate) {
+	int rc = 0;
+	Interface hw(camera);
+	HwBufferCtrlObj *buffer = camera.getBufferCtrlObj();
+	buffer->setFrameDim(FrameDim(Size(1024, 1), Bpp32));
+	buffer->setNbBuffers(16);
+	buffer->registerFrameCallback(gate);
+	camera.setNbFrames(5000);
+	simulator.setFrameRate(1000.);
+	hw.prepareAcq();
+	hw.startAcq();
+	double t0 = Timestamp::now();
+	while (camera.getNbHwAcquiredFrames() < 10 && Timestamp::now() - t0 < 5.)
+		usleep(1000);
+	gate.setOpen(false);
+	usleep(100000);
+	simulator.dropConnections();
+	usleep(10000);
+
+	// a poll from another thread does not reconnect under the acquisition thread
+	Camera::XhStatus status;
+	string error;
+	try {
+		camera.getStatus(status);
+		cout << "acquisition: reconnected while acquiring" << endl;
+		rc = 1;
+	} catch (Exception& e) {
+		cout << "acquisition: poll refused with [" << e.getErrMsg() << "]" << endl;
+	}
+	gate.setOpen(true);
+	t0 = Timestamp::now();
+	while (camera.isAcqRunning() && Timestamp::now() - t0 < 5.)
+		usleep(1000);
+	if (camera.isAcqRunning()) {
+		cout << "acquisition: still running on a lost connection" << endl;
+		hw.stopAcq();
+		return 1;
+	}
+	hw.stopAcq();
+	camera.getAcqError(error);
+	cout << "acquisition: failed with [" << error << "] after " << camera.getNbHwAcquiredFrames() << " frames" << endl;
+	if (error.empty()) {
+		cout << "acquisition: lost connection not reported" << endl;
+		rc = 1;
+	}
+
+	// once stopped, the next poll reconnects and reports the failure
+	HwInterface::StatusType hw_status;
+	hw.getStatus(hw_status);
+	if (hw_status.acq != AcqFault) {
+		cout << "acquisition: failure not in the status" << endl;
+		rc = 1;
+	}
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	DEB_GLOBAL_FUNCT();
+	int nb_heads = (argc > 1) ? atoi(argv[1]) : 16;
+	double latency = ((argc > 2) ? atof(argv[2]) : 1.) * 1e-3;
+	int rc = 0;
+
+	try {
+		// nothing listens on port 1
+		int nb_threads = countThreads();
+		bool refused = false;
+		try {
+			Camera unreachable("localhost", 1, "");
+		} catch (Exception&) {
+			refused = true;
+		}
+		if (!refused || countThreads() != nb_threads) {
+			cout << "threads left behind by a failed connection: " << countThreads() - nb_threads << endl;
+			rc = 1;
+		}
+
+		FrameGate gate;
+		Simulator simulator;
+		simulator.start();
+		Camera camera("localhost", simulator.getPort(), "config");
+		simulator.setCommandLatency(latency);
+
+		configure(camera, nb_heads);
+		vector<Camera::XhTimingGroup> groups(3);
+		int total = 0;
+		for (unsigned int g = 0; g < groups.size(); g++) {
+			camera.setDefaultTimingParameters(groups[g].timingParams);
+			groups[g].nframes = 10 * (g + 1);
+			groups[g].nscans = 1;
+			groups[g].intTime = 1000;
+			total += groups[g].nframes;
+		}
+		camera.setTimingGroups(groups);
+		vector<string> config = simulator.getConfigCommands();
+
+		// network failure, the server keeps its state
+		simulator.dropConnections();
+		usleep(10000);
+		vector<string> twice(config);
+		twice.insert(twice.end(), config.begin(), config.end());
+		rc |= check(simulator, camera, twice, total, "dropped");
+
+		// server restart, everything is programmed again
+		simulator.dropConnections(true);
+		usleep(10000);
+		rc |= check(simulator, camera, config, total, "restarted");
+
+		// lost while configuring, the command is sent again after the replay
+		simulator.dropConnections(true);
+		usleep(10000);
+		camera.setTimingOrbit(10);
+		vector<string> orbit(config);
+		orbit.push_back(config.back());
+		if (simulator.getConfigCommands() != orbit) {
+			cout << "configuration not replayed before the new command" << endl;
+			rc = 1;
+		}
+
+		// lost during a setup sequence, replayed by endSetup
+		camera.beginSetup();
+		simulator.dropConnections(true);
+		usleep(10000);
+		configure(camera, nb_heads);
+		camera.endSetup();
+		rc |= check(simulator, camera, config, total, "setup");
+
+		rc |= pollDuringReconnect(simulator, camera, latency);
+		rc |= dropDuringAcquisition(simulator, camera, gate);
+
+		// without auto-reconnect the error is reported
+		camera.setAutoReconnect(false);
+		simulator.dropConnections();
+		usleep(10000);
+		bool caught = false;
+		try {
+			Camera::XhStatus status;
+			camera.getStatus(status);
+		} catch (Exception& e) {
+			caught = true;
+		}
+		if (!caught) {
+			cout << "lost connection not reported" << endl;
+			rc = 1;
+		}
+		camera.reset();
+	} catch (Exception& ex) {
+		DEB_ERROR() << "LIMA Exception: " << ex;
+		rc = 1;
+	}
+	return rc;
+}
@@ -0,0 +1,145 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+//
+// Compares the time to configure the detector one command at a time and
+// pipelined between Camera::beginSetup and Camera::endSetup, against the
+// loopback da.server simulator with a simulated network latency, and checks
+// that the errors of pipelined commands are reported and that the readout
+// mode keeps the image type when it can.
+//
+// usage: test_Xh_setup [nb_heads] [latency_ms]
+//
+
+#include "lima/Timestamp.h"
+
+#include "XhCamera.h"
+#include "XhSimulator.h"
+#include "lima/Debug.h"
+#include <iostream>
+#include <cstdlib>
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+DEB_GLOBAL(DebModTest);
+
+// records the last image type the camera reported
+class TypeCallback : public HwMaxImageSizeCallback {
+public:
+	TypeCallback() : m_count(0), m_type(Bpp8) {}
+	virtual void maxImageSizeChanged(const Size& size, ImageType type) {
+		m_count++;
+		m_type = type;
+	}
+	int m_count;
+	ImageType m_type;
+};
+
+// a typical configuration sequence: clock, then caps, dacs, offsets and
+// dead pixels of each head, then the trigger outputs
+static void configure(Camera& camera, int nb_heads) {
+	camera.setupClock(Camera::XhESRF5468MHz);
+	for (int head = 0; head < nb_heads; head++) {
+		camera.setHeadCaps(2, 2, head);
+		camera.setHeadDac(-0.5, Camera::XhVdd, head);
+		camera.setCalEn(false, head);
+		camera.setOffsets(head * 512, 512, 100 + head);
+		camera.setDeadPixels(head * 512 + 7, 2);
+	}
+	for (int out = 0; out < 8; out++)
+		camera.setExtTrigOutput(out, Camera::XhTrigOut_dc, 1);
+}
+
+int main(int argc, char *argv[])
+{
+	DEB_GLOBAL_FUNCT();
+	int nb_heads = (argc > 1) ? atoi(argv[1]) : 16;
+	double latency = ((argc > 2) ? atof(argv[2]) : 1.) * 1e-3;
+	int rc = 0;
+
+	try {
+		Simulator simulator;
+		simulator.start();
+		Camera camera("localhost", simulator.getPort(), "config");
+		simulator.setCommandLatency(latency);
+
+		double t0 = Timestamp::now();
+		configure(camera, nb_heads);
+		double t1 = Timestamp::now();
+		camera.beginSetup();
+		configure(camera, nb_heads);
+		camera.endSetup();
+		double t2 = Timestamp::now();
+		cout << "setup of " << nb_heads << " heads: " << (t1 - t0) * 1e3 << " ms one by one, "
+				<< (t2 - t1) * 1e3 << " ms pipelined" << endl;
+
+		// a refused command in the middle, the ones after it still get their response
+		camera.beginSetup();
+		camera.setHeadCaps(2, 2, 0);
+		camera.sendCommand("no-such-command");
+		camera.setHeadCaps(2, 2, 1);
+		int total_frames;
+		camera.getTotalFrames(total_frames);	// sends the queued commands first
+		camera.sendCommand("no-such-command-either");
+		bool caught = false;
+		try {
+			camera.endSetup();
+		} catch (Exception& e) {
+			caught = true;
+			cout << "expected error: " << e << endl;
+		}
+		if (!caught) {
+			cout << "refused commands were not reported" << endl;
+			rc = 1;
+		}
+		// the connection is still in step
+		camera.setHeadCaps(2, 2, 0);
+		camera.getTotalFrames(total_frames);
+
+		// the readout mode keeps the image type unless it cannot be read
+		TypeCallback cb;
+		camera.registerMaxImageSizeCallback(cb);
+		ImageType type;
+		camera.setImageType(Bpp32F);
+		camera.set16BitReadout(true);
+		camera.set16BitReadout(false);
+		camera.getImageType(type);
+		if (type != Bpp32F || cb.m_count != 1) {
+			cout << "the readout mode changed the Bpp32F image type" << endl;
+			rc = 1;
+		}
+		camera.set16BitReadout(true);
+		camera.setImageType(Bpp16);
+		camera.set16BitReadout(false);
+		camera.getImageType(type);
+		if (type != Bpp32 || cb.m_type != Bpp32 || cb.m_count != 3) {
+			cout << "Bpp16 frames were kept in 32 bit readout mode" << endl;
+			rc = 1;
+		}
+		camera.unregisterMaxImageSizeCallback(cb);
+	} catch (Exception& ex) {
+		DEB_ERROR() << "LIMA Exception: " << ex;
+		rc = 1;
+	}
+	return rc;
+}
@@ -0,0 +1,107 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+//
+// Has the loopback da.server simulator send data blocks shorter than asked
+// for, over each data path, and checks that the read fails instead of
+// leaving stale data at the end of the frame, and that the next read works.
+// Timing data reads go through the same path, including blocks larger than
+// the socket buffers.
+//
+
+#include "XhCamera.h"
+#include "XhSimulator.h"
+#include "lima/Debug.h"
+#include "lima/Exceptions.h"
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+DEB_GLOBAL(DebModTest);
+
+int main(int argc, char *argv[])
+{
+	DEB_GLOBAL_FUNCT();
+	const char* modes[] = { "connect-back", "persistent", "shared memory" };
+	const int npixels = 1024;
+	int rc = 0;
+
+	for (int mode = 0; mode < 3; mode++) {
+		try {
+			Simulator simulator(0, npixels);
+			simulator.start();
+			Camera camera("localhost", simulator.getPort(), "config");
+			camera.setPersistentDataConnection(mode == 1);
+			camera.setSharedMemoryData(mode == 2);
+			vector<uint32_t> frame(npixels);
+
+			simulator.setShortBlocks(4);
+			bool caught = false;
+			try {
+				camera.readFrame(&frame[0], 3, 1);
+			} catch (Exception& e) {
+				caught = true;
+			}
+			if (!caught) {
+				cout << modes[mode] << ": short block not reported" << endl;
+				rc = 1;
+			}
+
+			const int nparams = 30, ngroups = 8192;
+			vector<unsigned int> timing(nparams * ngroups);
+			caught = false;
+			try {
+				camera.getTimingInfo(&timing[0], 0, nparams, 0, 2);
+			} catch (Exception& e) {
+				caught = true;
+			}
+			if (!caught) {
+				cout << modes[mode] << ": short timing block not reported" << endl;
+				rc = 1;
+			}
+
+			simulator.setShortBlocks(0);
+			camera.getTimingInfo(&timing[0], 0, nparams, 0, ngroups);
+			for (int i = 0; i < nparams * ngroups; i++) {
+				if (timing[i] != (unsigned int) ((i / nparams) * 100 + i % nparams)) {
+					cout << modes[mode] << ": wrong timing word " << i << endl;
+					rc = 1;
+					break;
+				}
+			}
+			camera.readFrame(&frame[0], 5, 1);
+			for (int i = 0; i < npixels; i++) {
+				if (frame[i] != Simulator::pixelValue(5, i)) {
+					cout << modes[mode] << ": wrong pixel " << i << " after a short block" << endl;
+					rc = 1;
+					break;
+				}
+			}
+		} catch (Exception& ex) {
+			DEB_ERROR() << modes[mode] << ": LIMA Exception: " << ex;
+			rc = 1;
+		}
+	}
+	return rc;
+}
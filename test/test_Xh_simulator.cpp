@@ -0,0 +1,480 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+//
+// Readout benchmark of Camera::AcqThread and XhClient against the
+// loopback da.server simulator.
+//
+// usage: test_Xh_simulator [-n nframes] [-r frame_rate] [-x npixels] [-b nbuffers] [-w wait] [-k chunk] [-a nacc] [-A shift] [-C nconcat] [-G ngroups] [-R x:width] [-S nstreams] [-B rcvbuf] [-P busy_poll] [-u where] [-U] [-M] [-Q] [-s] [-W] [-F] [-d] [-p] [-c] [-l]
+//   -w  frame wait mode: poll, adaptive or server
+//   -b  number of LImA frame buffers (default nframes)
+//   -k  most frames per read command, 0 for the default byte limit only
+//   -a  detector frames summed in each LImA frame
+//   -A  right shift of the sums in Bpp32 frames
+//   -C  detector frames concatenated as the rows of each LImA frame
+//   -G  program the acquisition as ngroups timing groups, one by one then pipelined
+//   -R  read a roi of width pixels from pixel x
+//   -S  split large reads over nstreams data connections, then drain the
+//       whole run in one read on one and on nstreams connections
+//   -u  un-interleave the heads on the server or the client
+//   -s  16 bit readout into Bpp16 frames
+//   -W  16 bit readout widened to Bpp32 frames
+//   -F  Bpp32F frames
+//   -d  dark subtraction and gain correction
+//   -p  use a persistent data connection
+//   -c  use a separate control connection for status queries
+//   -l  simulate an older server without protocol extensions
+//
+
+#include "lima/HwInterface.h"
+#include "lima/HwFrameCallback.h"
+#include "lima/Timestamp.h"
+
+#include "XhCamera.h"
+#include "XhInterface.h"
+#include "XhSimulator.h"
+#include "lima/Debug.h"
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+DEB_GLOBAL(DebModTest);
+
+class FrameCounter : public HwFrameCallback {
+public:
+	FrameCounter(int npixels, bool readout16, ImageType type, bool uninterleave, int nb_accumulate) : m_npixels(npixels), m_roi_x(0),
+			m_roi_width(npixels), m_nb_concat(1), m_readout16(readout16), m_type(type), m_uninterleave(uninterleave), m_nb_accumulate(nb_accumulate),
+			m_acc_shift(0), m_dark(0.f), m_gain(1.f), m_frame_period(0.), m_group_frames(0), m_group_delay(0.), m_nb_frames(0), m_errors(0), m_bad_timestamps(0),
+			m_first_frame(0.) {}
+
+	// expect frames holding pixels x to x + width - 1 of nb_concat strips
+	void setRoi(int x, int width, int nb_concat) {
+		m_roi_x = x;
+		m_roi_width = width;
+		m_nb_concat = nb_concat;
+	}
+
+	// expect accumulated Bpp32 frames shifted right by shift bits
+	void setAccumulationShift(int shift) {
+		m_acc_shift = shift;
+	}
+
+	// expect frames corrected with a flat dark and gain
+	void setCorrection(float dark, float gain) {
+		m_dark = dark;
+		m_gain = gain;
+	}
+
+	// expect frames timestamped every frame_period seconds, group_delay more
+	// before every group of group_frames frames
+	void setFramePeriod(double frame_period, int group_frames=0, double group_delay=0.) {
+		m_frame_period = frame_period;
+		m_group_frames = group_frames;
+		m_group_delay = group_delay;
+	}
+
+	virtual bool newFrameReady(const HwFrameInfoType& frame_info) {
+		if (m_frame_period > 0.) {
+			double expected = frame_info.acq_frame_nb * m_frame_period;
+			if (m_group_frames > 0)
+				expected += (frame_info.acq_frame_nb / m_group_frames + 1) * m_group_delay;
+			if (fabs(double(frame_info.frame_timestamp) - expected) > 1e-9)
+				m_bad_timestamps++;
+		}
+		for (int row = 0; row < m_nb_concat; row++) {
+			if (!checkStrip(frame_info.frame_ptr, row * m_roi_width, frame_info.acq_frame_nb * m_nb_concat + row)) {
+				m_errors++;
+				break;
+			}
+		}
+		AutoMutex aLock(m_cond.mutex());
+		if (m_nb_frames == 0)
+			m_first_frame = Timestamp::now();
+		m_nb_frames++;
+		m_cond.broadcast();
+		return true;
+	}
+
+	// check the strip starting at pixel offset of the frame, from detector frame strip
+	bool checkStrip(const void* frame_ptr, int offset, int strip) {
+		for (int i = 0; i < m_roi_width; i++) {
+			int pixel = m_roi_x + i;
+			if (m_uninterleave)
+				pixel = (pixel < m_npixels / 2) ? 2 * pixel : 2 * (pixel - m_npixels / 2) + 1;
+			if (m_nb_accumulate > 1) {
+				if (!checkAccumulated(frame_ptr, offset + i, strip, pixel))
+					return false;
+				continue;
+			}
+			uint32_t expected = Simulator::pixelValue(strip, pixel);
+			uint32_t value;
+			if (m_readout16)
+				expected &= 0xffff;
+			float corrected = ((float) expected - m_dark) * m_gain;
+			if (m_type == Bpp16) {
+				value = ((const uint16_t *) frame_ptr)[offset + i];
+			} else if (m_type == Bpp32F) {
+				value = (((const float *) frame_ptr)[offset + i] == corrected) ? expected : ~expected;
+			} else {
+				value = ((const uint32_t *) frame_ptr)[offset + i];
+				if (m_dark != 0.f || m_gain != 1.f)
+					expected = (corrected > 0.f) ? (uint32_t) lrintf(corrected) : 0;
+			}
+			if (value != expected)
+				return false;
+		}
+		return true;
+	}
+
+	bool waitFrames(int nb_frames, double timeout) {
+		AutoMutex aLock(m_cond.mutex());
+		while (m_nb_frames < nb_frames) {
+			if (!m_cond.wait(timeout))
+				return false;
+		}
+		return true;
+	}
+
+	// sum of the detector frames, corrected sum in Bpp32 frames and corrected mean in Bpp32F frames
+	bool checkAccumulated(const void* frame_ptr, int i, int strip, int pixel) {
+		uint64_t sum = 0;
+		for (int k = 0; k < m_nb_accumulate; k++) {
+			uint32_t v = Simulator::pixelValue(strip * m_nb_accumulate + k, pixel);
+			sum += m_readout16 ? (v & 0xffff) : v;
+		}
+		double n = m_nb_accumulate;
+		if (m_type == Bpp32F) {
+			float expected = (float) (((double) sum / n - m_dark) * m_gain);
+			return ((const float *) frame_ptr)[i] == expected;
+		}
+		double v = ((double) sum - n * m_dark) * m_gain / (double) (1 << m_acc_shift);
+		uint32_t expected = (v <= 0.) ? 0 : (v >= 4294967295.) ? 0xffffffffu : (uint32_t) llrint(v);
+		return ((const uint32_t *) frame_ptr)[i] == expected;
+	}
+
+	int getErrors() const { return m_errors; }
+	int getBadTimestamps() const { return m_bad_timestamps; }
+	double getFirstFrameTime() const { return m_first_frame; }
+
+private:
+	Cond m_cond;
+	int m_npixels;
+	int m_roi_x;
+	int m_roi_width;
+	int m_nb_concat;
+	bool m_readout16;
+	ImageType m_type;
+	bool m_uninterleave;
+	int m_nb_accumulate;
+	int m_acc_shift;
+	float m_dark;
+	float m_gain;
+	double m_frame_period;
+	int m_group_frames;
+	double m_group_delay;
+	int m_nb_frames;
+	int m_errors;
+	int m_bad_timestamps;
+	double m_first_frame;
+};
+
+// Polls the detector status during the acquisition, as Tango monitoring does
+class StatusMonitor : public Thread {
+public:
+	StatusMonitor(Camera& cam) : m_cam(cam), m_quit(false), m_nb_queries(0), m_max_latency(0.) {}
+	~StatusMonitor() { stop(); }
+
+	void stop() {
+		m_quit = true;
+		join();
+	}
+
+	int getNbQueries() const { return m_nb_queries; }
+	double getMaxLatency() const { return m_max_latency; }
+
+protected:
+	virtual void threadFunction() {
+		while (!m_quit) {
+			Camera::XhStatus status;
+			double t0 = Timestamp::now();
+			m_cam.getStatus(status);
+			double latency = double(Timestamp::now()) - t0;
+			if (latency > m_max_latency)
+				m_max_latency = latency;
+			m_nb_queries++;
+			usleep(1000);
+		}
+	}
+
+private:
+	Camera& m_cam;
+	volatile bool m_quit;
+	int m_nb_queries;
+	double m_max_latency;
+};
+
+int main(int argc, char *argv[])
+{
+	DEB_GLOBAL_FUNCT();
+	int nframes = 1000;
+	double frame_rate = 0.;
+	int npixels = 1024;
+	int nbuffers = 0;
+	int chunk_frames = -1;
+	int nb_accumulate = 1;
+	int acc_shift = 0;
+	int nb_concat = 1;
+	int nb_groups = 0;
+	int roi_x = 0;
+	int roi_width = 0;
+	int nb_streams = 1;
+	int rcvbuf = 0;
+	int busy_poll = 0;
+	bool quickack = false;
+	bool unix_socket = false;
+	bool shared_memory = false;
+	Camera::FrameWaitType frame_wait = Camera::XhWaitPoll;
+	bool persistent = false;
+	bool control = false;
+	bool readout16 = false;
+	bool uninterleave = false;
+	bool client_uninterleave = false;
+	ImageType image_type = Bpp32;
+	bool correction = false;
+	bool legacy = false;
+	int rc = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:x:b:w:k:a:A:C:G:R:S:B:P:u:UMQsWFdpcl")) != -1) {
+		switch (opt) {
+		case 'n': nframes = atoi(optarg); break;
+		case 'r': frame_rate = atof(optarg); break;
+		case 'x': npixels = atoi(optarg); break;
+		case 'b': nbuffers = atoi(optarg); break;
+		case 'k': chunk_frames = atoi(optarg); break;
+		case 'a': nb_accumulate = atoi(optarg); break;
+		case 'A': acc_shift = atoi(optarg); break;
+		case 'C': nb_concat = atoi(optarg); break;
+		case 'G': nb_groups = atoi(optarg); break;
+		case 'R': sscanf(optarg, "%d:%d", &roi_x, &roi_width); break;
+		case 'S': nb_streams = atoi(optarg); break;
+		case 'B': rcvbuf = atoi(optarg); break;
+		case 'P': busy_poll = atoi(optarg); break;
+		case 'Q': quickack = true; break;
+		case 'U': unix_socket = true; break;
+		case 'M': shared_memory = true; break;
+		case 'w':
+			if (string(optarg) == "adaptive")
+				frame_wait = Camera::XhWaitAdaptive;
+			else if (string(optarg) == "server")
+				frame_wait = Camera::XhWaitServer;
+			break;
+		case 'p': persistent = true; break;
+		case 'c': control = true; break;
+		case 'u':
+			uninterleave = true;
+			client_uninterleave = (string(optarg) == "client");
+			break;
+		case 's': readout16 = true; image_type = Bpp16; break;
+		case 'W': readout16 = true; image_type = Bpp32; break;
+		case 'F': image_type = Bpp32F; break;
+		case 'd': correction = true; break;
+		case 'l': legacy = true; break;
+		default:
+			cerr << "usage: " << argv[0] << " [-n nframes] [-r frame_rate] [-x npixels] [-b nbuffers] [-w wait] [-k chunk] [-a nacc] [-A shift] [-C nconcat] [-G ngroups] [-R x:width] [-S nstreams] [-B rcvbuf] [-P busy_poll] [-u where] [-U] [-M] [-Q] [-s] [-W] [-F] [-d] [-p] [-c] [-l]" << endl;
+			return 2;
+		}
+	}
+
+	try {
+		Simulator simulator(0, npixels);
+		simulator.setFrameRate(frame_rate);
+		simulator.setMaxFrames(nframes * nb_concat * nb_accumulate);
+		simulator.setLegacyProtocol(legacy);
+		stringstream unix_path;
+		unix_path << "/tmp/xh_simulator_" << getpid() << ".sock";
+		if (unix_socket)
+			simulator.setUnixPath(unix_path.str());
+		simulator.start();
+
+		Camera camera(unix_socket ? unix_path.str() : "localhost", simulator.getPort(), "config");
+		Interface hw(camera);
+		FrameCounter counter(npixels, readout16, image_type, uninterleave, nb_accumulate);
+		if (persistent)
+			camera.setPersistentDataConnection(true);
+		if (control)
+			camera.setControlConnection(true);
+		if (shared_memory) {
+			camera.setSharedMemoryData(true);
+			bool enabled;
+			camera.getSharedMemoryData(enabled);
+			if (enabled == legacy) {
+				cout << "shared memory " << (enabled ? "used with a legacy server" : "not used") << endl;
+				rc = 1;
+			}
+		}
+		camera.setDataStreams(nb_streams);
+		if (rcvbuf > 0 || quickack || busy_poll > 0)
+			camera.setDataSocketOptions(rcvbuf, quickack, busy_poll);
+		camera.setFrameWaitMode(frame_wait);
+		if (chunk_frames >= 0)
+			camera.setReadChunkSize(chunk_frames, DEFAULT_CHUNK_BYTES);
+
+		if (uninterleave) {
+			camera.setClientUninterleave(client_uninterleave);
+			camera.uninterleave(true);
+		}
+		if (readout16)
+			camera.set16BitReadout(true);
+		camera.setImageType(image_type);
+		camera.setAccumulation(nb_accumulate);
+		camera.setAccumulationShift(acc_shift);
+		counter.setAccumulationShift(acc_shift);
+		camera.setConcatFrames(nb_concat);
+		if (correction) {
+			const float dark = 1000.f, gain = 0.75f;
+			vector<float> dark_table(npixels, dark), gain_table(npixels, gain);
+			camera.setDark(frame_rate > 0. ? 1. / frame_rate : 0., &dark_table[0], npixels);
+			camera.setGain(&gain_table[0], npixels);
+			camera.setCorrection(true);
+			counter.setCorrection(dark, gain);
+		}
+
+		Roi hw_roi;
+		camera.checkRoi(Roi(roi_x, 0, roi_width, nb_concat), hw_roi);
+		camera.setRoi(hw_roi);
+		counter.setRoi(hw_roi.getTopLeft().x, hw_roi.getSize().getWidth(), nb_concat);
+		cout << "reading roi " << hw_roi << endl;
+
+		HwBufferCtrlObj *buffer = camera.getBufferCtrlObj();
+		buffer->setFrameDim(FrameDim(hw_roi.getSize(), image_type));
+		buffer->setNbBuffers(nbuffers > 0 ? nbuffers : nframes);
+		buffer->registerFrameCallback(counter);
+
+		camera.setNbFrames(nframes);
+		if (nb_groups > 0) {
+			// LImA frames split evenly between the groups, a 1 us delay before each group
+			if (nframes % nb_groups != 0) {
+				cout << nframes << " frames cannot be split into " << nb_groups << " groups" << endl;
+				return 2;
+			}
+			const int group_delay = 50;
+			int per_frame = nb_concat * nb_accumulate;
+			Camera::XhTimingGroup group;
+			group.nframes = nframes / nb_groups * per_frame;
+			group.nscans = 1;
+			group.intTime = (frame_rate > 0.) ? (int) round(1. / frame_rate / 20e-9) : 1000;
+			camera.setDefaultTimingParameters(group.timingParams);
+			group.timingParams.groupDelay = group_delay;
+			vector<Camera::XhTimingGroup> groups(nb_groups, group);
+
+			double t0 = Timestamp::now();
+			for (int g = 0; g < nb_groups; g++)
+				camera.setTimingGroup(g, group.nframes, group.nscans, group.intTime, g == nb_groups - 1, group.timingParams);
+			double t1 = Timestamp::now();
+			camera.setTimingGroups(groups);
+			double t2 = Timestamp::now();
+			cout << nb_groups << " timing groups programmed in " << (t1 - t0) * 1e3 << " ms one by one, "
+					<< (t2 - t1) * 1e3 << " ms pipelined" << endl;
+			camera.setExpTime(0.);
+			counter.setFramePeriod(group.intTime * 20e-9 * per_frame, nframes / nb_groups, group_delay * 20e-9);
+		} else if (frame_rate > 0.) {
+			camera.setExpTime(1. / frame_rate);
+			// one scan per frame, the detector frames are timestamped every integration time
+			counter.setFramePeriod(round(1. / frame_rate / 20e-9) * 20e-9 * nb_concat * nb_accumulate);
+		}
+		double t0 = Timestamp::now();
+		hw.prepareAcq();
+		hw.startAcq();
+		StatusMonitor monitor(camera);
+		monitor.start();
+		if (!counter.waitFrames(nframes, 60.)) {
+			cout << "time-out waiting for " << nframes << " frames" << endl;
+			rc = 1;
+		}
+		double elapsed = double(Timestamp::now()) - t0;
+		monitor.stop();
+		hw.stopAcq();
+
+		double mbytes = (double) nframes * nb_concat * nb_accumulate * hw_roi.getSize().getWidth() * (readout16 ? sizeof(uint16_t) : sizeof(uint32_t)) / 1e6;
+		cout << nframes << " frames of " << hw_roi.getSize() << " pixels in " << elapsed << " s: "
+				<< nframes / elapsed << " frames/s, " << mbytes / elapsed << " MB/s, "
+				<< simulator.getNbStatusRequests() << " status requests" << endl;
+		cout << "first frame after " << (counter.getFirstFrameTime() - t0) * 1e3 << " ms" << endl;
+		double last_rate, mean_rate;
+		camera.getTransferRate(last_rate, mean_rate);
+		cout << "reads: " << mean_rate << " MB/s mean, " << last_rate << " MB/s last" << endl;
+		if (mean_rate <= 0.) {
+			cout << "no read throughput measured" << endl;
+			rc = 1;
+		}
+		cout << monitor.getNbQueries() << " monitoring queries, slowest " << monitor.getMaxLatency() * 1e3 << " ms" << endl;
+		if (counter.getBadTimestamps() != 0) {
+			cout << counter.getBadTimestamps() << " frames with a bad timestamp" << endl;
+			rc = 1;
+		}
+		if (counter.getErrors() != 0) {
+			cout << counter.getErrors() << " frames with bad data" << endl;
+			rc = 1;
+		}
+		if (nb_streams > 1) {
+			// end of run: drain the detector memory in one read
+			int width = hw_roi.getSize().getWidth();
+			int nb_hw_frames = nframes * nb_concat * nb_accumulate;
+			vector<uint32_t> block((size_t) nb_hw_frames * width);
+			double elapsed[2];
+			for (int k = 0; k < 2; k++) {
+				camera.setDataStreams(k == 0 ? 1 : nb_streams);
+				camera.set16BitReadout(false);
+				fill(block.begin(), block.end(), 0);
+				double t = Timestamp::now();
+				camera.readFrame(&block[0], 0, nb_hw_frames);
+				elapsed[k] = double(Timestamp::now()) - t;
+				int bad = 0;
+				for (int f = 0; !uninterleave && f < nb_hw_frames; f++) {
+					for (int i = 0; i < width; i++) {
+						if (block[(size_t) f * width + i] != Simulator::pixelValue(f, hw_roi.getTopLeft().x + i))
+							bad++;
+					}
+				}
+				if (bad != 0) {
+					cout << bad << " bad pixels draining on " << (k == 0 ? 1 : nb_streams) << " streams" << endl;
+					rc = 1;
+				}
+			}
+			double mbytes = block.size() * sizeof(uint32_t) / 1e6;
+			cout << "drained " << mbytes << " MB: " << mbytes / elapsed[0] << " MB/s on 1 stream, "
+					<< mbytes / elapsed[1] << " MB/s on " << nb_streams << " streams" << endl;
+		}
+	} catch (Exception& ex) {
+		DEB_ERROR() << "LIMA Exception: " << ex;
+		rc = 1;
+	}
+	return rc;
+}
@@ -0,0 +1,202 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+//
+// Checks parseStatus against the former stringstream parser and
+// compares the number of read-status replies per second each can decode.
+// Then polls the status of a camera on the loopback simulator and checks
+// that a poll does not allocate once the buffers have grown.
+//
+// usage: test_Xh_status_parser [iterations]
+//
+
+#include "lima/Timestamp.h"
+
+#include "XhStatusParser.h"
+#include "XhSimulator.h"
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <new>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+// allocations of this process, from any thread
+static long nb_allocs = 0;
+
+void* operator new(size_t size) {
+	__sync_fetch_and_add(&nb_allocs, 1);
+	void* ptr = malloc(size ? size : 1);
+	if (ptr == 0)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void* ptr) throw() {
+	free(ptr);
+}
+
+// the parser used by Camera::getStatus before it was made allocation free
+static void legacyParseStatus(const string& str, Camera::XhStatus& status) {
+	unsigned pos, pos2;
+	pos = str.find(":");
+	string state = str.substr (2, pos-2);
+	if (state.compare("Idle") == 0) {
+		status.state = Camera::XhStatus::Idle;
+	} else if (state.compare("Paused at frame") == 0) {
+		status.state = Camera::XhStatus::PausedAtFrame;
+	} else if (state.compare("Paused at group") == 0) {
+		status.state = Camera::XhStatus::PausedAtGroup;
+	} else if (state.compare("Paused at scan") == 0) {
+		status.state = Camera::XhStatus::PausedAtScan;
+	} else {
+		status.state = Camera::XhStatus::Running;
+	}
+	pos = str.find("=");
+	pos2 = str.find(",", pos);
+	std::stringstream ss1(str.substr(pos+1, pos2-pos));
+	ss1 >> status.group_num ;
+	pos = str.find("=", pos2);
+	pos2 = str.find(",", pos);
+	std::stringstream ss2(str.substr(pos+1, pos2-pos));
+	ss2 >> status.frame_num;
+	pos = str.find("=", pos2);
+	pos2 = str.find(",", pos);
+	std::stringstream ss3(str.substr(pos+1, pos2-pos));
+	ss3 >> status.scan_num;
+	pos = str.find("=", pos2);
+	pos2 = str.find(",", pos);
+	std::stringstream ss4(str.substr(pos+1, pos2-pos));
+	ss4 >> status.cycle;
+	pos = str.find("=", pos2);
+	std::stringstream ss5(str.substr(pos+1));
+	ss5 >> status.completed_frames;
+}
+
+static bool sameStatus(const Camera::XhStatus& a, const Camera::XhStatus& b) {
+	return a.state == b.state && a.group_num == b.group_num && a.frame_num == b.frame_num
+			&& a.scan_num == b.scan_num && a.cycle == b.cycle && a.completed_frames == b.completed_frames;
+}
+
+static const char* replies[] = {
+	"  Idle: group=0, frame=0, scan=0, cycle=0, completed=0",
+	"  Running: group=3, frame=1234, scan=7, cycle=2, completed=98765",
+	"  Paused at frame: group=1, frame=17, scan=0, cycle=0, completed=17",
+	"  Paused at group: group=12, frame=0, scan=3, cycle=1, completed=4000",
+	"  Paused at scan: group=0, frame=999, scan=42, cycle=0, completed=1000000",
+	"  Running: group=0, frame=2147483647, scan=0, cycle=0, completed=2147483647",
+};
+static const int nb_replies = sizeof(replies) / sizeof(replies[0]);
+
+/*
+ * Allocations per status poll of a camera connected to the simulator, which
+ * runs in a child process so that only the client is counted. Negative if
+ * the simulator could not be started.
+ */
+static double pollAllocations(int nb_polls) {
+	int fds[2];
+	if (pipe(fds) < 0)
+		return -1.;
+	pid_t pid = fork();
+	if (pid < 0)
+		return -1.;
+	if (pid == 0) {
+		close(fds[0]);
+		Simulator simulator;
+		simulator.start();
+		int port = simulator.getPort();
+		if (write(fds[1], &port, sizeof(port)) == sizeof(port))
+			pause();
+		_exit(0);
+	}
+	close(fds[1]);
+	int port;
+	bool ok = read(fds[0], &port, sizeof(port)) == sizeof(port);
+	close(fds[0]);
+	double per_poll = -1.;
+	if (ok) {
+		try {
+			Camera camera("localhost", port, "config");
+			Camera::XhStatus status;
+			for (int i = 0; i < 10; i++)
+				camera.getStatus(status);
+			long before = nb_allocs;
+			for (int i = 0; i < nb_polls; i++)
+				camera.getStatus(status);
+			per_poll = double(nb_allocs - before) / nb_polls;
+		} catch (Exception& ex) {
+			cout << "status poll failed: " << ex.getErrMsg() << endl;
+		}
+	}
+	kill(pid, SIGTERM);
+	waitpid(pid, 0, 0);
+	return per_poll;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = (argc > 1) ? atoi(argv[1]) : 1000000;
+	int rc = 0;
+	Camera::XhStatus s1, s2;
+	vector<string> strs(replies, replies + nb_replies);
+
+	for (int i = 0; i < nb_replies; i++) {
+		legacyParseStatus(strs[i], s1);
+		parseStatus(replies[i], s2);
+		if (!sameStatus(s1, s2)) {
+			cout << "mismatch parsing [" << replies[i] << "]" << endl;
+			rc = 1;
+		}
+	}
+
+	long sum = 0;
+	double t0 = Timestamp::now();
+	for (int i = 0; i < iterations; i++) {
+		legacyParseStatus(strs[i % nb_replies], s1);
+		sum += s1.completed_frames;
+	}
+	double t1 = Timestamp::now();
+	for (int i = 0; i < iterations; i++) {
+		parseStatus(strs[i % nb_replies].c_str(), s2);
+		sum -= s2.completed_frames;
+	}
+	double t2 = Timestamp::now();
+
+	cout << "stringstream parser: " << iterations / (t1 - t0) << " replies/s" << endl;
+	cout << "single pass parser:  " << iterations / (t2 - t1) << " replies/s" << endl;
+	if (sum != 0) {
+		cout << "checksum mismatch" << endl;
+		rc = 1;
+	}
+
+	double allocs = pollAllocations(1000);
+	cout << "allocations per status poll: " << allocs << endl;
+	if (allocs != 0.) {
+		cout << "status poll allocates" << endl;
+		rc = 1;
+	}
+	return rc;
+}
@@ -0,0 +1,259 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+//
+// Records an acquisition against the loopback da.server simulator in a
+// trace file, then replays the trace through Camera::AcqThread at full speed
+// and in real time, and checks that the same frames come out. Also checks
+// that a trace on a full device stops at the first write error.
+//
+// usage: test_Xh_trace [-n nframes] [-r frame_rate] [-S nstreams] [-p] [-M] [-k]
+//   -S  split large reads over nstreams data connections
+//   -p  use a persistent data connection
+//   -M  read the data through shared memory
+//   -k  keep the trace file
+//
+
+#include "lima/HwInterface.h"
+#include "lima/HwFrameCallback.h"
+#include "lima/Timestamp.h"
+
+#include "XhCamera.h"
+#include "XhInterface.h"
+#include "XhSimulator.h"
+#include "XhTrace.h"
+#include "lima/Debug.h"
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+DEB_GLOBAL(DebModTest);
+
+class FrameChecker : public HwFrameCallback {
+public:
+	FrameChecker(int npixels) : m_npixels(npixels), m_nb_frames(0), m_errors(0) {}
+
+	virtual bool newFrameReady(const HwFrameInfoType& frame_info) {
+		const uint32_t* frame = (const uint32_t*) frame_info.frame_ptr;
+		for (int i = 0; i < m_npixels; i++) {
+			if (frame[i] != Simulator::pixelValue(frame_info.acq_frame_nb, i)) {
+				m_errors++;
+				break;
+			}
+		}
+		AutoMutex aLock(m_cond.mutex());
+		m_nb_frames++;
+		m_cond.broadcast();
+		return true;
+	}
+
+	bool waitFrames(int nb_frames, double timeout) {
+		AutoMutex aLock(m_cond.mutex());
+		while (m_nb_frames < nb_frames) {
+			if (!m_cond.wait(timeout))
+				return false;
+		}
+		return true;
+	}
+
+	int getErrors() const { return m_errors; }
+
+private:
+	Cond m_cond;
+	int m_npixels;
+	int m_nb_frames;
+	int m_errors;
+};
+
+struct Options {
+	int nframes;
+	double frame_rate;
+	int nb_streams;
+	bool persistent;
+	bool shared_memory;
+};
+
+/*
+ * Acquire nframes from the server on port, recording a trace if filename is
+ * not empty. Returns the acquisition time, negative on error.
+ */
+static double acquire(int port, const Options& opt, const string& filename) {
+	const int npixels = 1024;
+	Camera camera("localhost", port, "config");
+	Interface hw(camera);
+	FrameChecker checker(npixels);
+	camera.setPersistentDataConnection(opt.persistent);
+	camera.setSharedMemoryData(opt.shared_memory);
+	camera.setDataStreams(opt.nb_streams);
+	camera.setReadChunkSize(0, DEFAULT_CHUNK_BYTES);
+	if (!filename.empty())
+		camera.startTrace(filename);
+
+	HwBufferCtrlObj *buffer = camera.getBufferCtrlObj();
+	buffer->setFrameDim(FrameDim(Size(npixels, 1), Bpp32));
+	buffer->setNbBuffers(opt.nframes);
+	buffer->registerFrameCallback(checker);
+	camera.setNbFrames(opt.nframes);
+	if (opt.frame_rate > 0.)
+		camera.setExpTime(1. / opt.frame_rate);
+
+	double t0 = Timestamp::now();
+	hw.prepareAcq();
+	hw.startAcq();
+	bool ok = checker.waitFrames(opt.nframes, 60.);
+	double elapsed = double(Timestamp::now()) - t0;
+	hw.stopAcq();
+	if (!filename.empty())
+		camera.stopTrace();
+	if (!ok) {
+		cout << "time-out waiting for " << opt.nframes << " frames" << endl;
+		return -1.;
+	}
+	if (checker.getErrors() != 0) {
+		cout << checker.getErrors() << " frames with bad data" << endl;
+		return -1.;
+	}
+	return elapsed;
+}
+
+/*
+ * Trace on /dev/full: the first record which reaches the device fails, and
+ * only the complete records written are counted.
+ */
+static int checkWriteError() {
+	if (access("/dev/full", W_OK) != 0)
+		return 0;
+	XhTraceWriter writer("/dev/full");
+	vector<char> block(4 << 20);
+	writer.record(XhTraceRecord::XhTraceData, 0, &block[0], block.size());
+	writer.record(XhTraceRecord::XhTraceData, 0, &block[0], block.size());
+	cout << "full device: " << writer.getNbBytes() << " bytes traced" << (writer.isFailed() ? ", stopped" : "") << endl;
+	if (!writer.isFailed() || writer.getNbBytes() != (long long) sizeof(XhTraceHeader)) {
+		cout << "write error not detected" << endl;
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	DEB_GLOBAL_FUNCT();
+	Options opt;
+	opt.nframes = 1000;
+	opt.frame_rate = 10000.;
+	opt.nb_streams = 1;
+	opt.persistent = false;
+	opt.shared_memory = false;
+	bool keep = false;
+	int rc = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:r:S:pMk")) != -1) {
+		switch (c) {
+		case 'n': opt.nframes = atoi(optarg); break;
+		case 'r': opt.frame_rate = atof(optarg); break;
+		case 'S': opt.nb_streams = atoi(optarg); break;
+		case 'p': opt.persistent = true; break;
+		case 'M': opt.shared_memory = true; break;
+		case 'k': keep = true; break;
+		default:
+			cerr << "usage: " << argv[0] << " [-n nframes] [-r frame_rate] [-S nstreams] [-p] [-M] [-k]" << endl;
+			return 2;
+		}
+	}
+	stringstream filename;
+	filename << "/tmp/xh_trace_" << getpid() << ".xht";
+
+	try {
+		rc |= checkWriteError();
+		double recorded;
+		{
+			Simulator simulator;
+			simulator.setFrameRate(opt.frame_rate);
+			simulator.setMaxFrames(opt.nframes);
+			simulator.start();
+			recorded = acquire(simulator.getPort(), opt, filename.str());
+		}
+		if (recorded < 0.)
+			return 1;
+
+		// what the trace holds
+		XhTraceReader reader(filename.str());
+		XhTraceRecord record;
+		vector<char> payload;
+		long long counts[XhTraceRecord::XhTraceData + 1] = {0}, data_bytes = 0;
+		while (reader.next(record, payload)) {
+			if (record.type >= XhTraceRecord::XhTraceConnect && record.type <= XhTraceRecord::XhTraceData)
+				counts[record.type]++;
+			if (record.type == XhTraceRecord::XhTraceData)
+				data_bytes += payload.size();
+		}
+		cout << "recorded in " << recorded << " s: " << counts[XhTraceRecord::XhTraceConnect] << " connections, "
+				<< counts[XhTraceRecord::XhTraceCommand] << " commands, " << counts[XhTraceRecord::XhTraceServer] << " responses, "
+				<< counts[XhTraceRecord::XhTraceData] << " blocks" << endl;
+		if (counts[XhTraceRecord::XhTraceConnect] < opt.nb_streams || counts[XhTraceRecord::XhTraceCommand] == 0
+				|| counts[XhTraceRecord::XhTraceServer] == 0) {
+			cout << "incomplete trace" << endl;
+			rc = 1;
+		}
+		if (data_bytes != (long long) (opt.nframes * 1024 * sizeof(uint32_t))) {
+			cout << data_bytes << " data bytes traced, expected " << opt.nframes * 1024 * sizeof(uint32_t) << endl;
+			rc = 1;
+		}
+
+		for (int real_time = 0; real_time < 2; real_time++) {
+			// the frame rate is only used by commands not in the trace
+			Simulator simulator;
+			simulator.setFrameRate(0.);
+			simulator.loadTrace(filename.str(), real_time);
+			simulator.start();
+			double elapsed = acquire(simulator.getPort(), opt, "");
+			const char* mode = real_time ? "real time" : "full speed";
+			if (elapsed < 0.) {
+				cout << "replay " << mode << " failed" << endl;
+				rc = 1;
+				continue;
+			}
+			cout << "replayed " << simulator.getNbReplayed() << " commands " << mode << " in " << elapsed << " s" << endl;
+			if (simulator.getNbReplayed() == 0) {
+				cout << "nothing replayed from the trace" << endl;
+				rc = 1;
+			}
+			if (real_time && elapsed < 0.5 * recorded) {
+				cout << "real time replay faster than recorded" << endl;
+				rc = 1;
+			}
+		}
+	} catch (Exception& ex) {
+		DEB_ERROR() << "LIMA Exception: " << ex;
+		rc = 1;
+	}
+	if (!keep)
+		unlink(filename.str().c_str());
+	return rc;
+}
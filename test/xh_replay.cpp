@@ -0,0 +1,73 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+//
+// Serves a trace recorded with Camera::startTrace() as da.server, e.g. to
+// replay a beamline session through the python binding or the tango server.
+// Commands not in the trace are simulated.
+//
+// usage: xh_replay [-t] [-p port] trace_file
+//   -t  reply after the recorded latencies, otherwise at once
+//
+
+#include "XhSimulator.h"
+#include "lima/Exceptions.h"
+#include <iostream>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+int main(int argc, char *argv[])
+{
+	int port = 1972;
+	bool real_time = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "tp:")) != -1) {
+		switch (opt) {
+		case 't': real_time = true; break;
+		case 'p': port = atoi(optarg); break;
+		default:
+			cerr << "usage: " << argv[0] << " [-t] [-p port] trace_file" << endl;
+			return 2;
+		}
+	}
+	if (optind != argc - 1) {
+		cerr << "usage: " << argv[0] << " [-t] [-p port] trace_file" << endl;
+		return 2;
+	}
+
+	try {
+		Simulator simulator(port);
+		simulator.loadTrace(argv[optind], real_time);
+		simulator.start();
+		cout << "replaying " << argv[optind] << " on port " << simulator.getPort() << endl;
+		for (;;)
+			pause();
+	} catch (Exception& ex) {
+		cerr << "LIMA Exception: " << ex << endl;
+		return 1;
+	}
+	return 0;
+}
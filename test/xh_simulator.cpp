@@ -0,0 +1,57 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2013
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+//
+// Stand-alone da.server simulator, e.g. for the python binding or the
+// tango server.
+//
+// usage: xh_simulator [port] [npixels] [frame_rate]
+//
+
+#include "XhSimulator.h"
+#include "lima/Exceptions.h"
+#include <iostream>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+using namespace lima;
+using namespace lima::Xh;
+
+int main(int argc, char *argv[])
+{
+	int port = (argc > 1) ? atoi(argv[1]) : 1972;
+	int npixels = (argc > 2) ? atoi(argv[2]) : 1024;
+	double frame_rate = (argc > 3) ? atof(argv[3]) : 1000.;
+
+	try {
+		Simulator simulator(port, npixels);
+		simulator.setFrameRate(frame_rate);
+		simulator.start();
+		cout << "xh simulator listening on port " << simulator.getPort() << endl;
+		for (;;)
+			pause();
+	} catch (Exception& ex) {
+		cerr << "LIMA Exception: " << ex << endl;
+		return 1;
+	}
+	return 0;
+}